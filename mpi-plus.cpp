@@ -1,5 +1,23 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <numeric>
+#include <tuple>
+#include <utility>
 #include <vector>
 #include <mpi.h>
 
@@ -10,211 +28,327 @@
 namespace mpi {
     class Session;
     class Communicator;
+    class Datatype;
     class Request;
+    class RequestSet;
     class Status;
+    class TagSpace;
+    class TuningTable;
+    enum class Algorithm;
+    enum class WaitPolicy;
 
     inline Communicator comm_world();
+    inline TuningTable& tuning();
+    inline std::string to_string(Algorithm algorithm);
+    inline WaitPolicy& wait_policy();
+    inline std::string to_string(WaitPolicy policy);
     constexpr int any_tag = MPI_ANY_TAG;
     constexpr int any_source = MPI_ANY_SOURCE;
 
     namespace detail {
-        // template <typename T> inline int make_datatype_for(const T&);
+        template <typename T> struct builtin_datatype;
+        template <typename Op> struct builtin_op;
+        template <typename Op> struct scalar_of;
+        template <typename T, typename Op> struct reduce_kernel;
+        template <typename T, typename Op> struct user_op;
+        template <typename T> struct binned;
+        constexpr int collective_tag = 32767;
+        constexpr int sparse_tag = 32764;
+        constexpr int neighbor_tag = 32763;
+        constexpr int tag_space_begin = 16384;
+        constexpr int tag_space_end = neighbor_tag;
+        template <typename T> inline MPI_Datatype datatype();
+        template <typename T, typename Op> inline MPI_Op make_op(const Op& op);
+        template <typename T, typename Compare> std::vector<T> sample_sort(const Communicator&, std::vector<T>, Compare, bool);
+        template <typename Test> void wait_until(Test test, WaitPolicy policy);
     }
+    template <typename T> struct min;
+    template <typename T> struct max;
+    template <typename Op, typename S = typename detail::scalar_of<Op>::type> struct componentwise;
+    template <typename T> struct compensated;
+    template <typename T> struct compensated_plus;
+    template <typename T> struct reproducible_plus;
+
     namespace ext {
         class log;
+        template <typename T> class dist_vector;
+        template <typename T> class fused_reduction;
+        template <typename T> class dist_csr;
+        class fft_kernel;
+        class fft3d;
+        class sfc_partition;
+        enum class sfc_curve;
+        class histogram;
+        class quantile_sketch;
+        class philox;
+        class load_balancer;
+        class amr;
+        class octree;
+        class distributed_octree;
+        class graph;
+        class mailbox;
+        class channel;
+        template <typename T, typename Destination> std::size_t migrate(const Communicator& comm, std::vector<T>& particles, Destination destination, const std::vector<int>& neighbors = {});
+        template <typename Destination, typename... Fields> std::size_t migrate(const Communicator& comm, std::tuple<std::vector<Fields>&...> fields, Destination destination, const std::vector<int>& neighbors = {});
+        template <typename T, typename Compare = std::less<T>> std::vector<T> parallel_sort(const Communicator& comm, std::vector<T> values, Compare compare = Compare());
+        template <typename T, typename Compare = std::less<T>> std::vector<T> parallel_stable_sort(const Communicator& comm, std::vector<T> values, Compare compare = Compare());
     }
 }
 
-// template <> int mpi::detail::make_datatype_for<char>  (const char&)   { return MPI_CHAR; }
-// template <> int mpi::detail::make_datatype_for<int>   (const int&)    { return MPI_INTEGER; }
-// template <> int mpi::detail::make_datatype_for<float> (const float&)  { return MPI_FLOAT; }
-// template <> int mpi::detail::make_datatype_for<double>(const double&) { return MPI_DOUBLE; }
-
 
 
 
 // ============================================================================
-class mpi::Session
+/**
+ * Reduction operators that have no counterpart in <functional>. Any binary
+ * functor can be passed to the Communicator's reduction methods; std::plus,
+ * std::multiplies, the bitwise and logical functors, and these two are
+ * mapped onto the native MPI operation when the data type allows it.
+ */
+template <typename T>
+struct mpi::min
 {
-public:
-    Session()
-    {
-        MPI_Init(0, nullptr);
-    }
-    ~Session()
-    {
-        MPI_Finalize();
-    }
+    static constexpr bool commutative = true;
+    T operator()(const T& a, const T& b) const { return b < a ? b : a; }
+};
+
+template <typename T>
+struct mpi::max
+{
+    static constexpr bool commutative = true;
+    T operator()(const T& a, const T& b) const { return a < b ? b : a; }
 };
 
 
 
 
 // ============================================================================
+template <typename T> struct mpi::detail::builtin_datatype { static constexpr bool value = false; };
+template <> struct mpi::detail::builtin_datatype<char>               { static constexpr bool value = true; static MPI_Datatype get() { return MPI_CHAR; } };
+template <> struct mpi::detail::builtin_datatype<signed char>        { static constexpr bool value = true; static MPI_Datatype get() { return MPI_SIGNED_CHAR; } };
+template <> struct mpi::detail::builtin_datatype<unsigned char>      { static constexpr bool value = true; static MPI_Datatype get() { return MPI_UNSIGNED_CHAR; } };
+template <> struct mpi::detail::builtin_datatype<short>              { static constexpr bool value = true; static MPI_Datatype get() { return MPI_SHORT; } };
+template <> struct mpi::detail::builtin_datatype<unsigned short>     { static constexpr bool value = true; static MPI_Datatype get() { return MPI_UNSIGNED_SHORT; } };
+template <> struct mpi::detail::builtin_datatype<int>                { static constexpr bool value = true; static MPI_Datatype get() { return MPI_INT; } };
+template <> struct mpi::detail::builtin_datatype<unsigned>           { static constexpr bool value = true; static MPI_Datatype get() { return MPI_UNSIGNED; } };
+template <> struct mpi::detail::builtin_datatype<long>               { static constexpr bool value = true; static MPI_Datatype get() { return MPI_LONG; } };
+template <> struct mpi::detail::builtin_datatype<unsigned long>      { static constexpr bool value = true; static MPI_Datatype get() { return MPI_UNSIGNED_LONG; } };
+template <> struct mpi::detail::builtin_datatype<long long>          { static constexpr bool value = true; static MPI_Datatype get() { return MPI_LONG_LONG; } };
+template <> struct mpi::detail::builtin_datatype<unsigned long long> { static constexpr bool value = true; static MPI_Datatype get() { return MPI_UNSIGNED_LONG_LONG; } };
+template <> struct mpi::detail::builtin_datatype<float>              { static constexpr bool value = true; static MPI_Datatype get() { return MPI_FLOAT; } };
+template <> struct mpi::detail::builtin_datatype<double>             { static constexpr bool value = true; static MPI_Datatype get() { return MPI_DOUBLE; } };
+template <> struct mpi::detail::builtin_datatype<long double>        { static constexpr bool value = true; static MPI_Datatype get() { return MPI_LONG_DOUBLE; } };
+template <> struct mpi::detail::builtin_datatype<bool>               { static constexpr bool value = true; static MPI_Datatype get() { return MPI_CXX_BOOL; } };
+template <> struct mpi::detail::builtin_datatype<std::complex<float>>  { static constexpr bool value = true; static MPI_Datatype get() { return MPI_CXX_FLOAT_COMPLEX; } };
+template <> struct mpi::detail::builtin_datatype<std::complex<double>> { static constexpr bool value = true; static MPI_Datatype get() { return MPI_CXX_DOUBLE_COMPLEX; } };
+
+template <typename Op> struct mpi::detail::builtin_op { static constexpr bool value = false; };
+template <typename T> struct mpi::detail::builtin_op<std::plus<T>>        { static constexpr bool value = true; static MPI_Op get() { return MPI_SUM; } };
+template <typename T> struct mpi::detail::builtin_op<std::multiplies<T>>  { static constexpr bool value = true; static MPI_Op get() { return MPI_PROD; } };
+template <typename T> struct mpi::detail::builtin_op<mpi::min<T>>         { static constexpr bool value = true; static MPI_Op get() { return MPI_MIN; } };
+template <typename T> struct mpi::detail::builtin_op<mpi::max<T>>         { static constexpr bool value = true; static MPI_Op get() { return MPI_MAX; } };
+template <typename T> struct mpi::detail::builtin_op<std::logical_and<T>> { static constexpr bool value = true; static MPI_Op get() { return MPI_LAND; } };
+template <typename T> struct mpi::detail::builtin_op<std::logical_or<T>>  { static constexpr bool value = true; static MPI_Op get() { return MPI_LOR; } };
+template <typename T> struct mpi::detail::builtin_op<std::bit_and<T>>     { static constexpr bool value = true; static MPI_Op get() { return MPI_BAND; } };
+template <typename T> struct mpi::detail::builtin_op<std::bit_or<T>>      { static constexpr bool value = true; static MPI_Op get() { return MPI_BOR; } };
+template <typename T> struct mpi::detail::builtin_op<std::bit_xor<T>>     { static constexpr bool value = true; static MPI_Op get() { return MPI_BXOR; } };
+
+
+
+
+// ============================================================================
+namespace mpi { namespace detail {
+
+
 /**
- * A thin RAII wrapper around the MPI_Request struct. This is a movable, but
- * non-copyable object. Keep it around on the stack in order to check on the
- * status of a non-blocking communication and retrieve the message content.
- * Requests are cancelled and deallocated (if necessary) when they go out of
- * scope.
+ * Return the MPI datatype for T: the native one for built-in arithmetic
+ * types, and otherwise an opaque contiguous block of sizeof(T) bytes. The
+ * derived type is committed once and reused.
  */
-class mpi::Request
+template <typename T>
+MPI_Datatype datatype_for(std::true_type)
 {
-public:
+    return builtin_datatype<T>::get();
+}
 
+template <typename T>
+MPI_Datatype datatype_for(std::false_type)
+{
+    static MPI_Datatype type = []
+    {
+        MPI_Datatype t;
+        MPI_Type_contiguous(sizeof(T), MPI_BYTE, &t);
+        MPI_Type_commit(&t);
+        return t;
+    }();
+    return type;
+}
 
-    /**
-     * Default constructor, creates a null request.
-     */
-    Request() {}
+template <typename T>
+MPI_Datatype datatype()
+{
+    return datatype_for<T>(std::integral_constant<bool, builtin_datatype<T>::value>());
+}
 
 
-    /**
-     * Request is a unique object, no copy's are permitted.
-     */
-    Request(const Request& other) = delete;
+/**
+ * Evaluates to true if the functor declares a static member
+ * `commutative = true`. User-defined operators are assumed to be
+ * non-commutative otherwise, so MPI will preserve rank order.
+ */
+template <typename Op, typename = void>
+struct is_commutative : std::false_type {};
 
+template <typename Op>
+struct is_commutative<Op, decltype(void(Op::commutative))> : std::integral_constant<bool, Op::commutative> {};
 
-    /**
-     * Move constructor. Steals ownership of the other.
-     */
-    Request(Request&& other)
-    {
-        buffer = std::move(other.buffer);
-        request = other.request;
-        other.request = MPI_REQUEST_NULL;
-    }
 
+/**
+ * Evaluates to true if the functor carries no state, so that any two
+ * instances of it are interchangeable. Only such functors may be bound to
+ * persistent reductions (see detail::user_op).
+ */
+template <typename Op>
+struct is_stateless : std::is_empty<Op> {};
 
-    /**
-     * Destructor. Cancels the request if one is pending. For this reason, the
-     * request returned by non-blocking communications must be retained on the
-     * stack somewhere in order for the operation not to be cancelled.
-     */
-    ~Request()
-    {
-        cancel();
-    }
+template <typename Op, typename S>
+struct is_stateless<componentwise<Op, S>> : is_stateless<Op> {};
 
 
-    /**
-     * Copy assignment is not permitted.
-     */
-    Request& operator=(const Request& other) = delete;
+/**
+ * Evaluates to true for mpi::reproducible_plus, which only the all_reduce
+ * and all_sum overloads written for it can honor.
+ */
+template <typename Op>
+struct is_reproducible : std::false_type {};
 
+template <typename T>
+struct is_reproducible<reproducible_plus<T>> : std::true_type {};
 
-    /**
-     * Move assignment. Cancels the current request (if one is pending) and
-     * steals ownership of the other.
-     */
-    Request& operator=(Request&& other)
-    {
-        cancel();
-        buffer = std::move(other.buffer);
-        request = other.request;
-        other.request = MPI_REQUEST_NULL;
-        return *this;        
-    }
+}}
 
 
-    /**
-     * Cancel this request and reset its state to null.
-     */
-    void cancel()
-    {
-        if (! is_null())
-        {
-            MPI_Cancel(&request);
-            MPI_Request_free(&request);
-        }
-    }
 
 
-    /**
-     * Return true if this request is null.
-     */
-    bool is_null() const
-    {
-        return request == MPI_REQUEST_NULL;
-    }
+// ============================================================================
+template <template <typename> class Op, typename S>
+struct mpi::detail::scalar_of<Op<S>> { using type = S; };
 
 
-    /**
-     * Check to see whether the request has completed. If it has, this method
-     * returns true and resets the request to a null state. If this method
-     * returns true and the request was for a non-blocking receive operation,
-     * the get() method can be called to retrieve the message content.
-     */
-    // bool test()
-    // {
-    //     int flag;
-    //     MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
-    //     return flag;
-    // }
+/**
+ * Applies a scalar operator to every component of a struct (or array) of
+ * scalars, e.g. the component-wise minimum of 3-vectors:
+ *
+ *              auto lo = comm.all_reduce(points, mpi::componentwise<mpi::min<double>>());
+ *
+ * When used in a reduction, the MPI user function for this operator treats
+ * the buffers as flat arrays of scalars, so the kernel is a single
+ * unit-stride loop that the compiler vectorizes. The data type must consist
+ * only of S's.
+ */
+template <typename Op, typename S>
+struct mpi::componentwise
+{
+    static constexpr bool commutative = detail::is_commutative<Op>::value;
 
+    componentwise(Op op=Op()) : op(op) {}
 
-    /**
-     * Check to see whether the request has completed. Like above, except
-     * this const method will not free the request if it has completed.
-     */
-    bool is_ready() const
+    template <typename T>
+    T operator()(const T& a, const T& b) const
     {
-        int flag;
-        MPI_Request_get_status(request, &flag, MPI_STATUS_IGNORE);
-        return flag;
-    }
+        static_assert(sizeof(T) % sizeof(S) == 0, "type is not a whole number of scalars");
 
+        auto res = b;
+        apply(reinterpret_cast<const S*>(&a), reinterpret_cast<S*>(&res), sizeof(T) / sizeof(S));
+        return res;
+    }
 
-    /**
-     * Block until the request is fulfilled. After this method returns, the
-     * get() method can be called to retrieve the message content.
-     */
-    void wait()
+    void apply(const S* __restrict a, S* __restrict b, std::size_t n) const
     {
-        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            b[i] = op(a[i], b[i]);
+        }
     }
 
+    Op op;
+};
 
-    /**
-     * Block until the message is completed. Then deallocate the request, and
-     * return the message content.
-     */
-    const std::string& get()
-    {
-        wait();
-        // MPI_Wait(&request, MPI_STATUS_IGNORE);
-        return buffer;
-    }
 
 
-    /**
-     * Return the message content formatted as the given data type.
-     */
-    template <typename T>
-    T get()
+
+// ============================================================================
+/**
+ * A floating point sum carrying its own rounding error, for accurate
+ * (Kahan-style) summation. Accumulate locally with +=, then reduce with
+ * compensated_plus:
+ *
+ *              auto acc = mpi::compensated<double>();
+ *              for (auto x : data) acc += x;
+ *              auto total = comm.all_reduce(acc, mpi::compensated_plus<double>()).value();
+ *
+ * Both operations are branch-free (Knuth's two-sum), so that reductions over
+ * arrays of these are vectorized. Don't compile with -ffast-math, which
+ * optimizes the error term away.
+ */
+template <typename T>
+struct mpi::compensated
+{
+    compensated& operator+=(T x)
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        auto s = sum + x;
+        auto bp = s - sum;
+        error += (sum - (s - bp)) + (x - bp);
+        sum = s;
+        return *this;
+    }
 
-        if (buffer.size() != sizeof(T))
-        {
-            throw std::logic_error("received message has wrong size for data type");   
-        }
+    T value() const
+    {
+        return sum + error;
+    }
 
-        wait();
+    T sum = T();
+    T error = T();
+};
 
-        // MPI_Wait(&request, MPI_STATUS_IGNORE);
+template <typename T>
+struct mpi::compensated_plus
+{
+    static constexpr bool commutative = true;
 
-        auto value = T();
-        std::memcpy(&value, &buffer[0], sizeof(T));
-        return value;
+    compensated<T> operator()(const compensated<T>& a, const compensated<T>& b) const
+    {
+        auto res = compensated<T>();
+        auto bp = (res.sum = a.sum + b.sum) - a.sum;
+        res.error = a.error + b.error + (a.sum - (res.sum - bp)) + (b.sum - bp);
+        return res;
     }
+};
 
 
-private:
-    // ========================================================================
-    friend class Communicator;
-    MPI_Request request = MPI_REQUEST_NULL;
-    std::string buffer;
+
+
+// ============================================================================
+/**
+ * Selects the reproducible summation mode of the reduction API. Passed in
+ * place of std::plus, the sum is computed exactly in fixed point (see
+ * detail::binned) so that the result is bitwise identical no matter how the
+ * values are distributed over ranks, or in what order they are combined:
+ *
+ *              auto total = comm.all_sum(local_values, mpi::reproducible_plus<double>());
+ *              auto field = comm.all_reduce(local_field, mpi::reproducible_plus<double>());
+ *
+ * It costs an extra max-reduction, and K integer words per value on the
+ * wire instead of one float. Only the all_reduce and all_sum overloads taking
+ * it are reproducible; passing it to reduce, scan, exscan, all_reduce_init,
+ * or an all_reduce with an explicit algorithm is a compile-time error.
+ */
+template <typename T>
+struct mpi::reproducible_plus
+{
+    static_assert(std::is_floating_point<T>::value, "reproducible sums are for floating point types");
+    T operator()(const T& a, const T& b) const { return a + b; }
 };
 
 
@@ -222,680 +356,9733 @@ private:
 
 // ============================================================================
 /**
-    This is a simple wrapper class around the MPI_Status struct.
-*/
-class mpi::Status
+ * Fixed-point accumulation of floating point values, relative to an exponent
+ * e such that |x| < 2^e for every value that will be added. Each value is
+ * split into K signed 32-bit digits at fixed binary positions below 2^e and
+ * the digits are added into 64-bit integers. Integer addition is exact and
+ * associative, so the digit sums don't depend on the summation order, and
+ * neither does the value recovered from them. Bits of a value lying more than
+ * 32 K positions below 2^e are truncated, which is also order-independent.
+ */
+template <typename T>
+struct mpi::detail::binned
 {
-public:
+    static constexpr int limbs = 3;
+    static constexpr int digit_bits = 32;
+    static constexpr std::int64_t normalize_interval = std::int64_t(1) << 30;
 
 
     /**
-     * Default-constructed status has is_null() == true.
+     * The scale factors 2^-w and 2^w for the position w of each digit, given
+     * the exponent. Digits positioned below the smallest subnormal are
+     * dropped.
      */
-    Status() {}
+    struct frame
+    {
+        frame(int e) : e(e)
+        {
+            for (int k = 0; k < limbs; ++k)
+            {
+                up[k] = pow2(digit_bits * (k + 1) - e);
+                down[k] = pow2(e - digit_bits * (k + 1));
+
+                if (std::isfinite(up[k]) && down[k] != T(0))
+                {
+                    used = k + 1;
+                }
+            }
+        }
+        int e;
+        int used = 0;
+        T up[limbs];
+        T down[limbs];
+    };
 
 
     /**
-     * Check for null-status. Null status is returned e.g. when iprobe does
-     * not find any incoming messages:
-     *
-     *              if (comm.iprobe().is_null()) { }
-     * 
+     * Return 2^n from a table, which is a lot cheaper than std::ldexp.
+     * Underflows to zero and overflows to infinity.
      */
-    bool is_null() const
+    static T pow2(int n)
     {
-        return null;
+        using limits = std::numeric_limits<T>;
+        static const int lo = limits::min_exponent - limits::digits;
+        static const int hi = limits::max_exponent;
+        static const std::vector<T> table = []
+        {
+            auto t = std::vector<T>(hi - lo);
+
+            for (int i = lo; i < hi; ++i)
+            {
+                t[i - lo] = std::ldexp(T(1), i);
+            }
+            return t;
+        }();
+
+        if (n < lo) return T(0);
+        if (n >= hi) return limits::infinity();
+        return table[n - lo];
     }
 
 
     /**
-     * Return the number of bytes in the message described by this status.
+     * Return the exponent to use for values bounded by the given magnitude.
      */
-    int count()
+    static int exponent(T max_magnitude)
     {
-        if (is_null())
-        {
-            return 0;
-        }
-
-        int count;
-        MPI_Get_count(&status, MPI_CHAR, &count);
-        return count;
+        int e = 0;
+        std::frexp(max_magnitude, &e);
+        return e;
     }
 
 
     /**
-     * Get the rank of the message's source.
+     * Split x into digits and add them into the given limbs. Scaling by a
+     * power of two is exact, and so is the truncating conversion of each
+     * (less than 2^32) digit, and removing it from x.
      */
-    int source() const
+    static void deposit(T x, const frame& f, std::int64_t* limb)
     {
-        if (is_null())
+        for (int k = 0; k < f.used; ++k)
         {
-            return -1;
+            auto d = std::int64_t(x * f.up[k]);
+            limb[k] += d;
+            x -= T(d) * f.down[k];
         }
-        return status.MPI_SOURCE;
     }
 
 
     /**
-     * Get the tag of the message.
+     * Propagate carries so that all but the leading limb are within a single
+     * digit. This keeps the 64-bit words from overflowing when accumulating
+     * many values, or summing limbs from many ranks.
      */
-    int tag() const
+    static void normalize(std::int64_t* limb)
     {
-        if (is_null())
+        for (int k = limbs - 1; k > 0; --k)
         {
-            return -1;
+            auto carry = limb[k] >> digit_bits;
+            limb[k] -= carry * (std::int64_t(1) << digit_bits);
+            limb[k - 1] += carry;
         }
-        return status.MPI_TAG;
     }
 
 
-private:
-    // ========================================================================
-    friend class Communicator;
-    Status(MPI_Status status) : status(status), null(false) {}
-    MPI_Status status;
-    bool null = true;
+    /**
+     * Convert the limbs back into a floating point value.
+     */
+    static T collect(std::int64_t* limb, int e)
+    {
+        normalize(limb);
+
+        auto res = T();
+
+        for (int k = limbs - 1; k >= 0; --k)
+        {
+            res += T(limb[k]) * pow2(e - digit_bits * (k + 1));
+        }
+        return res;
+    }
 };
 
 
 
 
 // ============================================================================
-class mpi::Communicator
+/**
+ * The loop that applies an operator element-wise, b[i] = op(a[i], b[i]), on
+ * behalf of MPI. The default treats the elements one at a time; operators
+ * over compound types can specialize this to expose a flat loop over
+ * scalars to the vectorizer.
+ */
+template <typename T, typename Op>
+struct mpi::detail::reduce_kernel
 {
-public:
-
+    static void apply(const T* __restrict a, T* __restrict b, std::size_t n, const Op& op)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            b[i] = op(a[i], b[i]);
+        }
+    }
+};
 
-    /**
-     * Default constructor, gives you MPI_COMM_NULL.
-     */
-    Communicator()
+template <typename T, typename Op, typename S>
+struct mpi::detail::reduce_kernel<T, mpi::componentwise<Op, S>>
+{
+    static void apply(const T* a, T* b, std::size_t n, const componentwise<Op, S>& op)
     {
+        static_assert(sizeof(T) % sizeof(S) == 0, "type is not a whole number of scalars");
+        op.apply(reinterpret_cast<const S*>(a), reinterpret_cast<S*>(b), n * (sizeof(T) / sizeof(S)));
     }
+};
 
 
-    /**
-     * Copy constructor, duplicates the communicator and respects RAII.
-     */
-    Communicator(const Communicator& other)
+
+
+// ============================================================================
+/**
+ * Adapts a binary functor to an MPI_Op. The MPI_Op is created once per
+ * (T, Op) pair and the functor is stored alongside it, so lambdas with
+ * captures work too. The stored functor is replaced on every call, so
+ * overlapping non-blocking reductions must not rely on different captured
+ * state of the same lambda type. Persistent reductions would outlive many
+ * such calls, so they only accept stateless functors.
+ */
+template <typename T, typename Op>
+struct mpi::detail::user_op
+{
+    static void apply(void* invec, void* inoutvec, int* len, MPI_Datatype*)
     {
-        if (! other.is_null())
-        {
-            MPI_Comm_dup(other.comm, &comm);
-        }
+        reduce_kernel<T, Op>::apply(static_cast<const T*>(invec), static_cast<T*>(inoutvec), *len, *function());
     }
 
+    static std::unique_ptr<Op>& function()
+    {
+        static std::unique_ptr<Op> f;
+        return f;
+    }
 
-    /**
-     * Move constructor, sets the other comm back to null.
-     */
-    Communicator(Communicator&& other)
+    static MPI_Op get(const Op& op)
     {
-        comm = other.comm;
-        other.comm = MPI_COMM_NULL;
+        function().reset(new Op(op));
+
+        static MPI_Op res = []
+        {
+            MPI_Op o;
+            MPI_Op_create(apply, is_commutative<Op>::value, &o);
+            return o;
+        }();
+        return res;
     }
+};
+
+
+
+
+// ============================================================================
+namespace mpi { namespace detail {
+
+template <typename T, typename Op>
+MPI_Op make_op_for(const Op&, std::true_type)
+{
+    return builtin_op<Op>::get();
+}
+
+template <typename T, typename Op>
+MPI_Op make_op_for(const Op& op, std::false_type)
+{
+    return user_op<T, Op>::get(op);
+}
+
+
+/**
+ * Return an MPI_Op implementing the given functor on values of type T. The
+ * native operation is used when both the functor and the data type are
+ * known to MPI.
+ */
+template <typename T, typename Op>
+MPI_Op make_op(const Op& op)
+{
+    static_assert(! is_reproducible<Op>::value, "reproducible_plus is only supported by all_reduce and all_sum");
+    return make_op_for<T>(op, std::integral_constant<bool, builtin_op<Op>::value && builtin_datatype<T>::value>());
+}
+
+}}
+
+
+
+
+// ============================================================================
+class mpi::Session
+{
+public:
+    Session();
+    ~Session();
+};
+
+
+
+
+// ============================================================================
+/**
+ * RAII wrapper around a derived MPI datatype. Describes the layout of items
+ * in memory, so that MPI can send and receive strided data in place. This is
+ * a movable, but non-copyable object, and the type is freed when it goes out
+ * of scope (MPI keeps it alive for communications still using it).
+ */
+class mpi::Datatype
+{
+public:
 
 
     /**
-     * Destructor, closes the communicator unless it was null.
+     * Default constructor, creates a null datatype.
      */
-    ~Communicator()
-    {
-        close();
-    }
+    Datatype() {}
 
 
     /**
-     * Assignment operator: closes this communicator and duplicates the other
-     * one, unless the other one is null in which case sets this one to null,
-     * e.g. you can reset a communicator by writing
-     *
-     *              comm = Communicator();
-     *
+     * Datatype is a unique object, no copies are permitted.
      */
-    Communicator& operator=(const Communicator& other)
-    {
-        close();
-
-        if (! other.is_null())
-        {
-            MPI_Comm_dup(other.comm, &comm);
-        }
-        return *this;
-    }
+    Datatype(const Datatype& other) = delete;
+    Datatype& operator=(const Datatype& other) = delete;
 
 
     /**
-     * Move assignment. Steals the other communicator.
+     * Move constructor and assignment, steal ownership of the other.
      */
-    Communicator& operator=(Communicator&& other)
+    Datatype(Datatype&& other)
     {
-        close();
+        type = other.type;
+        other.type = MPI_DATATYPE_NULL;
+    }
 
-        comm = other.comm;
-        other.comm = MPI_COMM_NULL;
+    Datatype& operator=(Datatype&& other)
+    {
+        free();
+        type = other.type;
+        other.type = MPI_DATATYPE_NULL;
         return *this;
     }
 
 
     /**
-     * Close the communicator if it wasn't null.
+     * Destructor, frees the type unless it was null.
      */
-    void close()
+    ~Datatype()
     {
-        if (! is_null())
-        {
-            MPI_Comm_free(&comm);
-            comm = MPI_COMM_NULL;
-        }
+        free();
     }
 
 
     /**
-     * Return true if the communicator is null.
+     * Return true if this datatype is null.
      */
     bool is_null() const
     {
-        return comm == MPI_COMM_NULL;
+        return type == MPI_DATATYPE_NULL;
     }
 
 
     /**
-     * Return the number of ranks in the communicator. This returns zero for a
-     * null communicator (whereas I think MPI implementations typically
-     * produce an error).
+     * Create a type describing a multidimensional block of T's, with the
+     * item at index (i0, i1, ...) located offset + i0 * strides[0] + i1 *
+     * strides[1] + ... items from the buffer start. Items are sent in order
+     * of increasing index, the last one varying fastest, so permuting the
+     * strides transposes the block in flight. Returns a null datatype if the
+     * block is empty.
      */
-    int size() const
+    template <typename T>
+    static Datatype strided(const std::vector<int>& counts, const std::vector<std::size_t>& strides, std::size_t offset=0)
     {
-        if (is_null())
+        if (counts.size() != strides.size())
         {
-            return 0;
+            throw std::invalid_argument("strided datatype needs one stride per dimension");
         }
+        auto res = Datatype();
 
-        int res;
-        MPI_Comm_size(comm, &res);
-        return res;
-    }
-
+        if (std::find(counts.begin(), counts.end(), 0) != counts.end())
+        {
+            return res;
+        }
+        auto inner = detail::datatype<T>();
 
-    /**
-     * Return the rank of the communicator. This returns -1 for a null
-     * communicator (whereas I think MPI implementations typically produce an
-     * error).
-     */
-    int rank() const
-    {
-        if (is_null())
+        for (auto d = counts.size(); d-- > 0; )
         {
-            return -1;
+            auto outer = MPI_Datatype();
+            MPI_Type_create_hvector(counts[d], 1, strides[d] * sizeof(T), inner, &outer);
+
+            if (inner != detail::datatype<T>())
+            {
+                MPI_Type_free(&inner);
+            }
+            inner = outer;
         }
+        auto blocklength = 1;
+        auto displacement = MPI_Aint(offset * sizeof(T));
+        MPI_Type_create_struct(1, &blocklength, &displacement, &inner, &res.type);
+        MPI_Type_commit(&res.type);
 
-        int res;
-        MPI_Comm_rank(comm, &res);
+        if (inner != detail::datatype<T>())
+        {
+            MPI_Type_free(&inner);
+        }
         return res;
     }
 
 
-    /**
-     * Block all ranks in the communicator at this points.
-     */
-    void barrier() const
+private:
+    // ========================================================================
+    friend class Communicator;
+
+    void free()
     {
-        MPI_Barrier(comm);
+        if (! is_null())
+        {
+            MPI_Type_free(&type);
+        }
     }
 
+    MPI_Datatype type = MPI_DATATYPE_NULL;
+};
+
 
-    /**
-     * Probe for an incoming message and return its status. This method blocks
-     * until there is an incoming message to probe.
-     */
-    Status probe(int rank=any_source, int tag=any_tag) const
+
+
+// ============================================================================
+/**
+ * How to wait for a request to complete. MPI_Wait typically polls the
+ * network at full speed, which is fastest but keeps a core busy that
+ * threads on the same node could use. The other policies poll with MPI_Test,
+ * and between tests:
+ *
+ * spin:    do nothing;
+ * backoff: sleep, doubling the interval from 1 us up to 1 ms;
+ * yield:   give the core to any other thread that is ready to run;
+ * sleep:   sleep for 100 us.
+ *
+ * The process-wide default is returned by mpi::wait_policy(), and used by
+ * Request::wait and RequestSet::wait_all and wait_any, which also take a
+ * policy for one call:
+ *
+ *              mpi::wait_policy() = mpi::WaitPolicy::backoff;
+ *              request.wait(mpi::WaitPolicy::spin);
+ */
+enum class mpi::WaitPolicy
+{
+    native,
+    spin,
+    backoff,
+    yield,
+    sleep,
+};
+
+std::string mpi::to_string(WaitPolicy policy)
+{
+    switch (policy)
     {
-        MPI_Status status;
-        MPI_Probe(rank, tag, comm, &status);
-        return status;
+        case WaitPolicy::native:  return "native";
+        case WaitPolicy::spin:    return "spin";
+        case WaitPolicy::backoff: return "backoff";
+        case WaitPolicy::yield:   return "yield";
+        case WaitPolicy::sleep:   return "sleep";
     }
+    return "unknown";
+}
 
+mpi::WaitPolicy& mpi::wait_policy()
+{
+    static WaitPolicy policy = WaitPolicy::native;
+    return policy;
+}
 
-    /**
-     * Probe for an incoming message and return its status. This method will
-     * not block, but returns a null status if there was no message to probe.
-     */
-    Status iprobe(int rank=any_source, int tag=any_tag) const
-    {
-        MPI_Status status;
-        int flag;
-        MPI_Iprobe(rank, tag, comm, &flag, &status);
 
-        if (! flag)
+/**
+ * Call test until it returns true, pausing between calls according to the
+ * policy (native is treated as spin).
+ */
+template <typename Test>
+void mpi::detail::wait_until(Test test, WaitPolicy policy)
+{
+    auto pause = std::chrono::microseconds(1);
+
+    while (! test())
+    {
+        switch (policy)
         {
-            return Status();
+            case WaitPolicy::native:
+            case WaitPolicy::spin:
+                break;
+            case WaitPolicy::backoff:
+                std::this_thread::sleep_for(pause);
+                pause = std::min(2 * pause, std::chrono::microseconds(1000));
+                break;
+            case WaitPolicy::yield:
+                std::this_thread::yield();
+                break;
+            case WaitPolicy::sleep:
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                break;
         }
-        return status;
     }
+}
 
 
-    /**
-     * Blocking-receive a message with the given source and tag. Return the
-     * data as a string.
-     */
-    std::string recv(int source=any_source, int tag=any_tag) const
-    {
-        auto status = probe(source, tag);
-        auto buf = std::string(status.count(), 0);
 
-        MPI_Recv(&buf[0], buf.size(), MPI_CHAR, source, tag, comm, MPI_STATUS_IGNORE);
-        return buf;
-    }
+
+// ============================================================================
+/**
+ * A thin RAII wrapper around the MPI_Request struct. This is a movable, but
+ * non-copyable object. Keep it around on the stack in order to check on the
+ * status of a non-blocking communication and retrieve the message content.
+ * Requests are cancelled and deallocated (if necessary) when they go out of
+ * scope.
+ */
+class mpi::Request
+{
+public:
 
 
     /**
-     * Non-blocking receive a message with the given source and tag. Return a
-     * request object that can be queried for the completion of the receive
-     * operation. Note that the request is cancelled if allowed to go out of
-     * scope. You should keep the request somewhere, and call test(), wait(),
-     * or get() in a little while.
+     * Default constructor, creates a null request.
      */
-    Request irecv(int source=any_source, int tag=any_tag) const
-    {
-        auto status = iprobe(source, tag);
-
-        if (status.is_null())
-        {
-            return Request();
-        }
-        auto buf = std::string(status.count(), 0);
+    Request() {}
 
-        MPI_Request request;
-        MPI_Irecv(&buf[0], buf.size(), MPI_CHAR, source, tag, comm, &request);
 
-        Request res;
-        res.buffer = std::move(buf);
-        res.request = request;
-        return res;
-    }
+    /**
+     * Request is a unique object, no copy's are permitted.
+     */
+    Request(const Request& other) = delete;
 
 
     /**
-     * Blocking-send a string to the given rank.
+     * Move constructor. Steals ownership of the other.
      */
-    void send(std::string buf, int rank, int tag=0) const
+    Request(Request&& other)
     {
-        MPI_Send(&buf[0], buf.size(), MPI_CHAR, rank, tag, comm);
+        steal(other);
     }
 
 
     /**
-     * Non-blocking send a string to the given rank. Returns a request object
-     * that can be tested for completion or waited on. Note that the request
-     * is cancelled if allowed to go out of scope. Also keep in mind your MPI
-     * implementation may have chosen to buffer your message internally, in
-     * which case the request will have completed immediately, and the
-     * cancellation will have no effect. Therefore it is advisable to keep the
-     * returned request object, or at least do something equivalent to:
-     *
-     *              auto result = comm.isend("Message!", 0).get();
-     *
-     * Of course this would literally be a blocking send, but you get the
-     * idea. In practice you'll probably store the request somewhere and check
-     * on it after a while.
+     * Destructor. Cancels the request if one is pending. For this reason, the
+     * request returned by non-blocking communications must be retained on the
+     * stack somewhere in order for the operation not to be cancelled.
      */
-    Request isend(std::string buf, int rank, int tag=0) const
+    ~Request()
     {
-        MPI_Request request;
-        MPI_Isend(&buf[0], buf.size(), MPI_CHAR, rank, tag, comm, &request);
-
-        Request res;
-        res.buffer = std::move(buf);
-        res.request = request;
-        return res;
+        cancel();
     }
 
 
     /**
-     * Template version of a blocking send. You can pass any standard-layout
-     * data type here.
+     * Copy assignment is not permitted.
      */
-    template <typename T>
-    void send(const T& value, int rank, int tag=0) const
-    {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
-        auto buf = std::string(sizeof(T), 0);
-        std::memcpy(&buf[0], &value, sizeof(T));
-        send(buf, rank, tag);
-    }
+    Request& operator=(const Request& other) = delete;
 
 
     /**
-     * Template version of a non-blocking send. You can pass any standard-layout
-     * data type here.
+     * Move assignment. Cancels the current request (if one is pending) and
+     * steals ownership of the other.
      */
-    template <typename T>
-    Request isend(const T& value, int rank, int tag=0) const
+    Request& operator=(Request&& other)
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
-        auto buf = std::string(sizeof(T), 0);
-        std::memcpy(&buf[0], &value, sizeof(T));
-        return isend(buf, rank, tag);
+        cancel();
+        steal(other);
+        return *this;        
     }
 
 
     /**
-     * Template version of a blocking receive. You can pass any
-     * standard-layout data type here.
+     * Cancel this request and reset its state to null. Non-blocking
+     * collectives cannot be cancelled in MPI, so those requests are instead
+     * completed here. Persistent requests are cancelled if active (or
+     * completed, for collectives), and then freed.
      */
-    template <typename T>
-    T recv(int rank, int tag=0) const
+    void cancel()
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
-        auto buf = recv(rank, tag);
-
-        if (buf.size() != sizeof(T))
+        if (persistent)
         {
-            throw std::logic_error("received message has wrong size for data type");
+            if (active)
+            {
+                if (! collective && ! restart)
+                {
+                    MPI_Cancel(&request);
+                }
+                wait();
+            }
+            if (! restart && ! is_null())
+            {
+                MPI_Request_free(&request);
+            }
+            request = MPI_REQUEST_NULL;
+            restart = nullptr;
+            persistent = false;
+            return;
         }
 
-        auto value = T();
-        std::memcpy(&value, &buf[0], sizeof(T));
-        return value;
+        if (! is_null())
+        {
+            if (collective)
+            {
+                MPI_Wait(&request, MPI_STATUS_IGNORE);
+                return;
+            }
+            MPI_Cancel(&request);
+            MPI_Request_free(&request);
+        }
     }
 
 
     /**
-     * Execute a bcast operation with the given rank as the root.
+     * Return true if this request is null.
      */
-    template <typename T>
-    void bcast(int root, T& value) const
+    bool is_null() const
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
-        MPI_Bcast(&value, sizeof(T), MPI_CHAR, root, comm);
+        return request == MPI_REQUEST_NULL;
     }
 
 
     /**
-     * Execute a scatter communication with the given rank as root. The i-th
-     * index of the send buffer is received by the i-th rank. The send buffer
-     * is ignored by all processes except the root.
+     * Return true if this is a persistent request, which can be started
+     * repeatedly.
      */
-    template <typename T>
-    T scatter(int root, const std::vector<T>& values) const
+    bool is_persistent() const
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        return persistent;
+    }
 
-        if (root == rank() && values.size() != size())
+
+    /**
+     * Start a persistent request. Each start must be followed by a wait (or a
+     * completed test) before the next start. Throws std::logic_error if the
+     * request is not persistent or is already active.
+     */
+    void start()
+    {
+        if (! persistent)
         {
-            throw std::invalid_argument("scatter send buffer must equal the comm size");
+            throw std::logic_error("only persistent requests can be started");
+        }
+        if (active)
+        {
+            throw std::logic_error("persistent request was started while still active");
         }
 
-        auto value = T();
+        if (restart)
+        {
+            restart(&request);
+        }
+        else
+        {
+            MPI_Start(&request);
+        }
+        active = true;
+    }
 
-        MPI_Scatter(
-            &values[0], sizeof(T), MPI_CHAR,
-            &value, sizeof(T), MPI_CHAR, root, comm);
 
-        return value;
-    }
+    /**
+     * Check to see whether the request has completed. If it has, this method
+     * returns true and resets the request to a null state. If this method
+     * returns true and the request was for a non-blocking receive operation,
+     * the get() method can be called to retrieve the message content.
+     */
+    // bool test()
+    // {
+    //     int flag;
+    //     MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+    //     return flag;
+    // }
 
 
     /**
-     * Execute a scatter-v communication with the given rank as root. The i-th
-     * index of the send buffer is received by the i-th rank. The send buffer
-     * is ignored by all processes except the root.
+     * Check to see whether the request has completed. Like above, except
+     * this const method will not free the request if it has completed.
      */
-    template <typename T>
-    std::vector<T> scatter(int root, const std::vector<std::vector<T>>& values) const
+    bool is_ready() const
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        int flag;
+        MPI_Request_get_status(request, &flag, MPI_STATUS_IGNORE);
+        return flag;
+    }
 
-        if (root == rank() && values.size() != size())
-        {
-            throw std::invalid_argument("scatter send buffer must equal the comm size");
-        }
 
-        if (rank() == root)
-        {
-            auto sendcounts = std::vector<int>(size());
-            auto senddispls = std::vector<int>{0};
-            auto sendbuf    = std::vector<T>();
+    /**
+     * Return the status of the request if it has completed, e.g. to find the
+     * source and size of a message received, or a null status if it has
+     * not, or if the request is null or an inactive persistent one. Like
+     * is_ready(), this does not reset the request.
+     */
+    Status status() const;
 
-            for (int i = 0; i < values.size(); ++i)
-            {
-                sendcounts[i] = values[i].size() * sizeof(T);
-                sendbuf.insert(sendbuf.end(), values[i].begin(), values[i].end());
-            }
-            std::partial_sum(sendcounts.begin(), sendcounts.end() - 1, std::back_inserter(senddispls));
 
-            auto recvcount = scatter(root, sendcounts);
-            auto recvbuf   = std::vector<T>(recvcount / sizeof(T));
+    /**
+     * Block until the request is fulfilled, waiting according to the
+     * process-wide wait policy. After this method returns, the get() method
+     * can be called to retrieve the message content.
+     */
+    void wait()
+    {
+        wait(wait_policy());
+    }
 
-            MPI_Scatterv(
-                &sendbuf[0], &sendcounts[0], &senddispls[0], MPI_CHAR,
-                &recvbuf[0], recvcount, MPI_CHAR, root, comm);
 
-            return recvbuf;
+    /**
+     * Block until the request is fulfilled, waiting according to the given
+     * policy.
+     */
+    void wait(WaitPolicy policy)
+    {
+        if (policy == WaitPolicy::native)
+        {
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
         }
         else
         {
-            auto recvcount = scatter(root, std::vector<int>());
-            auto recvbuf   = std::vector<T>(recvcount / sizeof(T));
+            detail::wait_until([this]
+            {
+                int flag;
+                MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+                return flag != 0;
+            }, policy);
+        }
+        active = false;
+    }
 
-            MPI_Scatterv(
-                nullptr, nullptr, nullptr, MPI_CHAR,
-                &recvbuf[0], recvcount, MPI_CHAR, root, comm);
 
-            return recvbuf;
-        }
+    /**
+     * Block until the message is completed. Then deallocate the request, and
+     * return the message content.
+     */
+    const std::string& get()
+    {
+        static const std::string empty;
+        wait();
+        return buffer ? *buffer : empty;
     }
 
 
     /**
-     * Execute an all-to-all communication with container of data. Each rank
-     * sends the value at index i to rank i. The return value at index j
-     * contains the character received from rank j.
+     * Return the message content formatted as the given data type.
      */
     template <typename T>
-    std::vector<T> all_to_all(const std::vector<T>& sendbuf) const
+    T get()
     {
         static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
 
-        if (sendbuf.size() != size())
+        if (! buffer || buffer->size() != sizeof(T))
         {
-            throw std::invalid_argument("all_to_all send buffer must equal the comm size");
+            throw std::logic_error("received message has wrong size for data type");   
         }
 
-        auto recvbuf = std::vector<T>(sendbuf.size(), T());
+        wait();
 
-        MPI_Alltoall(
-            &sendbuf[0], sendbuf.size() / size() * sizeof(T), MPI_CHAR,
-            &recvbuf[0], recvbuf.size() / size() * sizeof(T), MPI_CHAR, comm);
+        auto value = T();
+        std::memcpy(&value, &buffer->at(0), sizeof(T));
+        return value;
+    }
 
-        return recvbuf;
+
+private:
+    // ========================================================================
+    friend class Communicator;
+    friend class RequestSet;
+
+
+    /**
+     * Take over the state of the other request, leaving it null.
+     */
+    void steal(Request& other)
+    {
+        buffer = std::move(other.buffer);
+        scratch = std::move(other.scratch);
+        keepalive = std::move(other.keepalive);
+        restart = std::move(other.restart);
+        collective = other.collective;
+        persistent = other.persistent;
+        active = other.active;
+        request = other.request;
+        other.request = MPI_REQUEST_NULL;
+        other.restart = nullptr;
+        other.persistent = false;
+        other.active = false;
     }
 
 
     /**
-     * Execute an all-gather communication with data of the given scalar type.
-     * The returned vector contains the value provided by process j at int
-     * j-th index.
+     * Create a request owning the given message buffer. The buffer is held
+     * on the heap so that the address handed to MPI stays valid when the
+     * request is moved.
      */
-    template <typename T>
-    std::vector<T> all_gather(const T& value) const
+    Request(std::string content)
+    : buffer(new std::string(std::move(content)))
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+    }
 
-        auto recvbuf = std::vector<T>(size(), T());
-        MPI_Allgather(&value, sizeof(T), MPI_CHAR, &recvbuf[0], sizeof(T), MPI_CHAR, comm);
-        return recvbuf;
+    MPI_Request request = MPI_REQUEST_NULL;
+    std::unique_ptr<std::string> buffer;
+    std::unique_ptr<std::string> scratch;
+    std::shared_ptr<void> keepalive;
+    std::function<void(MPI_Request*)> restart;
+    bool collective = false;
+    bool persistent = false;
+    bool active = false;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A collection of requests that can be started, waited on, or tested
+ * together, with a single call into MPI. Requests are moved into the set and
+ * remain accessible by index:
+ *
+ *              auto requests = mpi::RequestSet();
+ *              requests.add(comm.isend(message, 1));
+ *              requests.add(comm.all_reduce_init(local, global));
+ *              requests.start_all();
+ *              requests.wait_all();
+ *
+ */
+class mpi::RequestSet
+{
+public:
+
+
+    /**
+     * Add a request to the set, and return its index.
+     */
+    std::size_t add(Request request)
+    {
+        requests.push_back(std::move(request));
+        return requests.size() - 1;
     }
 
 
     /**
-     * Execute an all-gather-v communication. This is a generalization of the
-     * above, where each rank broadcasts to all others a container of items.
-     * The size of the container to be broadcasted need not be the same on
-     * every rank. The container broadcasted by rank j is returned in the j-th
-     * index of the vector returned by this function.
+     * Return the number of requests in the set.
      */
-    template <typename T>
-    std::vector<std::vector<T>> all_gather(const std::vector<T>& sendbuf) const
+    std::size_t size() const
     {
-        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        return requests.size();
+    }
+
+
+    /**
+     * Return the request at the given index.
+     */
+    Request& operator[](std::size_t index)
+    {
+        return requests[index];
+    }
+
+
+    /**
+     * Start all the persistent requests in the set. Non-persistent requests
+     * are left alone.
+     */
+    void start_all()
+    {
+        auto handles = std::vector<MPI_Request>();
+
+        for (auto& r : requests)
+        {
+            if (r.persistent && ! r.restart)
+            {
+                if (r.active)
+                {
+                    throw std::logic_error("persistent request was started while still active");
+                }
+                handles.push_back(r.request);
+                r.active = true;
+            }
+            else if (r.persistent)
+            {
+                r.start();
+            }
+        }
+        if (! handles.empty())
+        {
+            MPI_Startall(handles.size(), handles.data());
+        }
+    }
+
+
+    /**
+     * Block until every request in the set has completed, waiting according
+     * to the given policy (by default the process-wide one).
+     */
+    void wait_all()
+    {
+        wait_all(wait_policy());
+    }
+
+    void wait_all(WaitPolicy policy)
+    {
+        auto handles = gather_handles();
+
+        if (policy == WaitPolicy::native)
+        {
+            MPI_Waitall(handles.size(), handles.data(), MPI_STATUSES_IGNORE);
+        }
+        else
+        {
+            detail::wait_until([&handles]
+            {
+                int flag;
+                MPI_Testall(handles.size(), handles.data(), &flag, MPI_STATUSES_IGNORE);
+                return flag != 0;
+            }, policy);
+        }
+        scatter_handles(handles);
+
+        for (auto& r : requests)
+        {
+            r.active = false;
+        }
+    }
+
+
+    /**
+     * Block until any one of the requests completes, and return its index,
+     * waiting according to the given policy (by default the process-wide
+     * one). Returns -1 if none of the requests are pending.
+     */
+    int wait_any()
+    {
+        return wait_any(wait_policy());
+    }
+
+    int wait_any(WaitPolicy policy)
+    {
+        auto handles = gather_handles();
+        int index;
+
+        if (policy == WaitPolicy::native)
+        {
+            MPI_Waitany(handles.size(), handles.data(), &index, MPI_STATUS_IGNORE);
+        }
+        else
+        {
+            detail::wait_until([&handles, &index]
+            {
+                int flag;
+                MPI_Testany(handles.size(), handles.data(), &index, &flag, MPI_STATUS_IGNORE);
+                return flag != 0;
+            }, policy);
+        }
+        scatter_handles(handles);
+
+        if (index == MPI_UNDEFINED)
+        {
+            return -1;
+        }
+        requests[index].active = false;
+        return index;
+    }
+
+
+    /**
+     * Return the indexes of all the requests that have completed since the
+     * last call, without blocking.
+     */
+    std::vector<int> test_some()
+    {
+        auto handles = gather_handles();
+        auto indexes = std::vector<int>(handles.size());
+        int count;
+        MPI_Testsome(handles.size(), handles.data(), &count, indexes.data(), MPI_STATUSES_IGNORE);
+        scatter_handles(handles);
+
+        if (count == MPI_UNDEFINED)
+        {
+            return std::vector<int>();
+        }
+        indexes.resize(count);
+
+        for (auto i : indexes)
+        {
+            requests[i].active = false;
+        }
+        return indexes;
+    }
+
+
+private:
+    // ========================================================================
+    /**
+     * Inactive persistent requests are passed to MPI as null requests, since
+     * the MPI functions would otherwise report them as completed again.
+     */
+    std::vector<MPI_Request> gather_handles() const
+    {
+        auto handles = std::vector<MPI_Request>();
+
+        for (const auto& r : requests)
+        {
+            handles.push_back(r.persistent && ! r.active ? MPI_REQUEST_NULL : r.request);
+        }
+        return handles;
+    }
+
+    void scatter_handles(const std::vector<MPI_Request>& handles)
+    {
+        for (std::size_t i = 0; i < requests.size(); ++i)
+        {
+            if (! requests[i].persistent || requests[i].active)
+            {
+                requests[i].request = handles[i];
+            }
+        }
+    }
+
+    std::vector<Request> requests;
+};
+
+
+
+
+// ============================================================================
+/**
+    This is a simple wrapper class around the MPI_Status struct.
+*/
+class mpi::Status
+{
+public:
+
+
+    /**
+     * Default-constructed status has is_null() == true.
+     */
+    Status() {}
+
+
+    /**
+     * Check for null-status. Null status is returned e.g. when iprobe does
+     * not find any incoming messages:
+     *
+     *              if (comm.iprobe().is_null()) { }
+     * 
+     */
+    bool is_null() const
+    {
+        return null;
+    }
+
+
+    /**
+     * Return the number of bytes in the message described by this status.
+     */
+    int count()
+    {
+        if (is_null())
+        {
+            return 0;
+        }
+
+        int count;
+        MPI_Get_count(&status, MPI_CHAR, &count);
+        return count;
+    }
+
+
+    /**
+     * Get the rank of the message's source.
+     */
+    int source() const
+    {
+        if (is_null())
+        {
+            return -1;
+        }
+        return status.MPI_SOURCE;
+    }
+
+
+    /**
+     * Get the tag of the message.
+     */
+    int tag() const
+    {
+        if (is_null())
+        {
+            return -1;
+        }
+        return status.MPI_TAG;
+    }
+
+
+private:
+    // ========================================================================
+    friend class Communicator;
+    friend class Request;
+    Status(MPI_Status status) : status(status), null(false) {}
+    MPI_Status status;
+    bool null = true;
+};
+
+
+
+
+// ============================================================================
+mpi::Status mpi::Request::status() const
+{
+    // MPI reports a null or inactive persistent request as complete, with
+    // an empty status.
+    if (is_null() || (persistent && ! active))
+    {
+        return Status();
+    }
+    int flag;
+    MPI_Status status;
+    MPI_Request_get_status(request, &flag, &status);
+
+    if (! flag)
+    {
+        return Status();
+    }
+    return status;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Algorithms the library can use to implement a collective operation. The
+ * native one defers to the MPI implementation; the others are built by the
+ * library out of point-to-point messages.
+ */
+enum class mpi::Algorithm
+{
+    native,
+    recursive_doubling,
+    ring,
+    rabenseifner,
+    hierarchical,
+};
+
+std::string mpi::to_string(Algorithm algorithm)
+{
+    switch (algorithm)
+    {
+        case Algorithm::native:             return "native";
+        case Algorithm::recursive_doubling: return "recursive_doubling";
+        case Algorithm::ring:               return "ring";
+        case Algorithm::rabenseifner:       return "rabenseifner";
+        case Algorithm::hierarchical:       return "hierarchical";
+    }
+    return "unknown";
+}
+
+
+
+
+// ============================================================================
+/**
+ * Table of rules saying which algorithm to use for a collective operation,
+ * given the number of ranks and the message size in bytes. The process-wide
+ * table is returned by mpi::tuning(), and is consulted by e.g.
+ * Communicator::all_reduce. Rules can be added like this:
+ *
+ *              mpi::tuning().set("all_reduce", 8, 1 << 20, mpi::Algorithm::ring);
+ *
+ * meaning: on 8 or more ranks, for messages of 1 MB or more, use the ring
+ * algorithm. When several rules apply, the one with the largest rank
+ * threshold wins, and then the one with the largest size threshold. If no
+ * rule applies the native algorithm is used.
+ */
+class mpi::TuningTable
+{
+public:
+
+
+    // ========================================================================
+    struct Entry
+    {
+        std::string operation;
+        int min_ranks;
+        std::size_t min_bytes;
+        Algorithm algorithm;
+    };
+
+
+    /**
+     * Default constructor, creates a table with the built-in defaults. These
+     * follow what the allreduce benchmark (./mpi-plus bench) shows: the MPI
+     * implementation is as good or better for small messages, and the ring
+     * wins from a few hundred kB up. Run the benchmark to find the crossover
+     * on a given machine.
+     */
+    TuningTable()
+    {
+        set("all_reduce", 1, 0, Algorithm::native);
+        set("all_reduce", 3, 1 << 18, Algorithm::ring);
+    }
+
+
+    /**
+     * Add a rule, replacing any rule having the same operation and
+     * thresholds.
+     */
+    void set(const std::string& operation, int min_ranks, std::size_t min_bytes, Algorithm algorithm)
+    {
+        for (auto& entry : table)
+        {
+            if (entry.operation == operation && entry.min_ranks == min_ranks && entry.min_bytes == min_bytes)
+            {
+                entry.algorithm = algorithm;
+                return;
+            }
+        }
+        table.push_back({operation, min_ranks, min_bytes, algorithm});
+    }
+
+
+    /**
+     * Remove all the rules for the given operation, or only those with the
+     * given rank threshold if min_ranks is not -1.
+     */
+    void clear(const std::string& operation, int min_ranks=-1)
+    {
+        auto matches = [&] (const Entry& e)
+        {
+            return e.operation == operation && (min_ranks == -1 || e.min_ranks == min_ranks);
+        };
+        table.erase(std::remove_if(table.begin(), table.end(), matches), table.end());
+    }
+
+
+    /**
+     * Return the algorithm to use for the given operation, number of ranks,
+     * and message size.
+     */
+    Algorithm select(const std::string& operation, int ranks, std::size_t bytes) const
+    {
+        const Entry* best = nullptr;
+
+        for (const auto& entry : table)
+        {
+            if (entry.operation == operation && entry.min_ranks <= ranks && entry.min_bytes <= bytes)
+            {
+                if (! best
+                    || entry.min_ranks > best->min_ranks
+                    || (entry.min_ranks == best->min_ranks && entry.min_bytes > best->min_bytes))
+                {
+                    best = &entry;
+                }
+            }
+        }
+        return best ? best->algorithm : Algorithm::native;
+    }
+
+
+    /**
+     * Return all the rules in the table.
+     */
+    const std::vector<Entry>& entries() const
+    {
+        return table;
+    }
+
+
+    /**
+     * Add the rules from a tuning profile, in the format written by dump().
+     * Rules in the profile replace existing ones with the same operation and
+     * thresholds. Throws std::invalid_argument on malformed lines.
+     */
+    void load(const std::string& profile)
+    {
+        auto stream = std::istringstream(profile);
+        auto line = std::string();
+
+        while (std::getline(stream, line))
+        {
+            line = line.substr(0, line.find('#'));
+
+            auto words = std::istringstream(line);
+            auto entry = Entry();
+            auto name = std::string();
+
+            if (! (words >> entry.operation))
+            {
+                continue;
+            }
+            if (! (words >> entry.min_ranks >> entry.min_bytes >> name))
+            {
+                throw std::invalid_argument("malformed tuning profile line: " + line);
+            }
+            set(entry.operation, entry.min_ranks, entry.min_bytes, parse_algorithm(name));
+        }
+    }
+
+
+    /**
+     * Return the table as a tuning profile: one rule per line, giving the
+     * operation, minimum ranks, minimum bytes, and algorithm name.
+     */
+    std::string dump() const
+    {
+        auto stream = std::ostringstream();
+        stream << "# operation min_ranks min_bytes algorithm\n";
+
+        for (const auto& entry : table)
+        {
+            stream << entry.operation << " " << entry.min_ranks << " " << entry.min_bytes << " " << to_string(entry.algorithm) << "\n";
+        }
+        return stream.str();
+    }
+
+
+private:
+    // ========================================================================
+    static Algorithm parse_algorithm(const std::string& name)
+    {
+        for (auto a : {Algorithm::native, Algorithm::recursive_doubling, Algorithm::ring, Algorithm::rabenseifner, Algorithm::hierarchical})
+        {
+            if (to_string(a) == name)
+            {
+                return a;
+            }
+        }
+        throw std::invalid_argument("unknown algorithm in tuning profile: " + name);
+    }
+
+    std::vector<Entry> table;
+};
+
+
+
+
+// ============================================================================
+mpi::TuningTable& mpi::tuning()
+{
+    static TuningTable table;
+    return table;
+}
+
+
+
+
+// ============================================================================
+class mpi::Communicator
+{
+public:
+
+
+    /**
+     * Default constructor, gives you MPI_COMM_NULL.
+     */
+    Communicator()
+    {
+    }
+
+
+    /**
+     * Copy constructor. Copies are handles to the same MPI communicator,
+     * which is freed when the last of them is closed, so copying is cheap
+     * and local. Use dup() to get a communicator with its own context.
+     */
+    Communicator(const Communicator& other)
+    : comm(other.comm)
+    , shared(other.shared)
+    {
+    }
+
+
+    /**
+     * Move constructor, sets the other comm back to null.
+     */
+    Communicator(Communicator&& other)
+    : comm(other.comm)
+    , shared(std::move(other.shared))
+    {
+        other.comm = MPI_COMM_NULL;
+    }
+
+
+    /**
+     * Destructor, closes the communicator unless it was null.
+     */
+    ~Communicator()
+    {
+        close();
+    }
+
+
+    /**
+     * Assignment operator: closes this communicator and shares the other
+     * one, e.g. you can reset a communicator by writing
+     *
+     *              comm = Communicator();
+     *
+     */
+    Communicator& operator=(const Communicator& other)
+    {
+        if (this != &other)
+        {
+            close();
+            comm = other.comm;
+            shared = other.shared;
+        }
+        return *this;
+    }
+
+
+    /**
+     * Move assignment. Steals the other communicator.
+     */
+    Communicator& operator=(Communicator&& other)
+    {
+        if (this != &other)
+        {
+            close();
+            comm = other.comm;
+            shared = std::move(other.shared);
+            other.comm = MPI_COMM_NULL;
+        }
+        return *this;
+    }
+
+
+    /**
+     * Release this handle, freeing the MPI communicator if it was the last
+     * one to it.
+     */
+    void close()
+    {
+        shared.reset();
+        comm = MPI_COMM_NULL;
+    }
+
+
+    /**
+     * Return a duplicate of this communicator, with its own context, so that
+     * messages on it can never match those on this one. This is a collective
+     * operation. Like every new communicator, the duplicate comes with a
+     * private one for the library's own traffic, so it takes two of the
+     * implementation's context ids.
+     */
+    Communicator dup() const
+    {
+        auto res = MPI_Comm(MPI_COMM_NULL);
+
+        if (! is_null())
+        {
+            MPI_Comm_dup(comm, &res);
+        }
+        return adopt(res);
+    }
+
+
+    /**
+     * Return the number of handles sharing this communicator.
+     */
+    long use_count() const
+    {
+        return shared.use_count();
+    }
+
+
+    /**
+     * Return true if the communicator is null.
+     */
+    bool is_null() const
+    {
+        return comm == MPI_COMM_NULL;
+    }
+
+
+    /**
+     * Return the number of ranks in the communicator. This returns zero for a
+     * null communicator (whereas I think MPI implementations typically
+     * produce an error).
+     */
+    int size() const
+    {
+        if (is_null())
+        {
+            return 0;
+        }
+
+        int res;
+        MPI_Comm_size(comm, &res);
+        return res;
+    }
+
+
+    /**
+     * Return the rank of the communicator. This returns -1 for a null
+     * communicator (whereas I think MPI implementations typically produce an
+     * error).
+     */
+    int rank() const
+    {
+        if (is_null())
+        {
+            return -1;
+        }
+
+        int res;
+        MPI_Comm_rank(comm, &res);
+        return res;
+    }
+
+
+    /**
+     * Split the communicator into disjoint sub-communicators, one for each
+     * distinct color. Ranks in each are ordered by key, and then by their
+     * rank in this communicator. Ranks passing a negative color get a null
+     * communicator.
+     */
+    Communicator split(int color, int key=0) const
+    {
+        auto res = MPI_Comm(MPI_COMM_NULL);
+        MPI_Comm_split(comm, color < 0 ? MPI_UNDEFINED : color, key, &res);
+        return adopt(res);
+    }
+
+
+    /**
+     * Split the communicator into sub-communicators of ranks that can share
+     * memory, i.e. one per node.
+     */
+    Communicator split_shared() const
+    {
+        auto res = MPI_Comm(MPI_COMM_NULL);
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank(), MPI_INFO_NULL, &res);
+        return adopt(res);
+    }
+
+
+    /**
+     * Block all ranks in the communicator at this points.
+     */
+    void barrier() const
+    {
+        MPI_Barrier(comm);
+    }
+
+
+    /**
+     * Probe for an incoming message and return its status. This method blocks
+     * until there is an incoming message to probe.
+     */
+    Status probe(int rank=any_source, int tag=any_tag) const
+    {
+        MPI_Status status;
+        MPI_Probe(rank, tag, comm, &status);
+        return status;
+    }
+
+
+    /**
+     * Probe for an incoming message and return its status. This method will
+     * not block, but returns a null status if there was no message to probe.
+     */
+    Status iprobe(int rank=any_source, int tag=any_tag) const
+    {
+        MPI_Status status;
+        int flag;
+        MPI_Iprobe(rank, tag, comm, &flag, &status);
+
+        if (! flag)
+        {
+            return Status();
+        }
+        return status;
+    }
+
+
+    /**
+     * Blocking-receive a message with the given source and tag. Return the
+     * data as a string.
+     */
+    std::string recv(int source=any_source, int tag=any_tag) const
+    {
+        auto status = probe(source, tag);
+        auto buf = std::string(status.count(), 0);
+
+        MPI_Recv(&buf[0], buf.size(), MPI_CHAR, source, tag, comm, MPI_STATUS_IGNORE);
+        return buf;
+    }
+
+
+    /**
+     * Non-blocking receive a message with the given source and tag. Return a
+     * request object that can be queried for the completion of the receive
+     * operation. Note that the request is cancelled if allowed to go out of
+     * scope. You should keep the request somewhere, and call test(), wait(),
+     * or get() in a little while.
+     */
+    Request irecv(int source=any_source, int tag=any_tag) const
+    {
+        auto status = iprobe(source, tag);
+
+        if (status.is_null())
+        {
+            return Request();
+        }
+        auto res = Request(std::string(status.count(), 0));
+        auto& buf = *res.buffer;
+
+        MPI_Irecv(&buf[0], buf.size(), MPI_CHAR, source, tag, comm, &res.request);
+        return res;
+    }
+
+
+    /**
+     * Blocking-send a string to the given rank.
+     */
+    void send(std::string buf, int rank, int tag=0) const
+    {
+        MPI_Send(&buf[0], buf.size(), MPI_CHAR, rank, tag, comm);
+    }
+
+
+    /**
+     * Non-blocking send a string to the given rank. Returns a request object
+     * that can be tested for completion or waited on. Note that the request
+     * is cancelled if allowed to go out of scope. Also keep in mind your MPI
+     * implementation may have chosen to buffer your message internally, in
+     * which case the request will have completed immediately, and the
+     * cancellation will have no effect. Therefore it is advisable to keep the
+     * returned request object, or at least do something equivalent to:
+     *
+     *              auto result = comm.isend("Message!", 0).get();
+     *
+     * Of course this would literally be a blocking send, but you get the
+     * idea. In practice you'll probably store the request somewhere and check
+     * on it after a while.
+     */
+    Request isend(std::string buf, int rank, int tag=0) const
+    {
+        auto res = Request(std::move(buf));
+        auto& data = *res.buffer;
+
+        MPI_Isend(&data[0], data.size(), MPI_CHAR, rank, tag, comm, &res.request);
+        return res;
+    }
+
+
+    /**
+     * Simultaneously send a buffer of items to one rank and receive a buffer
+     * of items from another. This is the typed, zero-copy building block for
+     * the library's own collective algorithms.
+     */
+    template <typename T>
+    void sendrecv(const T* sendbuf, std::size_t sendcount, int dest, T* recvbuf, std::size_t recvcount, int source, int tag=0) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        MPI_Sendrecv(
+            sendbuf, sendcount, detail::datatype<T>(), dest, tag,
+            recvbuf, recvcount, detail::datatype<T>(), source, tag, comm, MPI_STATUS_IGNORE);
+    }
+
+
+    /**
+     * Create a persistent send of a buffer of items to the given rank. The
+     * returned request is started (and waited on) as many times as needed,
+     * each time sending the current contents of the buffer, which must
+     * outlive the request.
+     */
+    template <typename T>
+    Request send_init(const T* data, std::size_t count, int rank, int tag=0) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = Request();
+        res.persistent = true;
+        MPI_Send_init(data, count, detail::datatype<T>(), rank, tag, comm, &res.request);
+        return res;
+    }
+
+
+    /**
+     * Create a persistent receive of a buffer of items from the given rank.
+     * Each start receives a message of at most count items into the buffer,
+     * which must outlive the request.
+     */
+    template <typename T>
+    Request recv_init(T* data, std::size_t count, int rank, int tag=0) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = Request();
+        res.persistent = true;
+        MPI_Recv_init(data, count, detail::datatype<T>(), rank, tag, comm, &res.request);
+        return res;
+    }
+
+
+    /**
+     * Template version of a blocking send. You can pass any standard-layout
+     * data type here.
+     */
+    template <typename T>
+    void send(const T& value, int rank, int tag=0) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        auto buf = std::string(sizeof(T), 0);
+        std::memcpy(&buf[0], &value, sizeof(T));
+        send(buf, rank, tag);
+    }
+
+
+    /**
+     * Template version of a non-blocking send. You can pass any standard-layout
+     * data type here.
+     */
+    template <typename T>
+    Request isend(const T& value, int rank, int tag=0) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        auto buf = std::string(sizeof(T), 0);
+        std::memcpy(&buf[0], &value, sizeof(T));
+        return isend(buf, rank, tag);
+    }
+
+
+    /**
+     * Template version of a blocking receive. You can pass any
+     * standard-layout data type here.
+     */
+    template <typename T>
+    T recv(int rank, int tag=0) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        auto buf = recv(rank, tag);
+
+        if (buf.size() != sizeof(T))
+        {
+            throw std::logic_error("received message has wrong size for data type");
+        }
+
+        auto value = T();
+        std::memcpy(&value, &buf[0], sizeof(T));
+        return value;
+    }
+
+
+    /**
+     * Execute a bcast operation with the given rank as the root.
+     */
+    template <typename T>
+    void bcast(int root, T& value) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        MPI_Bcast(&value, sizeof(T), MPI_CHAR, root, comm);
+    }
+
+
+    /**
+     * Broadcast a vector of trivially copyable values from the given root.
+     * The vector is resized on the receiving ranks to match the root.
+     * Vectors small enough to fit in a single eager message are sent along
+     * with their size, in one bcast. Larger ones are sent as a size header
+     * followed by the payload, which is broadcasted straight out of (and
+     * into) the vector's storage in pipelined chunks.
+     */
+    template <typename T>
+    void bcast(int root, std::vector<T>& values) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        bcast_container(root, values, sizeof(T));
+    }
+
+
+    /**
+     * Broadcast a string from the given root. Same protocol as above.
+     */
+    void bcast(int root, std::string& value) const
+    {
+        bcast_container(root, value, 1);
+    }
+
+
+    /**
+     * Execute a scatter communication with the given rank as root. The i-th
+     * index of the send buffer is received by the i-th rank. The send buffer
+     * is ignored by all processes except the root.
+     */
+    template <typename T>
+    T scatter(int root, const std::vector<T>& values) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        if (root == rank() && values.size() != size())
+        {
+            throw std::invalid_argument("scatter send buffer must equal the comm size");
+        }
+
+        auto value = T();
+
+        MPI_Scatter(
+            &values[0], sizeof(T), MPI_CHAR,
+            &value, sizeof(T), MPI_CHAR, root, comm);
+
+        return value;
+    }
+
+
+    /**
+     * Execute a scatter-v communication with the given rank as root. The i-th
+     * index of the send buffer is received by the i-th rank. The send buffer
+     * is ignored by all processes except the root.
+     */
+    template <typename T>
+    std::vector<T> scatter(int root, const std::vector<std::vector<T>>& values) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        if (root == rank() && values.size() != size())
+        {
+            throw std::invalid_argument("scatter send buffer must equal the comm size");
+        }
+
+        if (rank() == root)
+        {
+            auto sendcounts = std::vector<int>(size());
+            auto senddispls = std::vector<int>{0};
+            auto sendbuf    = std::vector<T>();
+
+            for (int i = 0; i < values.size(); ++i)
+            {
+                sendcounts[i] = values[i].size() * sizeof(T);
+                sendbuf.insert(sendbuf.end(), values[i].begin(), values[i].end());
+            }
+            std::partial_sum(sendcounts.begin(), sendcounts.end() - 1, std::back_inserter(senddispls));
+
+            auto recvcount = scatter(root, sendcounts);
+            auto recvbuf   = std::vector<T>(recvcount / sizeof(T));
+
+            MPI_Scatterv(
+                &sendbuf[0], &sendcounts[0], &senddispls[0], MPI_CHAR,
+                &recvbuf[0], recvcount, MPI_CHAR, root, comm);
+
+            return recvbuf;
+        }
+        else
+        {
+            auto recvcount = scatter(root, std::vector<int>());
+            auto recvbuf   = std::vector<T>(recvcount / sizeof(T));
+
+            MPI_Scatterv(
+                nullptr, nullptr, nullptr, MPI_CHAR,
+                &recvbuf[0], recvcount, MPI_CHAR, root, comm);
+
+            return recvbuf;
+        }
+    }
+
+
+    /**
+     * Execute an all-to-all communication with container of data. Each rank
+     * sends the value at index i to rank i. The return value at index j
+     * contains the character received from rank j.
+     */
+    template <typename T>
+    std::vector<T> all_to_all(const std::vector<T>& sendbuf) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        if (sendbuf.size() != size())
+        {
+            throw std::invalid_argument("all_to_all send buffer must equal the comm size");
+        }
+
+        auto recvbuf = std::vector<T>(sendbuf.size(), T());
+
+        MPI_Alltoall(
+            &sendbuf[0], sendbuf.size() / size() * sizeof(T), MPI_CHAR,
+            &recvbuf[0], recvbuf.size() / size() * sizeof(T), MPI_CHAR, comm);
+
+        return recvbuf;
+    }
+
+
+    /**
+     * Execute an all-to-all-v communication. Each rank sends the container at
+     * index i to rank i. The return value at index j contains the container
+     * received from rank j. Containers may have any size, including zero.
+     */
+    template <typename T>
+    std::vector<std::vector<T>> all_to_all(const std::vector<std::vector<T>>& sendbuf) const
+    {
+        if (int(sendbuf.size()) != size())
+        {
+            throw std::invalid_argument("all_to_all send buffer must equal the comm size");
+        }
+
+        auto flat = std::vector<T>();
+        auto sendcounts = std::vector<int>();
+        auto recvcounts = std::vector<int>();
+
+        for (const auto& items : sendbuf)
+        {
+            flat.insert(flat.end(), items.begin(), items.end());
+            sendcounts.push_back(items.size());
+        }
+        return unflatten(all_to_allv(flat, sendcounts, recvcounts), recvcounts);
+    }
+
+
+    /**
+     * Flat version of the all-to-all-v. The send buffer holds the items for
+     * rank 0, then those for rank 1, and so on, with sendcounts[i] items
+     * going to rank i. Returns the items received from every rank,
+     * concatenated in rank order; on return, recvcounts[j] holds the number
+     * of items that came from rank j.
+     */
+    template <typename T>
+    std::vector<T> all_to_allv(const std::vector<T>& sendbuf, const std::vector<int>& sendcounts, std::vector<int>& recvcounts) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        if (int(sendcounts.size()) != size())
+        {
+            throw std::invalid_argument("all_to_allv send counts must equal the comm size");
+        }
+
+        recvcounts = all_to_all(sendcounts);
+
+        auto senddispls = std::vector<int>{0};
+        auto recvdispls = std::vector<int>{0};
+        std::partial_sum(sendcounts.begin(), sendcounts.end(), std::back_inserter(senddispls));
+        std::partial_sum(recvcounts.begin(), recvcounts.end(), std::back_inserter(recvdispls));
+
+        auto recvbuf = std::vector<T>(recvdispls.back());
+
+        MPI_Alltoallv(
+            sendbuf.data(), sendcounts.data(), senddispls.data(), detail::datatype<T>(),
+            recvbuf.data(), recvcounts.data(), recvdispls.data(), detail::datatype<T>(), comm);
+
+        return recvbuf;
+    }
+
+
+    /**
+     * Start a non-blocking all-to-all in which the data exchanged with each
+     * rank is described by a derived datatype, relative to the start of the
+     * send and receive buffers. A null datatype means nothing is exchanged
+     * with that rank. This lets e.g. a distributed transpose send and
+     * receive strided blocks in place, with no packing. The buffers must
+     * stay alive until the request completes; the datatypes need not.
+     */
+    template <typename T>
+    Request iall_to_allw(const T* sendbuf, const std::vector<Datatype>& sendtypes, T* recvbuf, const std::vector<Datatype>& recvtypes) const
+    {
+        if (int(sendtypes.size()) != size() || int(recvtypes.size()) != size())
+        {
+            throw std::invalid_argument("all_to_allw datatypes must equal the comm size");
+        }
+
+        struct arguments
+        {
+            std::vector<int> sendcounts, recvcounts, displs;
+            std::vector<MPI_Datatype> sendtypes, recvtypes;
+        };
+        auto args = std::make_shared<arguments>();
+        args->displs.resize(size(), 0);
+
+        for (int i = 0; i < size(); ++i)
+        {
+            args->sendcounts.push_back(sendtypes[i].is_null() ? 0 : 1);
+            args->recvcounts.push_back(recvtypes[i].is_null() ? 0 : 1);
+            args->sendtypes.push_back(sendtypes[i].is_null() ? MPI_BYTE : sendtypes[i].type);
+            args->recvtypes.push_back(recvtypes[i].is_null() ? MPI_BYTE : recvtypes[i].type);
+        }
+
+        auto res = Request();
+        res.collective = true;
+        res.keepalive = args;
+
+        MPI_Ialltoallw(
+            sendbuf, args->sendcounts.data(), args->displs.data(), args->sendtypes.data(),
+            recvbuf, args->recvcounts.data(), args->displs.data(), args->recvtypes.data(), comm, &res.request);
+
+        return res;
+    }
+
+
+    /**
+     * Sparse version of all_to_allv, for when each rank exchanges data with
+     * only a few others and the receivers don't know in advance who will
+     * send to them. The arguments and the result are the same as for
+     * all_to_allv, but messages are only sent where sendcounts is non-zero,
+     * and no all-to-all of the counts is needed. This uses the NBX
+     * (non-blocking consensus) algorithm: synchronous sends, probing for
+     * incoming messages, and a non-blocking barrier entered once the local
+     * sends have been matched.
+     */
+    template <typename T>
+    std::vector<T> sparse_exchange(const std::vector<T>& sendbuf, const std::vector<int>& sendcounts, std::vector<int>& recvcounts) const
+    {
+        auto received = std::vector<std::vector<T>>(size());
+        auto recvbuf = std::vector<T>();
+
+        sparse_exchange(sendbuf, sendcounts, [&received] (int source, int count)
+        {
+            received[source].resize(count);
+            return received[source].data();
+        });
+        recvcounts.clear();
+
+        for (const auto& items : received)
+        {
+            recvbuf.insert(recvbuf.end(), items.begin(), items.end());
+            recvcounts.push_back(items.size());
+        }
+        return recvbuf;
+    }
+
+
+    /**
+     * Like sparse_exchange, but appends the items received to recvbuf, in
+     * the order the messages arrive, rather than returning them. Messages are
+     * received directly into the end of the vector, so this does not
+     * reallocate it if it has enough capacity.
+     */
+    template <typename T>
+    void sparse_exchange_append(const std::vector<T>& sendbuf, const std::vector<int>& sendcounts, std::vector<T>& recvbuf) const
+    {
+        sparse_exchange(sendbuf, sendcounts, [&recvbuf] (int, int count)
+        {
+            recvbuf.resize(recvbuf.size() + count);
+            return recvbuf.data() + recvbuf.size() - count;
+        });
+    }
+
+
+    /**
+     * Exchange items with a fixed set of neighbor ranks, appending the items
+     * received to recvbuf in order of the neighbors. The neighbor lists must
+     * be symmetric: if rank a lists b then b lists a. The sendbuf holds the
+     * items for neighbors[0], then those for neighbors[1], and so on, with
+     * sendcounts[i] going to neighbors[i]. Counts are exchanged first, so the
+     * vector is grown only once, and not reallocated if it has enough
+     * capacity.
+     */
+    template <typename T>
+    void neighbor_exchange_append(const std::vector<T>& sendbuf, const std::vector<int>& neighbors, const std::vector<int>& sendcounts, std::vector<T>& recvbuf) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        if (sendcounts.size() != neighbors.size())
+        {
+            throw std::invalid_argument("neighbor_exchange needs one send count per neighbor");
+        }
+        auto n = neighbors.size();
+        auto recvcounts = std::vector<int>(n);
+        auto requests = std::vector<MPI_Request>(2 * n);
+        auto c = library().comm;
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            MPI_Irecv(&recvcounts[i], 1, MPI_INT, neighbors[i], detail::neighbor_tag, c, &requests[i]);
+            MPI_Isend(&sendcounts[i], 1, MPI_INT, neighbors[i], detail::neighbor_tag, c, &requests[n + i]);
+        }
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+
+        auto recvoffset = recvbuf.size();
+        auto sendoffset = std::size_t(0);
+        recvbuf.resize(recvoffset + std::accumulate(recvcounts.begin(), recvcounts.end(), std::size_t(0)));
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            MPI_Irecv(recvbuf.data() + recvoffset, recvcounts[i], detail::datatype<T>(), neighbors[i], detail::neighbor_tag, c, &requests[i]);
+            MPI_Isend(sendbuf.data() + sendoffset, sendcounts[i], detail::datatype<T>(), neighbors[i], detail::neighbor_tag, c, &requests[n + i]);
+            recvoffset += recvcounts[i];
+            sendoffset += sendcounts[i];
+        }
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    }
+
+
+    /**
+     * Execute an all-gather communication with data of the given scalar type.
+     * The returned vector contains the value provided by process j at int
+     * j-th index.
+     */
+    template <typename T>
+    std::vector<T> all_gather(const T& value) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto recvbuf = std::vector<T>(size(), T());
+        MPI_Allgather(&value, sizeof(T), MPI_CHAR, &recvbuf[0], sizeof(T), MPI_CHAR, comm);
+        return recvbuf;
+    }
+
+
+    /**
+     * Execute an all-gather-v communication. This is a generalization of the
+     * above, where each rank broadcasts to all others a container of items.
+     * The size of the container to be broadcasted need not be the same on
+     * every rank. The container broadcasted by rank j is returned in the j-th
+     * index of the vector returned by this function.
+     */
+    template <typename T>
+    std::vector<std::vector<T>> all_gather(const std::vector<T>& sendbuf) const
+    {
+        auto counts = std::vector<int>();
+        auto values = all_gatherv(sendbuf, counts);
+        return unflatten(values, counts);
+    }
+
+
+    /**
+     * Flat version of the all-gather-v. Rather than a vector of vectors, this
+     * returns the containers from every rank concatenated into a single
+     * ragged array. On return, counts[j] holds the number of items that came
+     * from rank j.
+     */
+    template <typename T>
+    std::vector<T> all_gatherv(const std::vector<T>& sendbuf, std::vector<int>& counts) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto recvcounts = all_gather(int(sendbuf.size() * sizeof(T)));
+        auto recvdispls = std::vector<int>{0};
+        std::partial_sum(recvcounts.begin(), recvcounts.end(), std::back_inserter(recvdispls));
+
+        auto recvbuf = std::vector<T>(recvdispls.back() / sizeof(T));
+
+        MPI_Allgatherv(
+            sendbuf.data(), sendbuf.size() * sizeof(T), MPI_CHAR,
+            recvbuf.data(), &recvcounts[0], &recvdispls[0], MPI_CHAR, comm);
+
+        counts.resize(recvcounts.size());
+
+        for (std::size_t i = 0; i < counts.size(); ++i)
+        {
+            counts[i] = recvcounts[i] / sizeof(T);
+        }
+        return recvbuf;
+    }
+
+
+    /**
+     * Execute a gather communication to the given root. The returned vector
+     * contains the value provided by process j at the j-th index on the
+     * root, and is empty on all other ranks. Unlike all_gather, only the
+     * root allocates a receive buffer.
+     */
+    template <typename T>
+    std::vector<T> gather(int root, const T& value) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto recvbuf = std::vector<T>(rank() == root ? size() : 0);
+        MPI_Gather(&value, sizeof(T), MPI_CHAR, recvbuf.data(), sizeof(T), MPI_CHAR, root, comm);
+        return recvbuf;
+    }
+
+
+    /**
+     * Execute a gather-v communication to the given root. The container sent
+     * by rank j is returned in the j-th index on the root. Other ranks get
+     * back an empty vector.
+     */
+    template <typename T>
+    std::vector<std::vector<T>> gather(int root, const std::vector<T>& sendbuf) const
+    {
+        auto counts = std::vector<int>();
+        auto values = gatherv(root, sendbuf, counts);
+
+        if (rank() != root)
+        {
+            return std::vector<std::vector<T>>();
+        }
+        return unflatten(values, counts);
+    }
+
+
+    /**
+     * Flat version of the gather-v. On the root, this returns the containers
+     * from every rank concatenated into a single ragged array, and counts[j]
+     * holds the number of items that came from rank j. On other ranks both
+     * the return value and the counts are empty.
+     */
+    template <typename T>
+    std::vector<T> gatherv(int root, const std::vector<T>& sendbuf, std::vector<int>& counts) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto sendcount = int(sendbuf.size() * sizeof(T));
+        auto recvcounts = gather(root, sendcount);
+        auto recvdispls = std::vector<int>();
+        auto recvbuf = std::vector<T>();
+
+        counts.clear();
+
+        if (rank() == root)
+        {
+            recvdispls.push_back(0);
+            std::partial_sum(recvcounts.begin(), recvcounts.end(), std::back_inserter(recvdispls));
+            recvbuf.resize(recvdispls.back() / sizeof(T));
+
+            for (auto c : recvcounts)
+            {
+                counts.push_back(c / sizeof(T));
+            }
+        }
+
+        MPI_Gatherv(
+            sendbuf.data(), sendcount, MPI_CHAR,
+            recvbuf.data(), recvcounts.data(), recvdispls.data(), MPI_CHAR, root, comm);
+
+        return recvbuf;
+    }
+
+
+    /**
+     * Execute a reduction to the given root, combining the values from every
+     * rank with the binary operator. The result is returned on the root;
+     * other ranks get a value-initialized T.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    T reduce(int root, const T& value, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = T();
+        MPI_Reduce(&value, &res, 1, detail::datatype<T>(), detail::make_op<T>(op), root, comm);
+        return res;
+    }
+
+
+    /**
+     * Element-wise reduction of vectors to the given root. The vectors must
+     * have the same size on every rank. Ranks other than the root get back
+     * an empty vector.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    std::vector<T> reduce(int root, const std::vector<T>& values, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = std::vector<T>(rank() == root ? values.size() : 0);
+        MPI_Reduce(values.data(), res.data(), values.size(), detail::datatype<T>(), detail::make_op<T>(op), root, comm);
+        return res;
+    }
+
+
+    /**
+     * Execute an all-reduce, returning on every rank the values from all
+     * ranks combined with the binary operator.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    T all_reduce(const T& value, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = T();
+        MPI_Allreduce(&value, &res, 1, detail::datatype<T>(), detail::make_op<T>(op), comm);
+        return res;
+    }
+
+
+    /**
+     * Element-wise all-reduce of vectors, which must have the same size on
+     * every rank.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    std::vector<T> all_reduce(const std::vector<T>& values, Op op=Op()) const
+    {
+        auto algorithm = Algorithm::native;
+
+        if (detail::builtin_op<Op>::value || detail::is_commutative<Op>::value)
+        {
+            algorithm = tuning().select("all_reduce", size(), values.size() * sizeof(T));
+        }
+        return all_reduce(values, op, algorithm);
+    }
+
+
+    /**
+     * Element-wise all-reduce of vectors, using the given algorithm rather
+     * than the one selected by the tuning table. Apart from the native one,
+     * the algorithms are implemented by the library and assume the operator
+     * is commutative:
+     *
+     * - recursive_doubling: log(p) exchanges of the whole vector. Best for
+     *   short vectors (latency bound).
+     * - ring: reduce-scatter and all-gather around a ring, 2(p-1) steps
+     *   moving 2n(p-1)/p items. Bandwidth optimal, good for long vectors.
+     * - rabenseifner: reduce-scatter by recursive halving and all-gather by
+     *   recursive doubling. Same volume as the ring in 2 log(p) steps.
+     * - hierarchical: reduce onto one leader per node, all-reduce among the
+     *   leaders, and broadcast back within each node. Only one rank per node
+     *   touches the network. The node communicators are created on first
+     *   use and cached.
+     */
+    template <typename T, typename Op>
+    std::vector<T> all_reduce(const std::vector<T>& values, Op op, Algorithm algorithm) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        static_assert(! detail::is_reproducible<Op>::value, "reproducible_plus is only supported by all_reduce and all_sum");
+
+        if (algorithm == Algorithm::native || size() == 1)
+        {
+            auto res = std::vector<T>(values.size());
+            MPI_Allreduce(values.data(), res.data(), values.size(), detail::datatype<T>(), detail::make_op<T>(op), comm);
+            return res;
+        }
+
+        auto res = values;
+
+        switch (algorithm)
+        {
+            case Algorithm::recursive_doubling: all_reduce_recursive_doubling(res.data(), res.size(), op); break;
+            case Algorithm::ring:               all_reduce_ring(res.data(), res.size(), op); break;
+            case Algorithm::rabenseifner:       all_reduce_rabenseifner(res.data(), res.size(), op); break;
+            case Algorithm::hierarchical:       all_reduce_hierarchical(res.data(), res.size(), op); break;
+            default: break;
+        }
+        return res;
+    }
+
+
+    /**
+     * Create a persistent all-reduce, bound to the given send and receive
+     * buffers. The returned request is started and waited on as many times
+     * as needed, each time reducing the current contents of sendbuf into
+     * recvbuf:
+     *
+     *              auto local = std::vector<double>(3), global = std::vector<double>();
+     *              auto allreduce = comm.all_reduce_init(local, global);
+     *
+     *              for (...)
+     *              {
+     *                  local = ...;
+     *                  allreduce.start();
+     *                  allreduce.wait();
+     *              }
+     *
+     * The receive buffer is resized here to match the send buffer, and
+     * neither may be resized or reallocated while the request exists. The
+     * operator must be stateless, e.g. a lambda without captures, because
+     * the functor behind a user-defined MPI_Op is shared by every reduction
+     * with the same operator type. With an MPI-4 library this uses
+     * MPI_Allreduce_init; otherwise the datatype and operator are resolved
+     * once here and each start posts an MPI_Iallreduce.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    Request all_reduce_init(const std::vector<T>& sendbuf, std::vector<T>& recvbuf, Op op=Op()) const
+    {
+        recvbuf.resize(sendbuf.size());
+        return all_reduce_init(sendbuf.data(), recvbuf.data(), sendbuf.size(), op);
+    }
+
+
+    /**
+     * Create a persistent all-reduce of a single value. The send and receive
+     * variables must outlive the request.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    Request all_reduce_init(const T& send, T& recv, Op op=Op()) const
+    {
+        return all_reduce_init(&send, &recv, 1, op);
+    }
+
+
+    /**
+     * Create a persistent broadcast of the contents of a vector, bound to its
+     * storage. The vector must already have the same size on every rank, and
+     * must not be resized while the request exists.
+     */
+    template <typename T>
+    Request bcast_init(int root, std::vector<T>& values) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto data = values.data();
+        auto count = int(values.size());
+        auto type = detail::datatype<T>();
+        auto res = Request();
+        res.persistent = true;
+
+#if MPI_VERSION >= 4
+        MPI_Bcast_init(data, count, type, root, comm, MPI_INFO_NULL, &res.request);
+#else
+        auto c = comm;
+        res.restart = [=] (MPI_Request* r) { MPI_Ibcast(data, count, type, root, c, r); };
+#endif
+        return res;
+    }
+
+
+    /**
+     * Reproducible all-reduce of a single value. See mpi::reproducible_plus.
+     */
+    template <typename T>
+    T all_reduce(const T& value, reproducible_plus<T> op) const
+    {
+        return all_reduce(std::vector<T>{value}, op)[0];
+    }
+
+
+    /**
+     * Reproducible element-wise all-reduce of vectors: the i-th result is
+     * bitwise identical however the summands are assigned to ranks.
+     */
+    template <typename T>
+    std::vector<T> all_reduce(const std::vector<T>& values, reproducible_plus<T>) const
+    {
+        using bins = detail::binned<T>;
+
+        auto magnitude = std::vector<T>(values.size());
+        auto finite = std::vector<int>(values.size());
+
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            finite[i] = std::isfinite(values[i]);
+            magnitude[i] = finite[i] ? std::fabs(values[i]) : T();
+        }
+        magnitude = all_reduce(magnitude, max<T>());
+        finite = all_reduce(finite, min<int>());
+
+        auto limbs = std::vector<std::int64_t>(values.size() * bins::limbs);
+        auto res = std::vector<T>(values.size());
+        auto frame = typename bins::frame(0);
+
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            if (finite[i])
+            {
+                auto e = bins::exponent(magnitude[i]);
+
+                if (e != frame.e)
+                {
+                    frame = typename bins::frame(e);
+                }
+                bins::deposit(values[i], frame, &limbs[i * bins::limbs]);
+            }
+        }
+        limbs = all_reduce(limbs);
+
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            res[i] = bins::collect(&limbs[i * bins::limbs], bins::exponent(magnitude[i]));
+        }
+
+        // Infinities and NaN's have no fixed-point representation; let them
+        // propagate through an ordinary sum instead.
+        if (std::any_of(finite.begin(), finite.end(), [] (int f) { return ! f; }))
+        {
+            auto plain = all_reduce(values);
+
+            for (std::size_t i = 0; i < values.size(); ++i)
+            {
+                if (! finite[i])
+                {
+                    res[i] = plain[i];
+                }
+            }
+        }
+        return res;
+    }
+
+
+    /**
+     * Return the sum of all the values on all ranks. The local values are
+     * summed first and then all-reduced, so the result depends on how the
+     * values are distributed.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    T all_sum(const std::vector<T>& values, Op op=Op()) const
+    {
+        return all_reduce(std::accumulate(values.begin(), values.end(), T(), op), op);
+    }
+
+
+    /**
+     * Return the sum of all the values on all ranks, reproducibly: the result
+     * is bitwise identical for any distribution of the values over any number
+     * of ranks.
+     */
+    template <typename T>
+    T all_sum(const std::vector<T>& values, reproducible_plus<T>) const
+    {
+        using bins = detail::binned<T>;
+
+        auto magnitude = T();
+        auto finite = 1;
+
+        for (auto x : values)
+        {
+            if (std::isfinite(x))
+            {
+                magnitude = std::max(magnitude, std::fabs(x));
+            }
+            else
+            {
+                finite = 0;
+            }
+        }
+
+        // Infinities and NaN's have no fixed-point representation; let them
+        // propagate through an ordinary sum instead.
+        if (! all_reduce(finite, min<int>()))
+        {
+            return all_sum(values);
+        }
+        magnitude = all_reduce(magnitude, max<T>());
+
+        auto e = bins::exponent(magnitude);
+        auto frame = typename bins::frame(e);
+        auto limbs = std::vector<std::int64_t>(bins::limbs);
+        auto n = std::int64_t();
+
+        for (auto x : values)
+        {
+            bins::deposit(x, frame, &limbs[0]);
+
+            if (++n % bins::normalize_interval == 0)
+            {
+                bins::normalize(&limbs[0]);
+            }
+        }
+        bins::normalize(&limbs[0]);
+        limbs = all_reduce(limbs);
+        return bins::collect(&limbs[0], e);
+    }
+
+
+    /**
+     * Execute an inclusive prefix reduction (scan). Rank j gets the result of
+     * applying the binary operator to the values from ranks 0 through j, in
+     * rank order. The operator can be any functor; std::plus, mpi::min, and
+     * the like map onto the native MPI operations, e.g.
+     *
+     *              auto last = comm.scan(count);                  // running sum
+     *              auto peak = comm.scan(value, mpi::max<int>());
+     *
+     */
+    template <typename T, typename Op=std::plus<T>>
+    T scan(const T& value, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = T();
+        MPI_Scan(&value, &res, 1, detail::datatype<T>(), detail::make_op<T>(op), comm);
+        return res;
+    }
+
+
+    /**
+     * Element-wise inclusive scan over vectors, which must have the same
+     * size on every rank.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    std::vector<T> scan(const std::vector<T>& values, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = std::vector<T>(values.size());
+        MPI_Scan(values.data(), res.data(), values.size(), detail::datatype<T>(), detail::make_op<T>(op), comm);
+        return res;
+    }
+
+
+    /**
+     * Execute an exclusive prefix reduction. Rank j gets the result of
+     * applying the operator to the values from ranks 0 through j - 1. Rank 0
+     * gets a value-initialized T, which is the identity for sums. This is the
+     * usual way to turn local counts into global offsets:
+     *
+     *              auto start = comm.exscan(std::uint64_t(particles.size()));
+     *
+     */
+    template <typename T, typename Op=std::plus<T>>
+    T exscan(const T& value, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = T();
+        MPI_Exscan(&value, &res, 1, detail::datatype<T>(), detail::make_op<T>(op), comm);
+        return rank() == 0 ? T() : res;
+    }
+
+
+    /**
+     * Element-wise exclusive scan over vectors, which must have the same size
+     * on every rank. Rank 0 gets a vector of value-initialized T's.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    std::vector<T> exscan(const std::vector<T>& values, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = std::vector<T>(values.size());
+        MPI_Exscan(values.data(), res.data(), values.size(), detail::datatype<T>(), detail::make_op<T>(op), comm);
+        return rank() == 0 ? std::vector<T>(values.size()) : res;
+    }
+
+
+    /**
+     * Non-blocking version of the scan. The result is retrieved with
+     * request.get<T>(). The request cannot be cancelled; if it goes out of
+     * scope it is waited on.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    Request iscan(const T& value, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = make_collective_request(value);
+        MPI_Iscan(&res.scratch->at(0), &res.buffer->at(0), 1, detail::datatype<T>(), detail::make_op<T>(op), comm, &res.request);
+        return res;
+    }
+
+
+    /**
+     * Non-blocking version of the exscan. Rank 0 gets a value-initialized T.
+     */
+    template <typename T, typename Op=std::plus<T>>
+    Request iexscan(const T& value, Op op=Op()) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        auto res = make_collective_request(value);
+
+        // MPI leaves the receive buffer undefined on rank 0, so point it at
+        // the tail of the scratch area rather than at the result.
+        auto recv = rank() == 0 ? &res.scratch->at(sizeof(T)) : &res.buffer->at(0);
+        MPI_Iexscan(&res.scratch->at(0), recv, 1, detail::datatype<T>(), detail::make_op<T>(op), comm, &res.request);
+        return res;
+    }
+
+
+private:
+    // ========================================================================
+    template <typename T, typename Op>
+    Request all_reduce_init(const T* sendbuf, T* recvbuf, std::size_t count, const Op& op) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+        static_assert(detail::is_stateless<Op>::value, "persistent reductions need a stateless (non-capturing) operator");
+
+        auto type = detail::datatype<T>();
+        auto mpi_op = detail::make_op<T>(op);
+        auto res = Request();
+        res.persistent = true;
+
+#if MPI_VERSION >= 4
+        MPI_Allreduce_init(sendbuf, recvbuf, count, type, mpi_op, comm, MPI_INFO_NULL, &res.request);
+#else
+        auto c = comm;
+        res.restart = [=] (MPI_Request* r) { MPI_Iallreduce(sendbuf, recvbuf, count, type, mpi_op, c, r); };
+#endif
+        return res;
+    }
+
+
+    /**
+     * Helpers for the library allreduce algorithms. On a non-power-of-two
+     * number of ranks, the first 2r ranks (r = p - p') pair up and the even
+     * ones hand their data to the odd ones, leaving p' (a power of two) ranks
+     * to run the algorithm. Return the rank of this process among those, or
+     * -1 if it sits out.
+     */
+    template <typename T, typename Op>
+    int all_reduce_fold(T* data, std::size_t n, const Op& op, int pof2) const
+    {
+        auto r = rank();
+        auto rem = size() - pof2;
+
+        if (r < 2 * rem)
+        {
+            if (r % 2 == 0)
+            {
+                library().sendrecv(data, n, r + 1, data, 0, MPI_PROC_NULL, detail::collective_tag);
+                return -1;
+            }
+            auto tmp = std::vector<T>(n);
+            library().sendrecv(data, 0, MPI_PROC_NULL, tmp.data(), n, r - 1, detail::collective_tag);
+            detail::reduce_kernel<T, Op>::apply(tmp.data(), data, n, op);
+            return r / 2;
+        }
+        return r - rem;
+    }
+
+    template <typename T>
+    void all_reduce_unfold(T* data, std::size_t n, int pof2) const
+    {
+        auto r = rank();
+        auto rem = size() - pof2;
+
+        if (r < 2 * rem)
+        {
+            if (r % 2 == 0)
+            {
+                library().sendrecv(data, 0, MPI_PROC_NULL, data, n, r + 1, detail::collective_tag);
+            }
+            else
+            {
+                library().sendrecv(data, n, r - 1, data, 0, MPI_PROC_NULL, detail::collective_tag);
+            }
+        }
+    }
+
+    int largest_power_of_two() const
+    {
+        int pof2 = 1;
+
+        while (pof2 * 2 <= size())
+        {
+            pof2 *= 2;
+        }
+        return pof2;
+    }
+
+    int folded_to_real_rank(int folded, int pof2) const
+    {
+        auto rem = size() - pof2;
+        return folded < rem ? 2 * folded + 1 : folded + rem;
+    }
+
+    template <typename T, typename Op>
+    void all_reduce_recursive_doubling(T* data, std::size_t n, const Op& op) const
+    {
+        auto pof2 = largest_power_of_two();
+        auto folded = all_reduce_fold(data, n, op, pof2);
+
+        if (folded != -1)
+        {
+            auto tmp = std::vector<T>(n);
+
+            for (int mask = 1; mask < pof2; mask <<= 1)
+            {
+                auto peer = folded_to_real_rank(folded ^ mask, pof2);
+                library().sendrecv(data, n, peer, tmp.data(), n, peer, detail::collective_tag);
+                detail::reduce_kernel<T, Op>::apply(tmp.data(), data, n, op);
+            }
+        }
+        all_reduce_unfold(data, n, pof2);
+    }
+
+    template <typename T, typename Op>
+    void all_reduce_ring(T* data, std::size_t n, const Op& op) const
+    {
+        auto p = size();
+        auto r = rank();
+        auto right = (r + 1) % p;
+        auto left = (r + p - 1) % p;
+        auto start = [&] (int chunk) { return n * chunk / p; };
+        auto count = [&] (int chunk) { return start(chunk + 1) - start(chunk); };
+        auto tmp = std::vector<T>(n / p + 1);
+
+        for (int step = 0; step < p - 1; ++step)
+        {
+            auto s = (r - step + p) % p;
+            auto q = (r - step - 1 + p) % p;
+            library().sendrecv(data + start(s), count(s), right, tmp.data(), count(q), left, detail::collective_tag);
+            detail::reduce_kernel<T, Op>::apply(tmp.data(), data + start(q), count(q), op);
+        }
+        for (int step = 0; step < p - 1; ++step)
+        {
+            auto s = (r + 1 - step + p) % p;
+            auto q = (r - step + p) % p;
+            library().sendrecv(data + start(s), count(s), right, data + start(q), count(q), left, detail::collective_tag);
+        }
+    }
+
+    template <typename T, typename Op>
+    void all_reduce_rabenseifner(T* data, std::size_t n, const Op& op) const
+    {
+        auto pof2 = largest_power_of_two();
+        auto folded = all_reduce_fold(data, n, op, pof2);
+
+        if (folded != -1)
+        {
+            auto start = [&] (int block) { return n * block / pof2; };
+            auto tmp = std::vector<T>(n / 2 + 1);
+            auto lo = 0;
+            auto hi = pof2;
+
+            for (int mask = pof2 / 2; mask > 0; mask >>= 1)
+            {
+                auto peer = folded_to_real_rank(folded ^ mask, pof2);
+                auto mid = lo + (hi - lo) / 2;
+                auto keep_lo = (folded & mask) ? mid : lo;
+                auto keep_hi = (folded & mask) ? hi : mid;
+                auto send_lo = (folded & mask) ? lo : mid;
+                auto send_hi = (folded & mask) ? mid : hi;
+                auto keep_count = start(keep_hi) - start(keep_lo);
+
+                library().sendrecv(
+                    data + start(send_lo), start(send_hi) - start(send_lo), peer,
+                    tmp.data(), keep_count, peer, detail::collective_tag);
+                detail::reduce_kernel<T, Op>::apply(tmp.data(), data + start(keep_lo), keep_count, op);
+                lo = keep_lo;
+                hi = keep_hi;
+            }
+            for (int mask = 1; mask < pof2; mask <<= 1)
+            {
+                auto peer = folded_to_real_rank(folded ^ mask, pof2);
+                auto width = hi - lo;
+                auto other_lo = (folded & mask) ? lo - width : hi;
+                auto other_hi = other_lo + width;
+
+                library().sendrecv(
+                    data + start(lo), start(hi) - start(lo), peer,
+                    data + start(other_lo), start(other_hi) - start(other_lo), peer, detail::collective_tag);
+                lo = std::min(lo, other_lo);
+                hi = std::max(hi, other_hi);
+            }
+        }
+        all_reduce_unfold(data, n, pof2);
+    }
+
+
+    template <typename T, typename Op>
+    void all_reduce_hierarchical(T* data, std::size_t n, const Op& op) const
+    {
+        if (! shared->hierarchy)
+        {
+            auto node = split_shared();
+            auto leaders = split(node.rank() == 0 ? 0 : -1, rank());
+            shared->hierarchy.reset(new std::pair<Communicator, Communicator>(std::move(node), std::move(leaders)));
+        }
+        auto& node = shared->hierarchy->first;
+        auto& leaders = shared->hierarchy->second;
+        auto type = detail::datatype<T>();
+        auto mpi_op = detail::make_op<T>(op);
+
+        MPI_Reduce(node.rank() == 0 ? MPI_IN_PLACE : data, data, n, type, mpi_op, 0, node.comm);
+
+        if (! leaders.is_null() && leaders.size() > 1)
+        {
+            auto algorithm = tuning().select("all_reduce", leaders.size(), n * sizeof(T));
+
+            if (algorithm == Algorithm::hierarchical)
+            {
+                algorithm = Algorithm::native;
+            }
+            auto values = leaders.all_reduce(std::vector<T>(data, data + n), op, algorithm);
+            std::copy(values.begin(), values.end(), data);
+        }
+        MPI_Bcast(data, n * sizeof(T), MPI_BYTE, 0, node.comm);
+    }
+
+
+    /**
+     * Create a collective request with a zeroed result buffer of sizeof(T),
+     * and a scratch area whose first sizeof(T) bytes hold the given value.
+     */
+    template <typename T>
+    static Request make_collective_request(const T& value)
+    {
+        auto res = Request(std::string(sizeof(T), 0));
+        auto result = T();
+        std::memcpy(&res.buffer->at(0), &result, sizeof(T));
+        res.scratch.reset(new std::string(2 * sizeof(T), 0));
+        std::memcpy(&res.scratch->at(0), &value, sizeof(T));
+        res.collective = true;
+        return res;
+    }
+
+
+    /**
+     * Split a flat ragged array into one vector per rank.
+     */
+    template <typename T>
+    static std::vector<std::vector<T>> unflatten(const std::vector<T>& values, const std::vector<int>& counts)
+    {
+        auto res = std::vector<std::vector<T>>(counts.size());
+        auto item = values.begin();
+
+        for (std::size_t i = 0; i < res.size(); ++i)
+        {
+            res[i].assign(item, item + counts[i]);
+            item += counts[i];
+        }
+        return res;
+    }
+
+
+    /**
+     * Implements the sized bcast for contiguous containers (vector, string).
+     * The header is a fixed-size block holding the element count and, if it
+     * fits, the payload itself.
+     */
+    template <typename Container>
+    void bcast_container(int root, Container& container, std::size_t item_size) const
+    {
+        const std::size_t bcast_eager_bytes = 256;
+        const std::size_t bcast_chunk_bytes = 1 << 22;
+        const std::size_t capacity = bcast_eager_bytes - sizeof(std::uint64_t);
+        char header[bcast_eager_bytes];
+        auto count = std::uint64_t(container.size());
+
+        if (rank() == root)
+        {
+            std::memcpy(header, &count, sizeof(count));
+
+            if (count * item_size <= capacity && count > 0)
+            {
+                std::memcpy(header + sizeof(count), &container[0], count * item_size);
+            }
+        }
+
+        MPI_Bcast(header, bcast_eager_bytes, MPI_CHAR, root, comm);
+        std::memcpy(&count, header, sizeof(count));
+
+        if (rank() != root)
+        {
+            container.resize(count);
+        }
+
+        if (count == 0)
+        {
+            return;
+        }
+
+        auto bytes = count * item_size;
+        auto data = reinterpret_cast<char*>(&container[0]);
+
+        if (bytes <= capacity)
+        {
+            if (rank() != root)
+            {
+                std::memcpy(data, header + sizeof(count), bytes);
+            }
+            return;
+        }
+
+        auto requests = std::vector<MPI_Request>();
+
+        for (std::size_t offset = 0; offset < bytes; offset += bcast_chunk_bytes)
+        {
+            auto chunk = std::min(bcast_chunk_bytes, bytes - offset);
+            requests.emplace_back();
+            MPI_Ibcast(data + offset, int(chunk), MPI_CHAR, root, comm, &requests.back());
+        }
+        MPI_Waitall(requests.size(), &requests[0], MPI_STATUSES_IGNORE);
+    }
+
+
+    /**
+     * The NBX algorithm behind the sparse exchanges. For each message, the
+     * receive function is called with its source and item count, and returns
+     * where to put the items.
+     */
+    template <typename T, typename Receive>
+    void sparse_exchange(const std::vector<T>& sendbuf, const std::vector<int>& sendcounts, Receive receive) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+        if (int(sendcounts.size()) != size())
+        {
+            throw std::invalid_argument("sparse_exchange send counts must equal the comm size");
+        }
+
+        // Consecutive rounds alternate tags, since a rank may start sending
+        // in the next round before a slower one has seen the barrier finish.
+        auto tag = detail::sparse_tag + (shared->sparse_rounds++ % 2);
+        auto c = library().comm;
+        auto sends = std::vector<MPI_Request>();
+        auto offset = std::size_t(0);
+
+        for (int q = 0; q < size(); ++q)
+        {
+            if (q == rank())
+            {
+                std::copy(sendbuf.begin() + offset, sendbuf.begin() + offset + sendcounts[q], receive(q, sendcounts[q]));
+            }
+            else if (sendcounts[q] > 0)
+            {
+                sends.emplace_back();
+                MPI_Issend(sendbuf.data() + offset, sendcounts[q], detail::datatype<T>(), q, tag, c, &sends.back());
+            }
+            offset += sendcounts[q];
+        }
+
+        auto barrier = MPI_REQUEST_NULL;
+        auto done = 0;
+
+        while (! done)
+        {
+            auto flag = 0;
+            auto status = MPI_Status();
+            MPI_Iprobe(MPI_ANY_SOURCE, tag, c, &flag, &status);
+
+            if (flag)
+            {
+                auto count = 0;
+                MPI_Get_count(&status, detail::datatype<T>(), &count);
+                MPI_Recv(receive(status.MPI_SOURCE, count), count, detail::datatype<T>(), status.MPI_SOURCE, tag, c, MPI_STATUS_IGNORE);
+            }
+            if (barrier == MPI_REQUEST_NULL)
+            {
+                auto sent = 0;
+                MPI_Testall(sends.size(), sends.data(), &sent, MPI_STATUSES_IGNORE);
+
+                if (sent)
+                {
+                    MPI_Ibarrier(c, &barrier);
+                }
+            }
+            else
+            {
+                MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+            }
+        }
+    }
+
+
+    // ========================================================================
+    /**
+     * The MPI communicator shared by copies of a Communicator, along with
+     * the state that must be common to everything using its context: the
+     * library communicator, the node-level split used by hierarchical
+     * reductions, and the count of sparse exchanges, which alternate between
+     * two tags. The communicator is not freed if MPI has already been
+     * finalized.
+     */
+    struct handle
+    {
+        handle(MPI_Comm comm) : comm(comm) {}
+
+        ~handle()
+        {
+            auto finalized = 0;
+            MPI_Finalized(&finalized);
+            hierarchy.reset();
+            library.reset();
+
+            if (! finalized)
+            {
+                MPI_Comm_free(&comm);
+            }
+        }
+        MPI_Comm comm;
+        std::unique_ptr<Communicator> library;
+        std::unique_ptr<std::pair<Communicator, Communicator>> hierarchy;
+        int sparse_rounds = 0;
+        std::map<int, int> free_tags = {{detail::tag_space_begin, detail::tag_space_end - detail::tag_space_begin}};
+    };
+
+    /**
+     * Wrap a newly created MPI communicator. Unless it is itself a library
+     * communicator, it gets a duplicate for the messages of the library's
+     * own algorithms (see library()). This is done here, where every rank
+     * is creating the communicator anyway, since point-to-point methods like
+     * neighbor_exchange_append can not create it collectively later.
+     */
+    static Communicator adopt(MPI_Comm comm, bool with_library=true)
+    {
+        Communicator res;
+
+        if (comm != MPI_COMM_NULL)
+        {
+            res.comm = comm;
+            res.shared = std::make_shared<handle>(comm);
+
+            if (with_library)
+            {
+                auto library = MPI_Comm(MPI_COMM_NULL);
+                MPI_Comm_dup(comm, &library);
+                res.shared->library.reset(new Communicator(adopt(library, false)));
+            }
+        }
+        return res;
+    }
+
+
+    /**
+     * Return the communicator used for the library's point-to-point traffic:
+     * the allreduce algorithms, sparse and neighbor exchanges, and the
+     * persistent exchanges of ext::dist_csr and ext::amr. It has the same
+     * group as this one but its own context, so none of those messages can
+     * match a user's receive, even one with any_tag.
+     */
+    const Communicator& library() const
+    {
+        return *shared->library;
+    }
+
+    static Communicator& world()
+    {
+        static Communicator res;
+        return res;
+    }
+
+    friend Communicator comm_world();
+    friend class Session;
+    friend class TagSpace;
+    template <typename T> friend class ext::dist_csr;
+    friend class ext::amr;
+    MPI_Comm comm = MPI_COMM_NULL;
+    std::shared_ptr<handle> shared;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Return a handle to a duplicate of MPI_COMM_WORLD. The duplicate is made on
+ * the first call, and shared by all later ones, so this is cheap and not a
+ * collective operation. The Session releases it before finalizing MPI.
+ */
+mpi::Communicator mpi::comm_world()
+{
+    auto& world = Communicator::world();
+
+    if (world.is_null())
+    {
+        auto res = MPI_Comm(MPI_COMM_NULL);
+        MPI_Comm_dup(MPI_COMM_WORLD, &res);
+        world = Communicator::adopt(res);
+    }
+    return world;
+}
+
+
+
+
+// ============================================================================
+/**
+ * A block of message tags reserved on a communicator, so that several
+ * modules can share one communicator without their messages matching, and
+ * without each paying for a dup() and its context id. The block is taken
+ * from the tags between detail::tag_space_begin (16384) and the tags the
+ * library reserves for itself, and is returned when the TagSpace goes out
+ * of scope; tags chosen by hand should stay below 16384. The methods mirror
+ * the Communicator's point-to-point methods, but take tags local to the
+ * block, from 0 to size() - 1:
+ *
+ *              auto halo = mpi::TagSpace(comm, 8);
+ *              halo.send(value, right, 3);
+ *              auto x = halo.recv<double>(left, 3);
+ *
+ * Reserving and releasing blocks are local operations, but every rank must
+ * do them in the same order, so that the ranks agree on the blocks. Wildcard
+ * tags are not supported, since MPI can not match a range of tags.
+ */
+class mpi::TagSpace
+{
+public:
+
+
+    /**
+     * Default constructor, creates an empty block.
+     */
+    TagSpace() {}
+
+
+    /**
+     * Reserve a block of count tags on the given communicator. Throws
+     * std::length_error if no free block is large enough.
+     */
+    TagSpace(const Communicator& comm, int count) : comm(comm)
+    {
+        if (comm.is_null() || count <= 0)
+        {
+            throw std::invalid_argument("TagSpace needs a communicator and a positive count");
+        }
+        auto& free_tags = comm.shared->free_tags;
+
+        for (auto it = free_tags.begin(); it != free_tags.end(); ++it)
+        {
+            if (it->second >= count)
+            {
+                first = it->first;
+                width = count;
+
+                if (it->second > count)
+                {
+                    free_tags[first + count] = it->second - count;
+                }
+                free_tags.erase(it);
+                return;
+            }
+        }
+        throw std::length_error("no free block of " + std::to_string(count) + " tags");
+    }
+
+
+    /**
+     * TagSpace is a unique object, no copies are permitted.
+     */
+    TagSpace(const TagSpace& other) = delete;
+    TagSpace& operator=(const TagSpace& other) = delete;
+
+
+    /**
+     * Move constructor and assignment, steal ownership of the other.
+     */
+    TagSpace(TagSpace&& other)
+    : comm(std::move(other.comm))
+    , first(other.first)
+    , width(other.width)
+    {
+        other.width = 0;
+    }
+
+    TagSpace& operator=(TagSpace&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            comm = std::move(other.comm);
+            first = other.first;
+            width = other.width;
+            other.width = 0;
+        }
+        return *this;
+    }
+
+
+    /**
+     * Destructor, returns the tags to the communicator.
+     */
+    ~TagSpace()
+    {
+        release();
+    }
+
+
+    /**
+     * Return the communicator the tags are reserved on.
+     */
+    const Communicator& communicator() const
+    {
+        return comm;
+    }
+
+
+    /**
+     * Return the number of tags in the block.
+     */
+    int size() const
+    {
+        return width;
+    }
+
+
+    /**
+     * Return the communicator tag for a tag local to this block. Throws
+     * std::out_of_range if the local tag is not in the block.
+     */
+    int tag(int local) const
+    {
+        if (local < 0 || local >= width)
+        {
+            throw std::out_of_range("tag " + std::to_string(local) + " is outside a block of " + std::to_string(width));
+        }
+        return first + local;
+    }
+
+
+    /**
+     * Return the local tag for a communicator tag, e.g. of a status, or -1
+     * if the tag is not in this block.
+     */
+    int local_tag(int tag) const
+    {
+        return tag >= first && tag < first + width ? tag - first : -1;
+    }
+
+
+    // ========================================================================
+    Status probe(int rank, int local) const { return comm.probe(rank, tag(local)); }
+    Status iprobe(int rank, int local) const { return comm.iprobe(rank, tag(local)); }
+    std::string recv(int source, int local) const { return comm.recv(source, tag(local)); }
+    Request irecv(int source, int local) const { return comm.irecv(source, tag(local)); }
+    void send(std::string buf, int rank, int local=0) const { comm.send(std::move(buf), rank, tag(local)); }
+    Request isend(std::string buf, int rank, int local=0) const { return comm.isend(std::move(buf), rank, tag(local)); }
+
+    template <typename T>
+    void send(const T& value, int rank, int local=0) const { comm.send(value, rank, tag(local)); }
+
+    template <typename T>
+    Request isend(const T& value, int rank, int local=0) const { return comm.isend(value, rank, tag(local)); }
+
+    template <typename T>
+    T recv(int rank, int local=0) const { return comm.recv<T>(rank, tag(local)); }
+
+    template <typename T>
+    void sendrecv(const T* sendbuf, std::size_t sendcount, int dest, T* recvbuf, std::size_t recvcount, int source, int local=0) const
+    {
+        comm.sendrecv(sendbuf, sendcount, dest, recvbuf, recvcount, source, tag(local));
+    }
+
+    template <typename T>
+    Request send_init(const T* data, std::size_t count, int rank, int local=0) const { return comm.send_init(data, count, rank, tag(local)); }
+
+    template <typename T>
+    Request recv_init(T* data, std::size_t count, int rank, int local=0) const { return comm.recv_init(data, count, rank, tag(local)); }
+
+
+private:
+    // ========================================================================
+    /**
+     * Return the block to the communicator's free list, merging it with
+     * free neighbors.
+     */
+    void release()
+    {
+        if (width == 0 || comm.is_null())
+        {
+            return;
+        }
+        auto& free_tags = comm.shared->free_tags;
+        auto it = free_tags.emplace(first, width).first;
+        auto next = std::next(it);
+
+        if (next != free_tags.end() && it->first + it->second == next->first)
+        {
+            it->second += next->second;
+            free_tags.erase(next);
+        }
+        if (it != free_tags.begin())
+        {
+            auto prev = std::prev(it);
+
+            if (prev->first + prev->second == it->first)
+            {
+                prev->second += it->second;
+                free_tags.erase(it);
+            }
+        }
+        width = 0;
+    }
+
+    Communicator comm;
+    int first = 0;
+    int width = 0;
+};
+
+
+
+
+// ============================================================================
+#include <fstream>
+#include <iostream>
+
+/**
+ * Initialize MPI, and load the collective tuning profile written by the
+ * autotuner (./mpi-plus tune), if there is one. The profile is read from the
+ * file named by the MPI_PLUS_TUNING environment variable, or else from
+ * mpi-plus.tuning in the working directory. Rank 0 reads the file and
+ * broadcasts it, so that every rank makes the same algorithm choices. A
+ * malformed profile is ignored with a warning, keeping the default table,
+ * since throwing here would leave MPI initialized with no Session to
+ * finalize it.
+ */
+mpi::Session::Session()
+{
+    MPI_Init(0, nullptr);
+
+    auto comm = comm_world();
+    auto profile = std::string();
+
+    if (comm.rank() == 0)
+    {
+        auto env = std::getenv("MPI_PLUS_TUNING");
+        auto file = std::ifstream(env ? env : "mpi-plus.tuning");
+        profile.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    comm.bcast(0, profile);
+
+    try
+    {
+        tuning().load(profile);
+    }
+    catch (const std::invalid_argument& e)
+    {
+        tuning() = TuningTable();
+
+        if (comm.rank() == 0)
+        {
+            std::cerr << "mpi-plus: ignoring the tuning profile (" << e.what() << ")\n";
+        }
+    }
+}
+
+
+/**
+ * Release the shared duplicate of MPI_COMM_WORLD, and finalize MPI.
+ */
+mpi::Session::~Session()
+{
+    Communicator::world().close();
+    MPI_Finalize();
+}
+
+
+
+
+// ============================================================================
+class mpi::ext::log
+{
+public:
+
+
+    // ========================================================================
+    using char_type    = std::stringstream::char_type;
+    using traits_type  = std::stringstream::traits_type;
+    using ostream_type = std::basic_ostream<char_type, traits_type>;
+
+
+    // ========================================================================
+    log(const Communicator& comm, std::ostream& stream)
+    : comm(comm)
+    , stream(stream)
+    {
+    }
+
+    log(const log& other)
+    : comm(other.comm)
+    , stream(other.stream)
+    {
+    }
+
+    ~log()
+    {
+        flush();
+    }
+
+    log only(int rank) const
+    {
+        auto res = *this;
+        res.active_rank = rank;
+        return res;
+    }
+
+    log& operator<<(ostream_type& os(ostream_type&))
+    {
+        buffer << os;
+        return *this;
+    }
+
+    template <typename T>
+    log& operator<<(const T& value)
+    {
+        buffer << value;
+        return *this;
+    }
+
+    log& flush()
+    {
+        if (active_rank == -1)
+        {
+            for (int n = 0; n < comm.size(); ++n)
+            {
+                if (n == comm.rank())
+                {
+                    stream << buffer.str();
+                }
+                comm.barrier();
+            }
+        }
+        else if (comm.rank() == active_rank)
+        {
+            stream << buffer.str();
+        }
+        stream.clear();
+        return *this;
+    }
+
+private:
+    // ========================================================================
+    const Communicator& comm;
+    std::ostream& stream;
+    std::stringstream buffer;
+    int active_rank = -1;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A vector distributed over the ranks of a communicator, each rank holding a
+ * contiguous block of the global vector. Provides the level-1 operations of
+ * Krylov solvers. The global reductions (dot, norm) are blocking; to overlap
+ * them with other work, collect several local dot products into an
+ * ext::fused_reduction and start them as one non-blocking all-reduce. The
+ * communicator must outlive the vector.
+ */
+template <typename T>
+class mpi::ext::dist_vector
+{
+public:
+
+
+    // ========================================================================
+    dist_vector(const Communicator& comm, std::size_t local_size, T value=T())
+    : comm(comm)
+    , values(local_size, value)
+    , offset(comm.exscan(std::uint64_t(local_size)))
+    {
+    }
+
+    dist_vector(const dist_vector& other) = default;
+
+    dist_vector& operator=(const dist_vector& other)
+    {
+        values = other.values;
+        offset = other.offset;
+        return *this;
+    }
+
+    const Communicator& communicator() const { return comm; }
+    std::size_t size() const { return values.size(); }
+    std::uint64_t global_offset() const { return offset; }
+    T* data() { return values.data(); }
+    const T* data() const { return values.data(); }
+    T& operator[](std::size_t i) { return values[i]; }
+    const T& operator[](std::size_t i) const { return values[i]; }
+
+
+    /**
+     * Return the dot product of the local blocks of this and another vector.
+     */
+    T local_dot(const dist_vector& other) const
+    {
+        auto res = T();
+
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            res += values[i] * other.values[i];
+        }
+        return res;
+    }
+
+
+    /**
+     * Return the global dot product with another vector (blocking).
+     */
+    T dot(const dist_vector& other) const
+    {
+        return comm.all_reduce(local_dot(other));
+    }
+
+
+    /**
+     * Return the global 2-norm (blocking).
+     */
+    T norm() const
+    {
+        return std::sqrt(dot(*this));
+    }
+
+
+    /**
+     * this += a * x
+     */
+    dist_vector& axpy(T a, const dist_vector& x)
+    {
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            values[i] += a * x.values[i];
+        }
+        return *this;
+    }
+
+
+    /**
+     * this = a * x + b * this
+     */
+    dist_vector& axpby(T a, const dist_vector& x, T b)
+    {
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            values[i] = a * x.values[i] + b * values[i];
+        }
+        return *this;
+    }
+
+
+private:
+    // ========================================================================
+    const Communicator& comm;
+    std::vector<T> values;
+    std::uint64_t offset;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Several global sums (typically dot products) combined into a single
+ * non-blocking all-reduce, so that back-to-back scalar reductions cost one
+ * latency, and that latency can be hidden behind other work, e.g. the next
+ * matrix-vector product in a pipelined CG iteration:
+ *
+ *              auto dots = mpi::ext::fused_reduction<double>(comm);
+ *
+ *              dots.reset();
+ *              auto rr = dots.add_dot(r, r);
+ *              auto wr = dots.add_dot(w, r);
+ *              dots.start();
+ *              apply_matrix(w, q);            // overlaps the reduction
+ *              auto gamma = dots[rr];         // waits
+ *
+ * The all-reduce is a persistent request, created on the first start and
+ * reused as long as the number of terms stays the same.
+ */
+template <typename T>
+class mpi::ext::fused_reduction
+{
+public:
+
+
+    // ========================================================================
+    fused_reduction(const Communicator& comm) : comm(comm)
+    {
+    }
+
+    /**
+     * Clear the terms, ready to add the next batch.
+     */
+    void reset()
+    {
+        request.wait();
+        count = 0;
+        started = false;
+    }
+
+    /**
+     * Add a local value to be summed over all ranks. Returns its index.
+     */
+    std::size_t add(T local_value)
+    {
+        if (started)
+        {
+            throw std::logic_error("fused_reduction: terms cannot be added after start");
+        }
+        if (count == local.size())
+        {
+            local.push_back(T());
+        }
+        local[count] = local_value;
+        return count++;
+    }
+
+    /**
+     * Add the dot product of two distributed vectors. Returns its index.
+     */
+    std::size_t add_dot(const dist_vector<T>& a, const dist_vector<T>& b)
+    {
+        return add(a.local_dot(b));
+    }
+
+    /**
+     * Start the all-reduce of the terms added so far.
+     */
+    void start()
+    {
+        if (! request.is_persistent() || local.size() != count || global.size() != count)
+        {
+            request = Request();
+            local.resize(count);
+            request = comm.all_reduce_init(local, global);
+        }
+        request.start();
+        started = true;
+    }
+
+    /**
+     * Block until the all-reduce has completed.
+     */
+    void wait()
+    {
+        request.wait();
+    }
+
+    /**
+     * Return the global sum of the term with the given index, waiting for
+     * the all-reduce if necessary.
+     */
+    T operator[](std::size_t index)
+    {
+        wait();
+        return global.at(index);
+    }
+
+
+private:
+    // ========================================================================
+    const Communicator& comm;
+    std::vector<T> local;
+    std::vector<T> global;
+    std::size_t count = 0;
+    bool started = false;
+    Request request;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A sparse matrix distributed by blocks of rows, for distributed
+ * matrix-vector products with ext::dist_vector. Each rank holds its rows in
+ * CSR format with global column indexes, and the columns are distributed the
+ * same way as the rows (the matrix is square).
+ *
+ * The communication plan is computed once, in the constructor: which remote
+ * vector entries (ghosts) each rank needs, and which of its own entries it
+ * must send to whom. The matrix is then split into a local part (columns
+ * owned by this rank, renumbered, with 32-bit indexes) and a ghost part
+ * (rows referencing remote columns only). A multiply starts persistent
+ * sends and receives of the ghosts, applies the local part while they are
+ * in flight, and then adds the ghost part. The ghosts travel on a tag of
+ * their own on the library communicator, so that exchanges of different
+ * matrices, or of other modules, can not match each other's messages.
+ */
+template <typename T>
+class mpi::ext::dist_csr
+{
+public:
+
+
+    // ========================================================================
+    dist_csr(
+        const Communicator& comm,
+        const std::vector<std::size_t>& row_ptr,
+        const std::vector<std::uint64_t>& cols,
+        const std::vector<T>& values)
+    : tags(comm.library(), 1)
+    {
+        auto rows = row_ptr.size() - 1;
+        auto first = comm.exscan(std::uint64_t(rows));
+        auto starts = comm.all_gather(first);
+        auto owner = [&] (std::uint64_t c) { return int(std::upper_bound(starts.begin(), starts.end(), c) - starts.begin()) - 1; };
+        auto is_local = [&] (std::uint64_t c) { return c >= first && c < first + rows; };
+
+        // Find the distinct remote columns. Sorting them groups them by
+        // owner, and gives each its index in the ghost buffer.
+        auto remote = std::vector<std::uint64_t>();
+
+        for (auto c : cols)
+        {
+            if (! is_local(c))
+            {
+                remote.push_back(c);
+            }
+        }
+        std::sort(remote.begin(), remote.end());
+        remote.erase(std::unique(remote.begin(), remote.end()), remote.end());
+
+        // Split the rows into the local and ghost parts.
+        local_ptr.push_back(0);
+
+        for (std::size_t i = 0; i < rows; ++i)
+        {
+            auto has_ghosts = false;
+
+            for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k)
+            {
+                if (is_local(cols[k]))
+                {
+                    local_col.push_back(cols[k] - first);
+                    local_val.push_back(values[k]);
+                }
+                else
+                {
+                    if (! has_ghosts)
+                    {
+                        ghost_row.push_back(i);
+                        ghost_ptr.push_back(ghost_col.size());
+                        has_ghosts = true;
+                    }
+                    ghost_col.push_back(std::lower_bound(remote.begin(), remote.end(), cols[k]) - remote.begin());
+                    ghost_val.push_back(values[k]);
+                }
+            }
+            local_ptr.push_back(local_col.size());
+        }
+        ghost_ptr.push_back(ghost_col.size());
+
+        // Tell each owner which of its entries this rank needs, and learn
+        // which of this rank's entries the others need.
+        auto wanted = std::vector<std::vector<std::uint64_t>>(comm.size());
+
+        for (auto c : remote)
+        {
+            wanted[owner(c)].push_back(c);
+        }
+        auto requested = comm.all_to_all(wanted);
+
+        // Build the persistent exchange.
+        ghosts.resize(remote.size());
+        auto offset = std::size_t(0);
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            if (! wanted[q].empty())
+            {
+                exchange.add(tags.recv_init(ghosts.data() + offset, wanted[q].size(), q));
+                offset += wanted[q].size();
+            }
+            for (auto c : requested[q])
+            {
+                send_index.push_back(c - first);
+            }
+        }
+        outgoing.resize(send_index.size());
+        offset = 0;
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            if (! requested[q].empty())
+            {
+                exchange.add(tags.send_init(outgoing.data() + offset, requested[q].size(), q));
+                offset += requested[q].size();
+            }
+        }
+    }
+
+
+    /**
+     * Return the number of rows owned by this rank.
+     */
+    std::size_t rows() const
+    {
+        return local_ptr.size() - 1;
+    }
+
+
+    /**
+     * Return the number of remote vector entries this rank receives for each
+     * multiply.
+     */
+    std::size_t ghost_count() const
+    {
+        return ghosts.size();
+    }
+
+
+    /**
+     * y = A x
+     */
+    void multiply(const dist_vector<T>& x, dist_vector<T>& y)
+    {
+        for (std::size_t k = 0; k < send_index.size(); ++k)
+        {
+            outgoing[k] = x[send_index[k]];
+        }
+        exchange.start_all();
+
+        multiply_local(x.data(), y.data());
+
+        exchange.wait_all();
+
+        multiply_ghost(y.data());
+    }
+
+
+private:
+    // ========================================================================
+    void multiply_local(const T* __restrict x, T* __restrict y) const
+    {
+        auto ptr = local_ptr.data();
+        auto col = local_col.data();
+        auto val = local_val.data();
+
+        for (std::size_t i = 0; i < rows(); ++i)
+        {
+            auto sum = T();
+
+            for (auto k = ptr[i]; k < ptr[i + 1]; ++k)
+            {
+                sum += val[k] * x[col[k]];
+            }
+            y[i] = sum;
+        }
+    }
+
+    void multiply_ghost(T* __restrict y) const
+    {
+        for (std::size_t b = 0; b < ghost_row.size(); ++b)
+        {
+            auto sum = T();
+
+            for (auto k = ghost_ptr[b]; k < ghost_ptr[b + 1]; ++k)
+            {
+                sum += ghost_val[k] * ghosts[ghost_col[k]];
+            }
+            y[ghost_row[b]] += sum;
+        }
+    }
+
+    TagSpace tags;
+    std::vector<std::size_t> local_ptr;
+    std::vector<std::uint32_t> local_col;
+    std::vector<T> local_val;
+    std::vector<std::size_t> ghost_row;
+    std::vector<std::size_t> ghost_ptr;
+    std::vector<std::uint32_t> ghost_col;
+    std::vector<T> ghost_val;
+    std::vector<std::size_t> send_index;
+    std::vector<T> outgoing;
+    std::vector<T> ghosts;
+    RequestSet exchange;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A simple in-place 1D complex FFT of a fixed length. Uses recursive
+ * mixed-radix Cooley-Tukey on the prime factors of the length, with
+ * precomputed twiddles; prime factors are done as direct DFT's, so lengths
+ * with large prime factors are slow. Transforms are unnormalized. This is
+ * the 1D transform used by ext::fft3d.
+ */
+class mpi::ext::fft_kernel
+{
+public:
+
+
+    // ========================================================================
+    using complex = std::complex<double>;
+
+
+    // ========================================================================
+    fft_kernel(std::size_t n) : n(n), twiddle(n), work(n)
+    {
+        for (std::size_t j = 0; j < n; ++j)
+        {
+            twiddle[j] = std::polar(1.0, -2 * M_PI * double(j) / double(n));
+        }
+        for (auto m = n, p = std::size_t(2); m > 1; )
+        {
+            if (m % p == 0)
+            {
+                factors.push_back(p);
+                m /= p;
+            }
+            else
+            {
+                p += p == 2 ? 1 : 2;
+                p = p * p > m ? m : p;
+            }
+        }
+    }
+
+    /**
+     * Transform the n values at data in place; sign is -1 for the forward
+     * transform and +1 for the inverse.
+     */
+    void operator()(complex* data, int sign) const
+    {
+        if (n > 1)
+        {
+            std::copy(data, data + n, work.begin());
+            transform(work.data(), 1, data, n, 1, 0, sign);
+        }
+    }
+
+
+private:
+    // ========================================================================
+    void transform(const complex* in, std::size_t stride, complex* out, std::size_t m, std::size_t tw, std::size_t level, int sign) const
+    {
+        if (m == 1)
+        {
+            out[0] = in[0];
+            return;
+        }
+        auto p = factors[level];
+        auto q = m / p;
+        complex t[64];
+        auto tmp = p <= 64 ? t : new complex[p];
+
+        for (std::size_t r = 0; r < p; ++r)
+        {
+            transform(in + r * stride, stride * p, out + r * q, q, tw * p, level + 1, sign);
+        }
+        for (std::size_t k = 0; k < q; ++k)
+        {
+            for (std::size_t r = 0; r < p; ++r)
+            {
+                tmp[r] = out[r * q + k] * w(r * k * tw, sign);
+            }
+            for (std::size_t s = 0; s < p; ++s)
+            {
+                auto sum = complex();
+
+                for (std::size_t r = 0; r < p; ++r)
+                {
+                    sum += tmp[r] * w(r * s * q * tw, sign);
+                }
+                out[k + s * q] = sum;
+            }
+        }
+        if (tmp != t)
+        {
+            delete [] tmp;
+        }
+    }
+
+    complex w(std::size_t j, int sign) const
+    {
+        auto z = twiddle[j % n];
+        return sign < 0 ? z : std::conj(z);
+    }
+
+    std::size_t n;
+    std::vector<std::size_t> factors;
+    std::vector<complex> twiddle;
+    mutable std::vector<complex> work;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Distributed 3D complex FFT with a slab decomposition. The n0 x n1 x n2 grid
+ * (row-major, index 2 fastest) is distributed over the ranks in slabs of
+ * whole x-planes. The forward transform does the local 1D FFTs along z and
+ * y, transposes globally so that each rank holds slabs of whole y-planes,
+ * and then does the FFTs along x. The result is left in the transposed
+ * layout, [y][x][z], and the backward transform takes it from there:
+ *
+ *              auto fft = mpi::ext::fft3d(comm, 64, 64, 64);
+ *              auto slab = std::vector<std::complex<double>>(fft.local_size());
+ *              auto spectrum = slab;
+ *              ... fill slab[(i * n1 + j) * n2 + k] for i in [fft.x_start(), + fft.x_count())
+ *              fft.forward(slab, spectrum);     // spectrum[(j * n0 + i) * n2 + k]
+ *              fft.backward(spectrum, slab);    // normalized
+ *
+ * The transposes send and receive blocks in place using strided datatypes
+ * and non-blocking all-to-all-w exchanges. They are split into batches of
+ * planes, so the exchange of one batch is in flight while the next batch is
+ * being transformed. The input buffer of each transform is overwritten.
+ * Slab decompositions limit the rank count to the grid size along x and y;
+ * a pencil decomposition is not implemented.
+ */
+class mpi::ext::fft3d
+{
+public:
+
+
+    // ========================================================================
+    using complex = std::complex<double>;
+
+
+    // ========================================================================
+    fft3d(const Communicator& comm, std::size_t n0, std::size_t n1, std::size_t n2, int batches=4)
+    : comm(comm)
+    , n0(n0), n1(n1), n2(n2)
+    , batches(batches)
+    , fft0(n0), fft1(n1), fft2(n2)
+    {
+        auto p = comm.size();
+
+        for (int q = 0; q <= p; ++q)
+        {
+            x_starts.push_back(n0 * q / p);
+            y_starts.push_back(n1 * q / p);
+        }
+        x0 = x_starts[comm.rank()];
+        y0 = y_starts[comm.rank()];
+        xc = x_starts[comm.rank() + 1] - x0;
+        yc = y_starts[comm.rank() + 1] - y0;
+
+        for (int b = 0; b < batches; ++b)
+        {
+            forward_send.emplace_back();
+            forward_recv.emplace_back();
+            backward_send.emplace_back();
+            backward_recv.emplace_back();
+
+            for (int q = 0; q < p; ++q)
+            {
+                auto qx0 = x_starts[q], qxc = x_starts[q + 1] - qx0;
+                auto qy0 = y_starts[q], qyc = y_starts[q + 1] - qy0;
+                auto mine_x = batch(xc, b), theirs_x = batch(qxc, b);
+                auto mine_y = batch(yc, b), theirs_y = batch(qyc, b);
+
+                // Forward: I send batch b of my x-planes, restricted to q's
+                // y-range, walking the block in [y][x][z] order, and receive
+                // q's batch b for my y-range into my y-slab.
+                forward_send[b].push_back(Datatype::strided<complex>(
+                    {int(qyc), int(mine_x.second), int(n2)}, {n2, n1 * n2, 1},
+                    (mine_x.first * n1 + qy0) * n2));
+                forward_recv[b].push_back(Datatype::strided<complex>(
+                    {int(yc), int(theirs_x.second), int(n2)}, {n0 * n2, n2, 1},
+                    (qx0 + theirs_x.first) * n2));
+
+                // Backward: the same, with the roles of x and y exchanged.
+                backward_send[b].push_back(Datatype::strided<complex>(
+                    {int(qxc), int(mine_y.second), int(n2)}, {n2, n0 * n2, 1},
+                    (mine_y.first * n0 + qx0) * n2));
+                backward_recv[b].push_back(Datatype::strided<complex>(
+                    {int(xc), int(theirs_y.second), int(n2)}, {n1 * n2, n2, 1},
+                    (qy0 + theirs_y.first) * n2));
+            }
+        }
+    }
+
+    std::size_t x_start() const { return x0; }
+    std::size_t x_count() const { return xc; }
+    std::size_t y_start() const { return y0; }
+    std::size_t y_count() const { return yc; }
+
+
+    /**
+     * Return the buffer size needed on this rank for both layouts.
+     */
+    std::size_t local_size() const
+    {
+        return std::max(xc * n1 * n2, yc * n0 * n2);
+    }
+
+
+    /**
+     * Forward transform from the x-slab layout [x][y][z] to the y-slab
+     * layout [y][x][z]. The input is overwritten.
+     */
+    void forward(std::vector<complex>& x_slab, std::vector<complex>& y_slab)
+    {
+        check_sizes(x_slab, y_slab);
+        auto pending = std::vector<Request>();
+
+        for (int b = 0; b < batches; ++b)
+        {
+            auto planes = batch(xc, b);
+
+            for (auto i = planes.first; i < planes.first + planes.second; ++i)
+            {
+                for (std::size_t j = 0; j < n1; ++j)
+                {
+                    fft2(&x_slab[(i * n1 + j) * n2], -1);
+                }
+                transform_strided(fft1, &x_slab[i * n1 * n2], n1, n2, n2, -1);
+                progress(pending);
+            }
+            pending.push_back(comm.iall_to_allw(x_slab.data(), forward_send[b], y_slab.data(), forward_recv[b]));
+        }
+        for (auto& r : pending)
+        {
+            r.wait();
+        }
+        for (std::size_t j = 0; j < yc; ++j)
+        {
+            transform_strided(fft0, &y_slab[j * n0 * n2], n0, n2, n2, -1);
+        }
+    }
+
+
+    /**
+     * Backward (inverse, normalized) transform from the y-slab layout
+     * [y][x][z] back to the x-slab layout [x][y][z]. The input is
+     * overwritten.
+     */
+    void backward(std::vector<complex>& y_slab, std::vector<complex>& x_slab)
+    {
+        check_sizes(x_slab, y_slab);
+        auto pending = std::vector<Request>();
+        auto scale = 1.0 / double(n0 * n1 * n2);
+
+        for (int b = 0; b < batches; ++b)
+        {
+            auto planes = batch(yc, b);
+
+            for (auto j = planes.first; j < planes.first + planes.second; ++j)
+            {
+                transform_strided(fft0, &y_slab[j * n0 * n2], n0, n2, n2, +1);
+                progress(pending);
+            }
+            pending.push_back(comm.iall_to_allw(y_slab.data(), backward_send[b], x_slab.data(), backward_recv[b]));
+        }
+        for (auto& r : pending)
+        {
+            r.wait();
+        }
+        for (std::size_t i = 0; i < xc; ++i)
+        {
+            transform_strided(fft1, &x_slab[i * n1 * n2], n1, n2, n2, +1);
+
+            for (std::size_t j = 0; j < n1; ++j)
+            {
+                auto line = &x_slab[(i * n1 + j) * n2];
+                fft2(line, +1);
+
+                for (std::size_t k = 0; k < n2; ++k)
+                {
+                    line[k] *= scale;
+                }
+            }
+        }
+    }
+
+
+private:
+    // ========================================================================
+    /**
+     * Return the (start, count) of batch b, out of count planes.
+     */
+    std::pair<std::size_t, std::size_t> batch(std::size_t count, int b) const
+    {
+        auto start = count * b / batches;
+        return {start, count * (b + 1) / batches - start};
+    }
+
+    /**
+     * Transform the 2D block data[m * stride + l], l < lines, along m, where
+     * m < n. Each line is copied to a contiguous buffer for the kernel.
+     */
+    template <typename Kernel>
+    void transform_strided(const Kernel& kernel, complex* data, std::size_t n, std::size_t stride, std::size_t lines, int sign)
+    {
+        line.resize(n);
+
+        for (std::size_t l = 0; l < lines; ++l)
+        {
+            for (std::size_t m = 0; m < n; ++m)
+            {
+                line[m] = data[m * stride + l];
+            }
+            kernel(line.data(), sign);
+
+            for (std::size_t m = 0; m < n; ++m)
+            {
+                data[m * stride + l] = line[m];
+            }
+        }
+    }
+
+    /**
+     * Give MPI a chance to move the transposes in flight along.
+     */
+    static void progress(std::vector<Request>& pending)
+    {
+        for (auto& r : pending)
+        {
+            r.is_ready();
+        }
+    }
+
+    void check_sizes(std::vector<complex>& x_slab, std::vector<complex>& y_slab) const
+    {
+        if (x_slab.size() < local_size() || y_slab.size() < local_size())
+        {
+            throw std::invalid_argument("fft3d buffers must have at least local_size() elements");
+        }
+    }
+
+    const Communicator& comm;
+    std::size_t n0, n1, n2;
+    int batches;
+    fft_kernel fft0, fft1, fft2;
+    std::vector<std::size_t> x_starts, y_starts;
+    std::size_t x0, xc, y0, yc;
+    std::vector<std::vector<Datatype>> forward_send, forward_recv;
+    std::vector<std::vector<Datatype>> backward_send, backward_recv;
+    std::vector<complex> line;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Parallel sample sort (PSRS, parallel sorting by regular sampling). Each
+ * rank sorts its items, and contributes evenly spaced samples, weighted by
+ * its item count, to rank 0, which picks p - 1 splitters at the global
+ * quantiles and broadcasts them. Items are then sent to the rank owning
+ * their bucket with an all_to_allv, and each rank merges the sorted runs it
+ * receives. Finally the result is redistributed so that every rank holds as
+ * many items as it passed in.
+ *
+ * Ties are broken by the rank and the position of an item in its local
+ * sorted run, so all items are distinct in the sort order. That keeps the
+ * buckets balanced when there are many duplicate keys, and, with a stable
+ * local sort and merges done in rank order, it also makes the whole sort
+ * stable with respect to the global order (rank, then index) of the input.
+ */
+template <typename T, typename Compare>
+std::vector<T> mpi::detail::sample_sort(const Communicator& comm, std::vector<T> values, Compare compare, bool stable)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+    struct sample
+    {
+        T value;
+        int rank;
+        std::uint64_t position;
+        std::uint64_t weight;
+    };
+
+    auto p = comm.size();
+    auto n = values.size();
+
+    if (stable)
+    {
+        std::stable_sort(values.begin(), values.end(), compare);
+    }
+    else
+    {
+        std::sort(values.begin(), values.end(), compare);
+    }
+
+    if (p == 1)
+    {
+        return values;
+    }
+
+    auto before = [&] (const sample& a, const sample& b)
+    {
+        if (compare(a.value, b.value)) return true;
+        if (compare(b.value, a.value)) return false;
+        return a.rank < b.rank || (a.rank == b.rank && a.position < b.position);
+    };
+
+
+    // Draw regular samples, each weighted by the number of items it stands
+    // for, and pick splitters at the global quantiles on rank 0.
+    // ------------------------------------------------------------------------
+    auto samples = std::vector<sample>();
+    auto num_samples = std::min(n, std::size_t(p));
+
+    for (std::size_t k = 0; k < num_samples; ++k)
+    {
+        auto position = (2 * k + 1) * n / (2 * num_samples);
+        auto weight = (k + 1) * n / num_samples - k * n / num_samples;
+        samples.push_back({values[position], comm.rank(), position, weight});
+    }
+
+    auto counts = std::vector<int>();
+    auto gathered = comm.gatherv(0, samples, counts);
+    auto splitters = std::vector<sample>();
+
+    if (comm.rank() == 0)
+    {
+        std::sort(gathered.begin(), gathered.end(), before);
+
+        auto total = std::uint64_t(0);
+        auto cumulative = std::uint64_t(0);
+        auto bucket = 1;
+
+        for (const auto& s : gathered)
+        {
+            total += s.weight;
+        }
+        for (const auto& s : gathered)
+        {
+            cumulative += s.weight;
+
+            while (bucket < p && cumulative * p >= bucket * total)
+            {
+                splitters.push_back(s);
+                ++bucket;
+            }
+        }
+    }
+    comm.bcast(0, splitters);
+
+    if (int(splitters.size()) < p - 1)
+    {
+        return values;
+    }
+
+
+    // Each splitter closes a bucket: find how many local items fall at or
+    // before it, and send those buckets away.
+    // ------------------------------------------------------------------------
+    auto sendcounts = std::vector<int>();
+    auto cut_before = std::size_t(0);
+
+    for (int q = 0; q < p; ++q)
+    {
+        auto cut = n;
+
+        if (q < p - 1)
+        {
+            const auto& s = splitters[q];
+            auto lo = std::size_t(std::lower_bound(values.begin(), values.end(), s.value, compare) - values.begin());
+            auto hi = std::size_t(std::upper_bound(values.begin(), values.end(), s.value, compare) - values.begin());
+
+            if      (comm.rank() < s.rank) cut = hi;
+            else if (comm.rank() > s.rank) cut = lo;
+            else    cut = std::max(lo, std::min(hi, std::size_t(s.position + 1)));
+        }
+        sendcounts.push_back(int(cut - cut_before));
+        cut_before = cut;
+    }
+
+    auto recvcounts = std::vector<int>();
+    auto received = comm.all_to_allv(values, sendcounts, recvcounts);
+    values = std::vector<T>();
+
+
+    // Merge the sorted runs pairwise. Lower ranks' runs stay on the left, so
+    // the merges keep ties in rank order.
+    // ------------------------------------------------------------------------
+    auto bounds = std::vector<std::size_t>{0};
+
+    for (auto c : recvcounts)
+    {
+        bounds.push_back(bounds.back() + c);
+    }
+    while (bounds.size() > 2)
+    {
+        auto merged = std::vector<std::size_t>{0};
+
+        for (std::size_t i = 2; i < bounds.size(); i += 2)
+        {
+            std::inplace_merge(
+                received.begin() + bounds[i - 2],
+                received.begin() + bounds[i - 1],
+                received.begin() + bounds[i], compare);
+            merged.push_back(bounds[i]);
+        }
+        if (bounds.size() % 2 == 0)
+        {
+            merged.push_back(bounds.back());
+        }
+        bounds = merged;
+    }
+
+
+    // Rebalance, so that each rank ends with as many items as it started
+    // with. The data is globally sorted, so each rank sends the overlap of
+    // its global index range with each rank's target range.
+    // ------------------------------------------------------------------------
+    auto targets = comm.all_gather(std::uint64_t(n));
+    auto start = comm.exscan(std::uint64_t(received.size()));
+    auto end = start + received.size();
+    auto target_start = std::uint64_t(0);
+
+    sendcounts.clear();
+
+    for (int q = 0; q < p; ++q)
+    {
+        auto target_end = target_start + targets[q];
+        auto lower = std::max(start, target_start);
+        auto upper = std::min(end, target_end);
+        sendcounts.push_back(upper > lower ? int(upper - lower) : 0);
+        target_start = target_end;
+    }
+    return comm.all_to_allv(received, sendcounts, recvcounts);
+}
+
+
+
+
+/**
+ * Sort items distributed over the ranks of a communicator, according to
+ * compare. Returns this rank's share of the globally sorted sequence, with
+ * the same number of items it passed in: the first rank gets the smallest
+ * items, and so on. The item type must be trivially copyable.
+ *
+ *              auto sorted = mpi::ext::parallel_sort(comm, particles, by_key);
+ *
+ */
+template <typename T, typename Compare>
+std::vector<T> mpi::ext::parallel_sort(const Communicator& comm, std::vector<T> values, Compare compare)
+{
+    return detail::sample_sort(comm, std::move(values), compare, false);
+}
+
+
+
+
+/**
+ * Like parallel_sort, but items that compare equal keep their order in the
+ * input, where the items on rank 0 come first, then those on rank 1, and so
+ * on.
+ */
+template <typename T, typename Compare>
+std::vector<T> mpi::ext::parallel_stable_sort(const Communicator& comm, std::vector<T> values, Compare compare)
+{
+    return detail::sample_sort(comm, std::move(values), compare, true);
+}
+
+
+
+
+// ============================================================================
+/**
+ * Space-filling curves available to ext::sfc_partition.
+ */
+enum class mpi::ext::sfc_curve
+{
+    morton,
+    hilbert,
+};
+
+
+
+
+// ============================================================================
+/**
+ * Load-balancing domain decomposition along a space-filling curve. Points
+ * in a box are mapped to 63-bit Morton or Hilbert keys (21 bits per axis),
+ * and each rank owns a contiguous segment of the curve. Since the curve
+ * keeps nearby points close together, the segments are compact regions of
+ * space, and unlike a fixed slab decomposition they can be re-cut to carry
+ * equal work however clustered the points are:
+ *
+ *              auto partition = mpi::ext::sfc_partition(comm, {0, 0, 0}, {1, 1, 1});
+ *              auto keys = partition.keys(positions);
+ *              partition.rebalance(keys, costs);
+ *              auto plan = partition.plan(keys);
+ *              positions = partition.migrate(plan, positions);
+ *              particles = partition.migrate(plan, particles);
+ *
+ * Before the first rebalance, the key space is cut into equal ranges.
+ */
+class mpi::ext::sfc_partition
+{
+public:
+
+
+    // ========================================================================
+    using point = std::array<double, 3>;
+
+
+    /**
+     * Where each of the local items should go: the destination rank of each
+     * item, and the number of items going to each rank.
+     */
+    struct migration_plan
+    {
+        std::vector<int> destinations;
+        std::vector<int> sendcounts;
+    };
+
+
+    // ========================================================================
+    sfc_partition(const Communicator& comm, point lower, point upper, sfc_curve curve=sfc_curve::hilbert)
+    : comm(comm)
+    , lower(lower)
+    , upper(upper)
+    , curve(curve)
+    {
+        for (int q = 1; q < comm.size(); ++q)
+        {
+            boundaries.push_back(std::uint64_t(double(max_key) * q / comm.size()));
+        }
+    }
+
+
+    /**
+     * Return the curve key of each of the given points. Points outside the
+     * box are clamped to it.
+     */
+    std::vector<std::uint64_t> keys(const std::vector<point>& points) const
+    {
+        auto res = std::vector<std::uint64_t>(points.size());
+        auto x = std::vector<std::uint32_t>(points.size());
+        auto y = std::vector<std::uint32_t>(points.size());
+        auto z = std::vector<std::uint32_t>(points.size());
+
+        quantize(points, 0, x);
+        quantize(points, 1, y);
+        quantize(points, 2, z);
+
+        if (curve == sfc_curve::morton)
+        {
+            for (std::size_t i = 0; i < points.size(); ++i)
+            {
+                res[i] = spread(x[i]) << 2 | spread(y[i]) << 1 | spread(z[i]);
+            }
+        }
+        else
+        {
+            for (std::size_t i = 0; i < points.size(); ++i)
+            {
+                res[i] = hilbert(x[i], y[i], z[i]);
+            }
+        }
+        return res;
+    }
+
+
+    /**
+     * Re-cut the curve so that each rank's segment carries an equal share of
+     * the total weight. The keys and weights of all items are sorted
+     * globally, and the new boundaries are the keys at which the running sum
+     * of the weights crosses a multiple of the total divided by the number
+     * of ranks. This is a collective operation.
+     */
+    void rebalance(const std::vector<std::uint64_t>& keys, const std::vector<double>& weights)
+    {
+        if (keys.size() != weights.size())
+        {
+            throw std::invalid_argument("sfc_partition::rebalance needs one weight per key");
+        }
+        struct weighted_key
+        {
+            std::uint64_t key;
+            double weight;
+        };
+
+        auto items = std::vector<weighted_key>();
+
+        for (std::size_t i = 0; i < keys.size(); ++i)
+        {
+            items.push_back({keys[i], weights[i]});
+        }
+        items = parallel_sort(comm, items, [] (const weighted_key& a, const weighted_key& b) { return a.key < b.key; });
+
+        auto local = 0.0;
+
+        for (const auto& item : items)
+        {
+            local += item.weight;
+        }
+        auto cumulative = comm.exscan(local);
+        auto total = comm.all_reduce(local);
+
+        if (total <= 0.0)
+        {
+            return;
+        }
+
+        // The boundary at the start of segment b is the first key with a
+        // running weight sum reaching b / p of the total; earlier ranks hold
+        // smaller keys, so a min-reduction over ranks finds it.
+        auto p = comm.size();
+        auto firsts = std::vector<std::uint64_t>(p - 1, max_key);
+        auto next = 1;
+
+        for (const auto& item : items)
+        {
+            auto segment = std::min(p - 1, int(cumulative * p / total));
+
+            for (; next <= segment; ++next)
+            {
+                firsts[next - 1] = item.key;
+            }
+            cumulative += item.weight;
+        }
+        boundaries = comm.all_reduce(firsts, mpi::min<std::uint64_t>());
+    }
+
+
+    /**
+     * Return the rank owning the given key.
+     */
+    int owner(std::uint64_t key) const
+    {
+        return std::upper_bound(boundaries.begin(), boundaries.end(), key) - boundaries.begin();
+    }
+
+
+    /**
+     * Return the plan for sending each item to the owner of its key.
+     */
+    migration_plan plan(const std::vector<std::uint64_t>& keys) const
+    {
+        auto res = migration_plan();
+        res.sendcounts.resize(comm.size(), 0);
+
+        for (auto key : keys)
+        {
+            res.destinations.push_back(owner(key));
+            res.sendcounts[res.destinations.back()]++;
+        }
+        return res;
+    }
+
+
+    /**
+     * Send the local items to their destinations according to the plan, and
+     * return the items received, in order of the source rank. The items go
+     * out in one stable pass over the data, and the exchange only involves
+     * ranks that actually trade items. This is a collective operation; any
+     * number of item arrays can be moved with the same plan.
+     */
+    template <typename T>
+    std::vector<T> migrate(const migration_plan& plan, const std::vector<T>& items) const
+    {
+        if (items.size() != plan.destinations.size())
+        {
+            throw std::invalid_argument("sfc_partition::migrate needs one item per destination");
+        }
+        auto offsets = std::vector<std::size_t>{0};
+        auto sendbuf = std::vector<T>(items.size());
+        auto recvcounts = std::vector<int>();
+
+        for (auto c : plan.sendcounts)
+        {
+            offsets.push_back(offsets.back() + c);
+        }
+        for (std::size_t i = 0; i < items.size(); ++i)
+        {
+            sendbuf[offsets[plan.destinations[i]]++] = items[i];
+        }
+        return comm.sparse_exchange(sendbuf, plan.sendcounts, recvcounts);
+    }
+
+
+    /**
+     * Return the first key owned by each rank but the first.
+     */
+    const std::vector<std::uint64_t>& segment_boundaries() const
+    {
+        return boundaries;
+    }
+
+
+private:
+    // ========================================================================
+    static constexpr int bits = 21;
+    static constexpr std::uint64_t max_key = (std::uint64_t(1) << (3 * bits)) - 1;
+
+    void quantize(const std::vector<point>& points, int axis, std::vector<std::uint32_t>& result) const
+    {
+        auto cells = double(1 << bits);
+        auto scale = cells / (upper[axis] - lower[axis]);
+
+        for (std::size_t i = 0; i < points.size(); ++i)
+        {
+            auto u = (points[i][axis] - lower[axis]) * scale;
+            result[i] = std::uint32_t(std::max(0.0, std::min(cells - 1, u)));
+        }
+    }
+
+    /**
+     * Spread the low 21 bits of x out to every third bit of the result.
+     * Branch-free, so loops over many points vectorize.
+     */
+    static std::uint64_t spread(std::uint64_t x)
+    {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x001f00000000ffffull;
+        x = (x | x << 16) & 0x001f0000ff0000ffull;
+        x = (x | x <<  8) & 0x100f00f00f00f00full;
+        x = (x | x <<  4) & 0x10c30c30c30c30c3ull;
+        x = (x | x <<  2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    /**
+     * Hilbert key of a cell, using Skilling's transform of the coordinates
+     * to the "transposed" Hilbert index (J. Skilling, Programming the Hilbert
+     * curve, AIP Conf. Proc. 707, 2004), whose bits are then interleaved.
+     */
+    static std::uint64_t hilbert(std::uint32_t x, std::uint32_t y, std::uint32_t z)
+    {
+        std::uint32_t X[3] = {x, y, z};
+        const auto M = std::uint32_t(1) << (bits - 1);
+
+        for (auto Q = M; Q > 1; Q >>= 1)
+        {
+            auto P = Q - 1;
+
+            for (int i = 0; i < 3; ++i)
+            {
+                if (X[i] & Q)
+                {
+                    X[0] ^= P;
+                }
+                else
+                {
+                    auto t = (X[0] ^ X[i]) & P;
+                    X[0] ^= t;
+                    X[i] ^= t;
+                }
+            }
+        }
+        X[1] ^= X[0];
+        X[2] ^= X[1];
+
+        auto t = std::uint32_t(0);
+
+        for (auto Q = M; Q > 1; Q >>= 1)
+        {
+            if (X[2] & Q)
+            {
+                t ^= Q - 1;
+            }
+        }
+        return spread(X[0] ^ t) << 2 | spread(X[1] ^ t) << 1 | spread(X[2] ^ t);
+    }
+
+    const Communicator& comm;
+    point lower, upper;
+    sfc_curve curve;
+    std::vector<std::uint64_t> boundaries;
+};
+
+
+
+
+// ============================================================================
+namespace mpi { namespace detail {
+
+
+/**
+ * Call f on each element of a tuple.
+ */
+template <typename Tuple, typename F, std::size_t... I>
+void for_each_element(Tuple& tuple, F f, std::index_sequence<I...>)
+{
+    int expand[] = {0, (f(std::get<I>(tuple)), 0)...};
+    (void) expand;
+}
+
+template <typename... Ts, typename F>
+void for_each_element(std::tuple<Ts...>& tuple, F f)
+{
+    for_each_element(tuple, f, std::index_sequence_for<Ts...>());
+}
+
+
+/**
+ * Count an item bound for rank d, or record it as bad if d is not a rank of
+ * the communicator.
+ */
+inline void count_destination(std::vector<int>& counts, int d, int& bad)
+{
+    if (d < 0 || d >= int(counts.size()))
+    {
+        bad = 1;
+        return;
+    }
+    counts[d]++;
+}
+
+
+/**
+ * Return where the items bound for each rank start in a send buffer, which
+ * is ordered by the neighbor list if one is given, and by rank otherwise.
+ * On return, counts holds the counts in that same order.
+ *
+ * This is also where the ranks agree, before anything is sent, that every
+ * item has a valid destination: an existing rank, and a neighbor if
+ * neighbors are given. If any rank has one that is not, every rank throws
+ * std::out_of_range, rather than leaving the others blocked in the
+ * exchange. The agreement is a one-integer all_reduce.
+ */
+inline std::vector<std::size_t> send_offsets(const Communicator& comm, std::vector<int>& counts, const std::vector<int>& neighbors, int bad)
+{
+    auto offsets = std::vector<std::size_t>(counts.size(), 0);
+    auto total = std::size_t(0);
+    auto neighbor_counts = std::vector<int>();
+
+    if (neighbors.empty())
+    {
+        for (std::size_t q = 0; q < counts.size(); ++q)
+        {
+            offsets[q] = total;
+            total += counts[q];
+        }
+    }
+    else
+    {
+        for (auto q : neighbors)
+        {
+            offsets[q] = total;
+            total += counts[q];
+            neighbor_counts.push_back(counts[q]);
+        }
+        if (total != std::size_t(std::accumulate(counts.begin(), counts.end(), 0)))
+        {
+            bad = 1;
+        }
+    }
+    if (comm.all_reduce(bad, max<int>()))
+    {
+        throw std::out_of_range(bad
+            ? "migrate: particle bound for a rank that does not exist or is not a neighbor"
+            : "migrate: a particle on another rank is bound for an invalid rank");
+    }
+    if (! neighbors.empty())
+    {
+        counts = neighbor_counts;
+    }
+    return offsets;
+}
+
+
+/**
+ * Append the items in sendbuf arriving from other ranks to recvbuf, using
+ * a neighbor exchange if neighbors are given, or a sparse exchange if not.
+ */
+template <typename T>
+void exchange_append(const Communicator& comm, const std::vector<T>& sendbuf, const std::vector<int>& counts, const std::vector<int>& neighbors, std::vector<T>& recvbuf)
+{
+    if (neighbors.empty())
+    {
+        comm.sparse_exchange_append(sendbuf, counts, recvbuf);
+    }
+    else
+    {
+        comm.neighbor_exchange_append(sendbuf, neighbors, counts, recvbuf);
+    }
+}
+
+}} // namespace mpi::detail
+
+
+
+
+/**
+ * Send the particles that have left this rank's subdomain to the ranks that
+ * now own them, and append the particles arriving from other ranks. The
+ * destination function returns the owner of a particle. A first pass counts
+ * the particles bound for each rank; a second compacts the ones staying put
+ * in place, in their original order, and copies each leaving one straight
+ * to its slot in the send buffer. The received particles go to the end of
+ * the vector, so it is not reallocated if its capacity suffices.
+ *
+ * If a list of neighbors is given, particles may only move to those ranks,
+ * and the exchange only involves them; the lists must be symmetric.
+ * Otherwise the exchange is a sparse all-to-all (see
+ * Communicator::sparse_exchange). If a particle on any rank is bound for a
+ * rank that does not exist or is not a neighbor, every rank throws
+ * std::out_of_range before anything is sent, and the particles are left as
+ * they were. Returns the number of particles received.
+ *
+ *              mpi::ext::migrate(comm, particles, [&] (const particle& p) { return owner(p.x); });
+ *
+ */
+template <typename T, typename Destination>
+std::size_t mpi::ext::migrate(const Communicator& comm, std::vector<T>& particles, Destination destination, const std::vector<int>& neighbors)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "type is not trivially copyable");
+
+    auto n = particles.size();
+    auto destinations = std::vector<int>(n);
+    auto sendcounts = std::vector<int>(comm.size(), 0);
+    auto leaving = std::size_t(0);
+    auto bad = 0;
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        destinations[i] = destination(particles[i]);
+
+        if (destinations[i] != comm.rank())
+        {
+            detail::count_destination(sendcounts, destinations[i], bad);
+            ++leaving;
+        }
+    }
+    auto offsets = detail::send_offsets(comm, sendcounts, neighbors, bad);
+    auto sendbuf = std::vector<T>(leaving);
+    auto kept = std::size_t(0);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (destinations[i] == comm.rank())
+        {
+            particles[kept++] = particles[i];
+        }
+        else
+        {
+            sendbuf[offsets[destinations[i]]++] = particles[i];
+        }
+    }
+    particles.resize(kept);
+    detail::exchange_append(comm, sendbuf, sendcounts, neighbors, particles);
+    return particles.size() - kept;
+}
+
+
+
+
+/**
+ * Structure-of-arrays version of migrate: the particle data is held in
+ * separate arrays, one per field, passed in as a tuple of references, and
+ * the destination function is called with the index of a particle:
+ *
+ *              mpi::ext::migrate(comm, std::tie(x, v, mass), [&] (std::size_t i) { return owner(x[i]); });
+ *
+ * Each array is compacted in a single pass, which also packs its outgoing
+ * values into the outgoing particle records. Particles go out as records of
+ * all their fields, so there is one exchange for all the arrays.
+ */
+template <typename Destination, typename... Fields>
+std::size_t mpi::ext::migrate(const Communicator& comm, std::tuple<std::vector<Fields>&...> fields, Destination destination, const std::vector<int>& neighbors)
+{
+    auto n = std::get<0>(fields).size();
+    auto record = std::size_t(0);
+
+    detail::for_each_element(fields, [n, &record] (auto& field)
+    {
+        using field_type = typename std::decay_t<decltype(field)>::value_type;
+        static_assert(std::is_trivially_copyable<field_type>::value, "type is not trivially copyable");
+
+        if (field.size() != n)
+        {
+            throw std::invalid_argument("migrate: all particle arrays must have the same size");
+        }
+        record += sizeof(field_type);
+    });
+
+    // Decide where each particle goes, and its slot in the send buffer.
+    auto slots = std::vector<std::size_t>(n);
+    auto sendcounts = std::vector<int>(comm.size(), 0);
+    auto destinations = std::vector<int>(n);
+    auto leaving = std::size_t(0);
+    auto bad = 0;
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        destinations[i] = destination(i);
+
+        if (destinations[i] != comm.rank())
+        {
+            detail::count_destination(sendcounts, destinations[i], bad);
+            ++leaving;
+        }
+    }
+    auto offsets = detail::send_offsets(comm, sendcounts, neighbors, bad);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        slots[i] = destinations[i] == comm.rank() ? 0 : offsets[destinations[i]]++;
+    }
+
+    // Compact each array and pack its leaving values into the records.
+    auto sendbuf = std::vector<char>(leaving * record);
+    auto recvbuf = std::vector<char>();
+    auto field_offset = std::size_t(0);
+    auto kept = std::size_t(0);
+
+    detail::for_each_element(fields, [&] (auto& field)
+    {
+        auto size = sizeof(field[0]);
+        kept = 0;
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            if (destinations[i] == comm.rank())
+            {
+                field[kept++] = field[i];
+            }
+            else
+            {
+                std::memcpy(&sendbuf[slots[i] * record + field_offset], &field[i], size);
+            }
+        }
+        field.resize(kept);
+        field_offset += size;
+    });
+
+    for (auto& c : sendcounts)
+    {
+        c *= record;
+    }
+    detail::exchange_append(comm, sendbuf, sendcounts, neighbors, recvbuf);
+
+    // Unpack the arriving records onto the ends of the arrays.
+    auto received = recvbuf.size() / record;
+    field_offset = 0;
+
+    detail::for_each_element(fields, [&] (auto& field)
+    {
+        auto size = sizeof(field[0]);
+        field.resize(kept + received);
+
+        for (std::size_t i = 0; i < received; ++i)
+        {
+            std::memcpy(&field[kept + i], &recvbuf[i * record + field_offset], size);
+        }
+        field_offset += size;
+    });
+    return received;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Histogram of values in equal-width bins over [lower, upper), with counts
+ * of the values below and above the range (and NaN's, which count as below).
+ * Values are binned locally, and a single all_reduce makes the histogram
+ * global, so only the counts are moved, never the data:
+ *
+ *              auto hist = mpi::ext::histogram(0.0, 1.0, 100);
+ *              hist.add(field);
+ *              hist.all_reduce(comm);
+ *              auto median = hist.quantile(0.5);
+ *
+ */
+class mpi::ext::histogram
+{
+public:
+
+
+    // ========================================================================
+    histogram(double lower, double upper, std::size_t bins)
+    : lower(lower)
+    , upper(upper)
+    , bins(bins)
+    , data(bins + 2, 0)
+    {
+        if (! (upper > lower) || bins == 0)
+        {
+            throw std::invalid_argument("histogram needs upper > lower and at least one bin");
+        }
+    }
+
+
+    /**
+     * Add values to the local histogram. The bin indexes are computed for a
+     * block of values at a time in a branch-free loop, which vectorizes;
+     * the counts are then accumulated into several interleaved copies of
+     * the histogram, so that runs of equal bins don't serialize on a single
+     * counter.
+     */
+    void add(const double* values, std::size_t count)
+    {
+        const std::size_t block = 256;
+        const std::size_t stride = bins + 2;
+        auto scale = bins / (upper - lower);
+        auto top = double(bins + 1);
+        std::int32_t index[block];
+
+        lanes.assign(lanes_count * stride, 0);
+
+        for (std::size_t start = 0; start < count; start += block)
+        {
+            auto n = std::min(block, count - start);
+
+            // Map the range to [1, bins + 1), so that after clamping to [0,
+            // bins + 1], truncation gives the underflow bin 0, the bins 1 to
+            // bins, and the overflow bin bins + 1. (Written with ternaries
+            // in this order so that GCC vectorizes the loop.)
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto u = (values[start + i] - lower) * scale + 1.0;
+                u = u > 0.0 ? u : 0.0;
+                u = u < top ? u : top;
+                index[i] = std::int32_t(u);
+            }
+            auto lane0 = &lanes[0 * stride];
+            auto lane1 = &lanes[1 * stride];
+            auto lane2 = &lanes[2 * stride];
+            auto lane3 = &lanes[3 * stride];
+            auto i = std::size_t(0);
+
+            for (; i + 4 <= n; i += 4)
+            {
+                lane0[index[i + 0]]++;
+                lane1[index[i + 1]]++;
+                lane2[index[i + 2]]++;
+                lane3[index[i + 3]]++;
+            }
+            for (; i < n; ++i)
+            {
+                lane0[index[i]]++;
+            }
+        }
+        for (std::size_t lane = 0; lane < lanes_count; ++lane)
+        {
+            for (std::size_t b = 0; b < stride; ++b)
+            {
+                data[b] += lanes[lane * stride + b];
+            }
+        }
+    }
+
+    void add(const std::vector<double>& values)
+    {
+        add(values.data(), values.size());
+    }
+
+
+    /**
+     * Sum the histograms over all ranks of the communicator, in place. This
+     * is a collective operation, and the histograms must have the same bins.
+     */
+    void all_reduce(const Communicator& comm)
+    {
+        data = comm.all_reduce(data);
+    }
+
+
+    /**
+     * Reset all the counts to zero.
+     */
+    void clear()
+    {
+        std::fill(data.begin(), data.end(), 0);
+    }
+
+    std::size_t size() const { return bins; }
+    std::uint64_t count(std::size_t bin) const { return data[bin + 1]; }
+    std::uint64_t underflow() const { return data.front(); }
+    std::uint64_t overflow() const { return data.back(); }
+    std::uint64_t total() const { return std::accumulate(data.begin(), data.end(), std::uint64_t(0)); }
+    double bin_lower(std::size_t bin) const { return lower + (upper - lower) * bin / bins; }
+    double bin_upper(std::size_t bin) const { return bin_lower(bin + 1); }
+
+
+    /**
+     * Estimate the q-th quantile, interpolating linearly within the bin it
+     * falls in. Quantiles landing among the values outside the range are
+     * returned as the nearest end of the range.
+     */
+    double quantile(double q) const
+    {
+        auto target = q * double(total());
+        auto cumulative = double(underflow());
+
+        if (target <= cumulative)
+        {
+            return lower;
+        }
+        for (std::size_t bin = 0; bin < bins; ++bin)
+        {
+            auto c = double(count(bin));
+
+            if (cumulative + c >= target && c > 0)
+            {
+                return bin_lower(bin) + (bin_upper(bin) - bin_lower(bin)) * (target - cumulative) / c;
+            }
+            cumulative += c;
+        }
+        return upper;
+    }
+
+
+private:
+    // ========================================================================
+    static constexpr std::size_t lanes_count = 4;
+    double lower, upper;
+    std::size_t bins;
+    std::vector<std::uint64_t> data;
+    std::vector<std::uint64_t> lanes;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Mergeable sketch of a distribution, for approximate quantiles with a
+ * guaranteed relative accuracy (the DDSketch of Masson, Rim and Lee, VLDB
+ * 2019). Values are counted in logarithmically spaced buckets; any quantile
+ * is then known to within the given relative error of the true value. The
+ * buckets are stored densely, so memory grows with the logarithm of the
+ * ratio of the largest to the smallest magnitude seen (about 115 buckets
+ * per decade at 1% accuracy), not with the number of values. Sketches merge
+ * by adding bucket counts, so global quantiles need only a small
+ * all_reduce, no matter how large the field:
+ *
+ *              auto sketch = mpi::ext::quantile_sketch(0.01);
+ *              sketch.add(field);
+ *              sketch.all_merge(comm);
+ *              auto p99 = sketch.quantile(0.99);
+ *
+ */
+class mpi::ext::quantile_sketch
+{
+public:
+
+
+    // ========================================================================
+    quantile_sketch(double relative_accuracy=0.01)
+    : gamma((1 + relative_accuracy) / (1 - relative_accuracy))
+    , inverse_log_gamma(1.0 / std::log(gamma))
+    {
+        if (! (relative_accuracy > 0 && relative_accuracy < 1))
+        {
+            throw std::invalid_argument("quantile_sketch relative accuracy must be in (0, 1)");
+        }
+    }
+
+
+    /**
+     * Add values to the sketch. Values whose magnitude is below the smallest
+     * normal double are counted as zero, and so is NaN.
+     */
+    void add(double x)
+    {
+        if (x > min_value)
+        {
+            positive.add(key(x), 1);
+        }
+        else if (x < -min_value)
+        {
+            negative.add(key(-x), 1);
+        }
+        else
+        {
+            ++zeros;
+        }
+    }
+
+    void add(const std::vector<double>& values)
+    {
+        for (auto x : values)
+        {
+            add(x);
+        }
+    }
+
+
+    /**
+     * Merge another sketch, with the same accuracy, into this one.
+     */
+    void merge(const quantile_sketch& other)
+    {
+        positive.merge(other.positive);
+        negative.merge(other.negative);
+        zeros += other.zeros;
+    }
+
+
+    /**
+     * Merge the sketches on all ranks of the communicator, so that each rank
+     * holds the sketch of the union of the data. This is a collective
+     * operation: one all_reduce to agree on the bucket ranges, and one to
+     * add up the counts.
+     */
+    void all_merge(const Communicator& comm)
+    {
+        // Empty stores report first() = LLONG_MAX and last() = LLONG_MIN,
+        // which are the identities of min and max, so they drop out here.
+        auto lower = comm.all_reduce(std::vector<long long>{positive.first(), negative.first()}, mpi::min<long long>());
+        auto upper = comm.all_reduce(std::vector<long long>{positive.last(), negative.last()}, mpi::max<long long>());
+
+        positive.resize(lower[0], upper[0]);
+        negative.resize(lower[1], upper[1]);
+
+        auto counts = positive.counts;
+        counts.insert(counts.end(), negative.counts.begin(), negative.counts.end());
+        counts.push_back(zeros);
+        counts = comm.all_reduce(counts);
+
+        std::copy(counts.begin(), counts.begin() + positive.counts.size(), positive.counts.begin());
+        std::copy(counts.begin() + positive.counts.size(), counts.end() - 1, negative.counts.begin());
+        zeros = counts.back();
+    }
+
+
+    /**
+     * Return the number of values in the sketch.
+     */
+    std::uint64_t count() const
+    {
+        return positive.total() + negative.total() + zeros;
+    }
+
+
+    /**
+     * Estimate the q-th quantile, for q in [0, 1]. The estimate is within
+     * the relative accuracy of the value with that rank in the data.
+     */
+    double quantile(double q) const
+    {
+        if (count() == 0)
+        {
+            throw std::logic_error("quantile of an empty sketch");
+        }
+        auto rank = std::uint64_t(std::max(0.0, std::min(1.0, q)) * double(count() - 1));
+        auto cumulative = std::uint64_t(0);
+
+        for (auto i = negative.counts.size(); i-- > 0; )
+        {
+            cumulative += negative.counts[i];
+
+            if (cumulative > rank)
+            {
+                return -value(negative.offset + i);
+            }
+        }
+        cumulative += zeros;
+
+        if (cumulative > rank)
+        {
+            return 0.0;
+        }
+        for (std::size_t i = 0; i < positive.counts.size(); ++i)
+        {
+            cumulative += positive.counts[i];
+
+            if (cumulative > rank)
+            {
+                return value(positive.offset + i);
+            }
+        }
+        return value(positive.last());
+    }
+
+
+private:
+    // ========================================================================
+    /**
+     * Dense bucket counts for the keys offset, offset + 1, and so on.
+     */
+    struct store
+    {
+        long long offset = 0;
+        std::vector<std::uint64_t> counts;
+
+        long long first() const { return counts.empty() ? std::numeric_limits<long long>::max() : offset; }
+        long long last() const { return counts.empty() ? std::numeric_limits<long long>::min() : offset + (long long)(counts.size()) - 1; }
+
+        std::uint64_t total() const
+        {
+            return std::accumulate(counts.begin(), counts.end(), std::uint64_t(0));
+        }
+
+        void resize(long long lo, long long hi)
+        {
+            if (hi < lo)
+            {
+                counts.clear();
+                return;
+            }
+            auto resized = std::vector<std::uint64_t>(hi - lo + 1, 0);
+
+            for (std::size_t i = 0; i < counts.size(); ++i)
+            {
+                resized[offset - lo + i] = counts[i];
+            }
+            offset = lo;
+            counts = std::move(resized);
+        }
+
+        void add(long long key, std::uint64_t n)
+        {
+            if (key < first() || key > last())
+            {
+                resize(std::min(key, first()), std::max(key, last()));
+            }
+            counts[key - offset] += n;
+        }
+
+        void merge(const store& other)
+        {
+            for (std::size_t i = 0; i < other.counts.size(); ++i)
+            {
+                if (other.counts[i])
+                {
+                    add(other.offset + i, other.counts[i]);
+                }
+            }
+        }
+    };
+
+    long long key(double x) const
+    {
+        return (long long)(std::ceil(std::log(x) * inverse_log_gamma));
+    }
+
+    double value(long long key) const
+    {
+        return 2 * std::pow(gamma, double(key)) / (gamma + 1);
+    }
+
+    static constexpr double min_value = std::numeric_limits<double>::min();
+    double gamma;
+    double inverse_log_gamma;
+    store positive;
+    store negative;
+    std::uint64_t zeros = 0;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Counter-based random number generator (Philox4x32-10, from Salmon et al.,
+ * Parallel random numbers: as easy as 1, 2, 3, SC11). Rather than stepping
+ * a hidden state, the generator is a keyed bijection of a 128-bit counter,
+ * so the random numbers for any element can be computed directly from its
+ * global index. Results depend only on the seed, the stream, and the global
+ * index, never on the decomposition or the number of ranks:
+ *
+ *              auto rng = mpi::ext::philox(seed, step);
+ *              auto first = comm.exscan(std::uint64_t(particles.size()));
+ *              rng.uniform(first, kicks);     // kicks[i] for global index first + i
+ *
+ * Each counter gives four 32-bit words, which make two doubles, so that
+ * global indexes 2c and 2c + 1 come from counter c. Doubles are uniform in
+ * [0, 1) with 52 random bits. The stream number picks independent sequences
+ * for the same seed, e.g. one per time step or one per physical process.
+ */
+class mpi::ext::philox
+{
+public:
+
+
+    // ========================================================================
+    using counter_type = std::array<std::uint32_t, 4>;
+    using key_type = std::array<std::uint32_t, 2>;
+
+
+    // ========================================================================
+    philox(std::uint64_t seed, std::uint64_t stream=0)
+    : key{{std::uint32_t(seed), std::uint32_t(seed >> 32)}}
+    , stream(stream)
+    {
+    }
+
+
+    /**
+     * Apply the Philox4x32-10 bijection to a counter, with the given key.
+     */
+    static counter_type generate(counter_type c, key_type k)
+    {
+        for (int round = 0; round < rounds; ++round)
+        {
+            auto p0 = std::uint64_t(m0) * c[0];
+            auto p1 = std::uint64_t(m1) * c[2];
+            c = {{
+                std::uint32_t(p1 >> 32) ^ c[1] ^ k[0], std::uint32_t(p1),
+                std::uint32_t(p0 >> 32) ^ c[3] ^ k[1], std::uint32_t(p0)}};
+            k[0] += w0;
+            k[1] += w1;
+        }
+        return c;
+    }
+
+
+    /**
+     * Return the uniform random double in [0, 1) for the given global index.
+     */
+    double uniform(std::uint64_t index) const
+    {
+        auto r = generate(counter(index / 2), key);
+        return index % 2 == 0 ? to_double(r[0], r[1]) : to_double(r[2], r[3]);
+    }
+
+
+    /**
+     * Return the standard normal random number for the given global index.
+     * Indexes 2c and 2c + 1 are the two outputs of a Box-Muller transform of
+     * the two uniforms from counter c.
+     */
+    double normal(std::uint64_t index) const
+    {
+        auto r = generate(counter(index / 2), key);
+        return box_muller(to_double(r[0], r[1]), to_double(r[2], r[3]), index % 2);
+    }
+
+
+    /**
+     * Fill out[i] with the uniform random double for global index first + i,
+     * for i < count. Counters are processed in blocks laid out as arrays of
+     * words, so the rounds run as vector instructions over many counters at
+     * once; this is much faster than calling uniform(index) in a loop.
+     */
+    void uniform(std::uint64_t first, double* out, std::size_t count) const
+    {
+        double block[2 * block_size];
+
+        for (std::uint64_t index = first; index < first + count; )
+        {
+            auto c = index / 2;
+            generate_block(c, block);
+
+            auto begin = index - 2 * c;
+            auto end = std::min(std::uint64_t(2 * block_size), first + count - 2 * c);
+            std::copy(block + begin, block + end, out + (index - first));
+            index = 2 * c + end;
+        }
+    }
+
+    void uniform(std::uint64_t first, std::vector<double>& out) const
+    {
+        uniform(first, out.data(), out.size());
+    }
+
+
+    /**
+     * Fill out[i] with the standard normal random number for global index
+     * first + i, for i < count.
+     */
+    void normal(std::uint64_t first, double* out, std::size_t count) const
+    {
+        double block[2 * block_size];
+
+        for (std::uint64_t index = first; index < first + count; )
+        {
+            auto c = index / 2;
+            generate_block(c, block);
+
+            for (std::size_t j = 0; j < block_size; ++j)
+            {
+                auto u0 = block[2 * j], u1 = block[2 * j + 1];
+                block[2 * j + 0] = box_muller(u0, u1, 0);
+                block[2 * j + 1] = box_muller(u0, u1, 1);
+            }
+            auto begin = index - 2 * c;
+            auto end = std::min(std::uint64_t(2 * block_size), first + count - 2 * c);
+            std::copy(block + begin, block + end, out + (index - first));
+            index = 2 * c + end;
+        }
+    }
+
+    void normal(std::uint64_t first, std::vector<double>& out) const
+    {
+        normal(first, out.data(), out.size());
+    }
+
+
+private:
+    // ========================================================================
+    static constexpr int rounds = 10;
+    static constexpr std::size_t block_size = 64;
+    static constexpr std::uint32_t m0 = 0xD2511F53;
+    static constexpr std::uint32_t m1 = 0xCD9E8D57;
+    static constexpr std::uint32_t w0 = 0x9E3779B9;
+    static constexpr std::uint32_t w1 = 0xBB67AE85;
+
+    counter_type counter(std::uint64_t c) const
+    {
+        return {{std::uint32_t(c), std::uint32_t(c >> 32), std::uint32_t(stream), std::uint32_t(stream >> 32)}};
+    }
+
+    /**
+     * Turn 64 random bits into a double in [0, 1), by filling the mantissa
+     * of a double in [1, 2) and subtracting one. Unlike a conversion from a
+     * 64-bit integer, this vectorizes.
+     */
+    static double to_double(std::uint32_t lo, std::uint32_t hi)
+    {
+        auto bits = (std::uint64_t(hi) << 32 | lo) >> 12 | 0x3FF0000000000000ull;
+        auto x = 0.0;
+        std::memcpy(&x, &bits, sizeof(double));
+        return x - 1.0;
+    }
+
+    static double box_muller(double u0, double u1, int which)
+    {
+        auto r = std::sqrt(-2.0 * std::log(1.0 - u0));
+        return which == 0 ? r * std::cos(2 * M_PI * u1) : r * std::sin(2 * M_PI * u1);
+    }
+
+    /**
+     * Generate the 2 * block_size doubles for the counters first, first + 1,
+     * and so on.
+     */
+    void generate_block(std::uint64_t first, double* out) const
+    {
+        std::uint32_t c0[block_size], c1[block_size], c2[block_size], c3[block_size];
+        auto k0 = key[0], k1 = key[1];
+
+        for (std::size_t j = 0; j < block_size; ++j)
+        {
+            c0[j] = std::uint32_t(first + j);
+            c1[j] = std::uint32_t((first + j) >> 32);
+            c2[j] = std::uint32_t(stream);
+            c3[j] = std::uint32_t(stream >> 32);
+        }
+        for (int round = 0; round < rounds; ++round)
+        {
+            for (std::size_t j = 0; j < block_size; ++j)
+            {
+                auto p0 = std::uint64_t(m0) * c0[j];
+                auto p1 = std::uint64_t(m1) * c2[j];
+                auto next0 = std::uint32_t(p1 >> 32) ^ c1[j] ^ k0;
+                auto next2 = std::uint32_t(p0 >> 32) ^ c3[j] ^ k1;
+                c1[j] = std::uint32_t(p1);
+                c3[j] = std::uint32_t(p0);
+                c0[j] = next0;
+                c2[j] = next2;
+            }
+            k0 += w0;
+            k1 += w1;
+        }
+        for (std::size_t j = 0; j < block_size; ++j)
+        {
+            out[2 * j + 0] = to_double(c0[j], c1[j]);
+            out[2 * j + 1] = to_double(c2[j], c3[j]);
+        }
+    }
+
+    key_type key;
+    std::uint64_t stream;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Dynamic load balancer for a fixed set of work blocks (e.g. AMR patches or
+ * SFC segments), numbered 0 to n - 1 in an order that keeps nearby blocks
+ * close together. The balancer keeps the assignment of blocks to ranks,
+ * replicated on every rank, and records the measured cost of each local
+ * block, either by timing a scope or by reporting a cost directly:
+ *
+ *              auto balancer = mpi::ext::load_balancer(comm, num_blocks);
+ *
+ *              for (auto block : balancer.local_blocks())
+ *              {
+ *                  auto timer = balancer.time(block);
+ *                  advance(block);
+ *              }
+ *              if (balancer.rebalance())
+ *              {
+ *                  balancer.migrate(block_data);
+ *              }
+ *
+ * Rebalancing cuts the block sequence into contiguous chunks of equal
+ * measured cost, chunk r going to rank r. As costs drift, the cuts move a
+ * little, so most blocks stay where they are and only those near the cuts
+ * migrate. Costs are cleared after each rebalance.
+ */
+class mpi::ext::load_balancer
+{
+public:
+
+
+    /**
+     * Adds the time between its construction and destruction to the cost
+     * of a block.
+     */
+    class scoped_timer
+    {
+    public:
+        scoped_timer(load_balancer& balancer, std::size_t block)
+        : balancer(&balancer)
+        , block(block)
+        , start(MPI_Wtime())
+        {
+        }
+
+        scoped_timer(scoped_timer&& other)
+        : balancer(other.balancer)
+        , block(other.block)
+        , start(other.start)
+        {
+            other.balancer = nullptr;
+        }
+
+        ~scoped_timer()
+        {
+            if (balancer)
+            {
+                balancer->record(block, MPI_Wtime() - start);
+            }
+        }
+
+    private:
+        load_balancer* balancer;
+        std::size_t block;
+        double start;
+    };
+
+
+    // ========================================================================
+    load_balancer(const Communicator& comm, std::size_t num_blocks)
+    : comm(comm)
+    , costs(num_blocks, 0.0)
+    {
+        for (std::size_t b = 0; b < num_blocks; ++b)
+        {
+            owners.push_back(int(b * comm.size() / num_blocks));
+        }
+        previous_owners = owners;
+    }
+
+
+    /**
+     * Return the blocks assigned to this rank, in increasing order.
+     */
+    std::vector<std::size_t> local_blocks() const
+    {
+        return blocks_of(owners, comm.rank());
+    }
+
+
+    /**
+     * Return the rank a block is assigned to.
+     */
+    int owner(std::size_t block) const
+    {
+        return owners[block];
+    }
+
+
+    /**
+     * Add to the measured cost of a local block.
+     */
+    void record(std::size_t block, double cost)
+    {
+        costs[block] += cost;
+    }
+
+
+    /**
+     * Discard the costs recorded since the last rebalance.
+     */
+    void clear()
+    {
+        std::fill(costs.begin(), costs.end(), 0.0);
+    }
+
+
+    /**
+     * Return a timer which adds its lifetime to the cost of a block.
+     */
+    scoped_timer time(std::size_t block)
+    {
+        return scoped_timer(*this, block);
+    }
+
+
+    /**
+     * Return the load of the busiest rank relative to the mean, from the
+     * costs recorded since the last rebalance. This is a collective
+     * operation.
+     */
+    double imbalance() const
+    {
+        auto local = 0.0;
+
+        for (auto block : local_blocks())
+        {
+            local += costs[block];
+        }
+        auto busiest = comm.all_reduce(local, mpi::max<double>());
+        auto mean = comm.all_reduce(local) / comm.size();
+        return mean > 0.0 ? busiest / mean : 1.0;
+    }
+
+
+    /**
+     * If the imbalance exceeds the tolerance, compute a new assignment of
+     * blocks from the recorded costs, which are summed over ranks in a
+     * single all_reduce. Every rank computes the same assignment, so no
+     * further communication is needed. Returns true if the assignment
+     * changed, in which case the block data should be moved with migrate.
+     * This is a collective operation.
+     */
+    bool rebalance(double tolerance=1.05)
+    {
+        auto load = imbalance();
+        auto global = comm.all_reduce(costs);
+        clear();
+        previous_owners = owners;
+
+        if (load <= tolerance)
+        {
+            return false;
+        }
+
+        auto total = std::accumulate(global.begin(), global.end(), 0.0);
+        auto cumulative = 0.0;
+        auto p = comm.size();
+
+        for (std::size_t b = 0; b < global.size(); ++b)
+        {
+            owners[b] = std::min(p - 1, int((cumulative + 0.5 * global[b]) * p / total));
+            cumulative += global[b];
+        }
+        return owners != previous_owners;
+    }
+
+
+    /**
+     * Return the number of blocks that changed owner in the last rebalance.
+     */
+    std::size_t migrated_blocks() const
+    {
+        auto n = std::size_t(0);
+
+        for (std::size_t b = 0; b < owners.size(); ++b)
+        {
+            n += owners[b] != previous_owners[b];
+        }
+        return n;
+    }
+
+
+    /**
+     * Move per-block data to the new owners after a rebalance. On entry,
+     * data[i] belongs to the i-th local block under the previous
+     * assignment; on return, to the i-th block of local_blocks(). Blocks may
+     * have different sizes. Only ranks that trade blocks exchange messages.
+     * This is a collective operation.
+     */
+    template <typename T>
+    void migrate(std::vector<std::vector<T>>& data) const
+    {
+        auto previous = blocks_of(previous_owners, comm.rank());
+
+        if (data.size() != previous.size())
+        {
+            throw std::invalid_argument("load_balancer::migrate needs data for each previously local block");
+        }
+
+        // Send the block sizes and contents, both in order of the global
+        // block index, to the new owners.
+        auto size_counts = std::vector<int>(comm.size(), 0);
+        auto data_counts = std::vector<int>(comm.size(), 0);
+        auto sizes = std::vector<std::uint64_t>();
+        auto contents = std::vector<T>();
+        auto incoming = std::map<std::size_t, std::vector<T>>();
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            for (std::size_t i = 0; i < previous.size(); ++i)
+            {
+                if (owners[previous[i]] == q && q != comm.rank())
+                {
+                    sizes.push_back(data[i].size());
+                    contents.insert(contents.end(), data[i].begin(), data[i].end());
+                    size_counts[q] += 1;
+                    data_counts[q] += data[i].size();
+                }
+                else if (owners[previous[i]] == q)
+                {
+                    incoming[previous[i]] = std::move(data[i]);
+                }
+            }
+        }
+
+        auto recvcounts = std::vector<int>();
+        auto recv_sizes = comm.sparse_exchange(sizes, size_counts, recvcounts);
+        auto recv_contents = comm.sparse_exchange(contents, data_counts, recvcounts);
+        auto offset = std::size_t(0);
+        auto n = std::size_t(0);
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            if (q == comm.rank())
+            {
+                continue;
+            }
+            for (auto block : blocks_of(previous_owners, q))
+            {
+                if (owners[block] == comm.rank())
+                {
+                    auto begin = recv_contents.begin() + offset;
+                    incoming[block].assign(begin, begin + recv_sizes[n]);
+                    offset += recv_sizes[n++];
+                }
+            }
+        }
+
+        data.clear();
+
+        for (auto& block : incoming)
+        {
+            data.push_back(std::move(block.second));
+        }
+    }
+
+
+private:
+    // ========================================================================
+    static std::vector<std::size_t> blocks_of(const std::vector<int>& owners, int rank)
+    {
+        auto res = std::vector<std::size_t>();
+
+        for (std::size_t b = 0; b < owners.size(); ++b)
+        {
+            if (owners[b] == rank)
+            {
+                res.push_back(b);
+            }
+        }
+        return res;
+    }
+
+    const Communicator& comm;
+    std::vector<int> owners;
+    std::vector<int> previous_owners;
+    std::vector<double> costs;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Patch-based, two-dimensional adaptive mesh refinement data exchange. The
+ * hierarchy is a set of rectangular patches of cells, each on a refinement
+ * level with twice the resolution of the one below, and owned by one rank.
+ * The patch metadata is small, and is added identically on every rank; the
+ * cell data lives only on the owner, with a layer of ghost cells around
+ * each patch:
+ *
+ *              auto mesh = mpi::ext::amr(comm, 1);
+ *              mesh.add_patch(0, {{0, 0}, {64, 64}}, 0);
+ *              mesh.add_patch(1, {{32, 32}, {64, 64}}, 1);
+ *              mesh.finalize();
+ *              ... update interiors of mesh.local_patches()
+ *              mesh.restrict_to_coarse();
+ *              mesh.fill_ghosts();
+ *
+ * finalize() computes two schedules once. The first is for the ghost fill:
+ * ghost cells are copied from the interiors of patches on the same level,
+ * and those not covered by one are prolonged (piecewise-constant) from the
+ * level below. The second is for the restriction: fine interiors are
+ * averaged onto the coarse cells they cover. Ghost cells outside all
+ * patches of their level and the one below (physical boundaries) are left
+ * to the caller.
+ *
+ * Transfers between two ranks are aggregated into a single message per
+ * rank pair, whatever the number of patches involved. The messages use a
+ * tag of their own on the library communicator, so they can not match
+ * those of other meshes or of the user. Every rank derives the
+ * same ordered list of transfers from the metadata, so the receiver knows
+ * the layout of each message, and the messages run on persistent requests.
+ * Values are computed by the sender (interpolated or averaged as needed),
+ * so the receiver only copies. Restriction has one schedule per level,
+ * run from the finest down.
+ */
+class mpi::ext::amr
+{
+public:
+
+
+    /**
+     * A half-open box of cells [lo, hi) in the index space of a level.
+     */
+    struct box
+    {
+        std::array<int, 2> lo, hi;
+
+        bool empty() const { return hi[0] <= lo[0] || hi[1] <= lo[1]; }
+        int size() const { return empty() ? 0 : (hi[0] - lo[0]) * (hi[1] - lo[1]); }
+        box grow(int n) const { return {{lo[0] - n, lo[1] - n}, {hi[0] + n, hi[1] + n}}; }
+        box refine() const { return {{2 * lo[0], 2 * lo[1]}, {2 * hi[0], 2 * hi[1]}}; }
+        box coarsen() const { return {{lo[0] >> 1, lo[1] >> 1}, {(hi[0] + 1) >> 1, (hi[1] + 1) >> 1}}; }
+
+        box intersect(const box& b) const
+        {
+            return {{std::max(lo[0], b.lo[0]), std::max(lo[1], b.lo[1])}, {std::min(hi[0], b.hi[0]), std::min(hi[1], b.hi[1])}};
+        }
+
+        /**
+         * Return this box minus b, as up to four disjoint boxes.
+         */
+        std::vector<box> subtract(const box& b) const
+        {
+            auto overlap = intersect(b);
+
+            if (overlap.empty())
+            {
+                return {*this};
+            }
+            auto res = std::vector<box>();
+            auto add = [&res] (box c) { if (! c.empty()) res.push_back(c); };
+            add({{lo[0], lo[1]}, {overlap.lo[0], hi[1]}});
+            add({{overlap.hi[0], lo[1]}, {hi[0], hi[1]}});
+            add({{overlap.lo[0], lo[1]}, {overlap.hi[0], overlap.lo[1]}});
+            add({{overlap.lo[0], overlap.hi[1]}, {overlap.hi[0], hi[1]}});
+            return res;
+        }
+    };
+
+
+    /**
+     * The metadata of a patch.
+     */
+    struct patch
+    {
+        int level;
+        box interior;
+        int owner;
+    };
+
+
+    // ========================================================================
+    amr(const Communicator& comm, int ghosts=1)
+    : comm(comm)
+    , tags(comm.library(), 1)
+    , ghosts(ghosts)
+    {
+    }
+
+
+    /**
+     * Add a patch, and return its index. All ranks must add the same patches
+     * in the same order. Patches on a level must not overlap, and those on
+     * levels above 0 must have even corners, so that they cover whole
+     * coarse cells.
+     */
+    std::size_t add_patch(int level, box interior, int owner)
+    {
+        if (finalized)
+        {
+            throw std::logic_error("amr: patches cannot be added after finalize");
+        }
+        if (level > 0 && (interior.lo[0] % 2 || interior.lo[1] % 2 || interior.hi[0] % 2 || interior.hi[1] % 2))
+        {
+            throw std::invalid_argument("amr: refined patches must have even corners");
+        }
+        patches.push_back({level, interior, owner});
+        return patches.size() - 1;
+    }
+
+
+    /**
+     * Allocate the local patch data, and compute the ghost fill and
+     * restriction schedules.
+     */
+    void finalize()
+    {
+        for (std::size_t p = 0; p < patches.size(); ++p)
+        {
+            if (patches[p].owner == comm.rank())
+            {
+                local.push_back(p);
+                storage[p].resize(patches[p].interior.grow(ghosts).size(), 0.0);
+            }
+        }
+
+        auto levels = 0;
+
+        for (const auto& p : patches)
+        {
+            levels = std::max(levels, p.level + 1);
+        }
+        auto fill = std::vector<transfer>();
+        auto average = std::vector<std::vector<transfer>>(levels);
+
+        for (std::size_t d = 0; d < patches.size(); ++d)
+        {
+            const auto& dst = patches[d];
+            auto uncovered = dst.interior.grow(ghosts).subtract(dst.interior);
+
+            for (std::size_t s = 0; s < patches.size(); ++s)
+            {
+                const auto& src = patches[s];
+
+                if (s != d && src.level == dst.level)
+                {
+                    add_transfer(fill, {s, d, dst.interior.grow(ghosts).intersect(src.interior), kind::copy});
+                    uncovered = subtract(uncovered, src.interior);
+                }
+                if (src.level == dst.level + 1)
+                {
+                    add_transfer(average[dst.level], {s, d, src.interior.coarsen().intersect(dst.interior), kind::restrict});
+                }
+            }
+            for (std::size_t s = 0; s < patches.size(); ++s)
+            {
+                if (patches[s].level == dst.level - 1)
+                {
+                    for (const auto& region : uncovered)
+                    {
+                        add_transfer(fill, {s, d, region.intersect(patches[s].interior.refine()), kind::prolong});
+                    }
+                }
+            }
+        }
+        ghost_fill.build(*this, fill);
+        restriction = std::vector<schedule>(levels);
+
+        for (int level = 0; level < levels; ++level)
+        {
+            restriction[level].build(*this, average[level]);
+        }
+        finalized = true;
+    }
+
+
+    /**
+     * Return the indexes of the patches owned by this rank.
+     */
+    const std::vector<std::size_t>& local_patches() const
+    {
+        return local;
+    }
+
+
+    /**
+     * Return the metadata of a patch.
+     */
+    const patch& patch_info(std::size_t p) const
+    {
+        return patches[p];
+    }
+
+
+    /**
+     * Return the value of cell (i, j) of a local patch, in the index space
+     * of its level. Cells in the ghost layer can be accessed too.
+     */
+    double& at(std::size_t p, int i, int j)
+    {
+        return storage.at(p)[offset(p, i, j)];
+    }
+
+    double at(std::size_t p, int i, int j) const
+    {
+        return storage.at(p)[offset(p, i, j)];
+    }
+
+
+    /**
+     * Fill the ghost cells of all local patches. This is a collective
+     * operation.
+     */
+    void fill_ghosts()
+    {
+        check_finalized();
+        ghost_fill.execute(*this);
+    }
+
+
+    /**
+     * Replace coarse cells covered by finer patches with the average of the
+     * fine cells. Levels are processed from the finest down, so data
+     * propagates through several levels. This is a collective operation.
+     */
+    void restrict_to_coarse()
+    {
+        check_finalized();
+
+        for (auto level = restriction.size(); level-- > 0; )
+        {
+            restriction[level].execute(*this);
+        }
+    }
+
+
+    /**
+     * Return the number of transfers between patches on different ranks, and
+     * the number of messages they are aggregated into, that this rank sends
+     * per ghost fill.
+     */
+    std::pair<std::size_t, std::size_t> ghost_fill_traffic() const
+    {
+        return {ghost_fill.remote_transfers, ghost_fill.messages};
+    }
+
+
+private:
+    // ========================================================================
+    enum class kind { copy, prolong, restrict };
+
+    /**
+     * Values for a region of the destination patch, in its index space,
+     * computed from the source patch.
+     */
+    struct transfer
+    {
+        std::size_t src, dst;
+        box region;
+        kind op;
+    };
+
+    /**
+     * The transfers of one exchange: local ones, done by direct copy, and
+     * for each peer rank, those aggregated into one message each way.
+     */
+    struct schedule
+    {
+        std::vector<transfer> local;
+        std::vector<transfer> sends;
+        std::vector<transfer> recvs;
+        std::vector<double> sendbuf, recvbuf;
+        RequestSet requests;
+        std::size_t remote_transfers = 0;
+        std::size_t messages = 0;
+
+        void build(const amr& mesh, std::vector<transfer> transfers)
+        {
+            auto me = mesh.comm.rank();
+            auto peer = [&mesh] (const transfer& t, bool sending) { return mesh.patches[sending ? t.dst : t.src].owner; };
+
+            // The order of transfers in a message is their order in the
+            // list, which is the same on every rank.
+            for (const auto& t : transfers)
+            {
+                auto src_owner = mesh.patches[t.src].owner;
+                auto dst_owner = mesh.patches[t.dst].owner;
+
+                if (src_owner == me && dst_owner == me) local.push_back(t);
+                else if (src_owner == me) sends.push_back(t);
+                else if (dst_owner == me) recvs.push_back(t);
+            }
+            std::stable_sort(sends.begin(), sends.end(), [&] (const transfer& a, const transfer& b) { return peer(a, true) < peer(b, true); });
+            std::stable_sort(recvs.begin(), recvs.end(), [&] (const transfer& a, const transfer& b) { return peer(a, false) < peer(b, false); });
+
+            auto send_size = std::size_t(0), recv_size = std::size_t(0);
+
+            for (const auto& t : sends) send_size += t.region.size();
+            for (const auto& t : recvs) recv_size += t.region.size();
+
+            sendbuf.resize(send_size);
+            recvbuf.resize(recv_size);
+            remote_transfers = sends.size();
+
+            auto post = [&] (const std::vector<transfer>& list, bool sending)
+            {
+                auto offset = std::size_t(0);
+
+                for (std::size_t i = 0; i < list.size(); )
+                {
+                    auto q = peer(list[i], sending);
+                    auto count = std::size_t(0);
+
+                    for (; i < list.size() && peer(list[i], sending) == q; ++i)
+                    {
+                        count += list[i].region.size();
+                    }
+                    if (sending)
+                    {
+                        requests.add(mesh.tags.send_init(sendbuf.data() + offset, count, q));
+                        ++messages;
+                    }
+                    else
+                    {
+                        requests.add(mesh.tags.recv_init(recvbuf.data() + offset, count, q));
+                    }
+                    offset += count;
+                }
+            };
+            post(recvs, false);
+            post(sends, true);
+        }
+
+        void execute(amr& mesh)
+        {
+            auto offset = std::size_t(0);
+
+            for (const auto& t : sends)
+            {
+                mesh.pack(t, sendbuf.data() + offset);
+                offset += t.region.size();
+            }
+            requests.start_all();
+
+            for (const auto& t : local)
+            {
+                auto values = std::vector<double>(t.region.size());
+                mesh.pack(t, values.data());
+                mesh.unpack(t, values.data());
+            }
+            requests.wait_all();
+            offset = 0;
+
+            for (const auto& t : recvs)
+            {
+                mesh.unpack(t, recvbuf.data() + offset);
+                offset += t.region.size();
+            }
+        }
+    };
+
+    void check_finalized() const
+    {
+        if (! finalized)
+        {
+            throw std::logic_error("amr: finalize must be called before exchanging data");
+        }
+    }
+
+    std::size_t offset(std::size_t p, int i, int j) const
+    {
+        auto g = patches[p].interior.grow(ghosts);
+        return std::size_t(i - g.lo[0]) * (g.hi[1] - g.lo[1]) + (j - g.lo[1]);
+    }
+
+    static void add_transfer(std::vector<transfer>& list, transfer t)
+    {
+        if (! t.region.empty())
+        {
+            list.push_back(t);
+        }
+    }
+
+    static std::vector<box> subtract(const std::vector<box>& boxes, const box& b)
+    {
+        auto res = std::vector<box>();
+
+        for (const auto& a : boxes)
+        {
+            for (const auto& c : a.subtract(b))
+            {
+                res.push_back(c);
+            }
+        }
+        return res;
+    }
+
+    /**
+     * Compute the values of a transfer's region from its (local) source.
+     */
+    void pack(const transfer& t, double* out) const
+    {
+        const auto& r = t.region;
+
+        for (int i = r.lo[0]; i < r.hi[0]; ++i)
+        {
+            for (int j = r.lo[1]; j < r.hi[1]; ++j)
+            {
+                switch (t.op)
+                {
+                    case kind::copy:    *out++ = at(t.src, i, j); break;
+                    case kind::prolong: *out++ = at(t.src, i >> 1, j >> 1); break;
+                    case kind::restrict:
+                        *out++ = 0.25 * (
+                            at(t.src, 2 * i, 2 * j) + at(t.src, 2 * i + 1, 2 * j) +
+                            at(t.src, 2 * i, 2 * j + 1) + at(t.src, 2 * i + 1, 2 * j + 1));
+                        break;
+                }
+            }
+        }
+    }
+
+    /**
+     * Store the values of a transfer's region into its (local) destination.
+     */
+    void unpack(const transfer& t, const double* in)
+    {
+        const auto& r = t.region;
+
+        for (int i = r.lo[0]; i < r.hi[0]; ++i)
+        {
+            for (int j = r.lo[1]; j < r.hi[1]; ++j)
+            {
+                at(t.dst, i, j) = *in++;
+            }
+        }
+    }
+
+    const Communicator& comm;
+    TagSpace tags;
+    int ghosts;
+    bool finalized = false;
+    std::vector<patch> patches;
+    std::vector<std::size_t> local;
+    std::map<std::size_t, std::vector<double>> storage;
+    schedule ghost_fill;
+    std::vector<schedule> restriction;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Octree over a set of point masses, for Barnes-Hut gravity and neighbour
+ * searches on one rank. Each node covers a cube, split into eight octants
+ * until a node holds at most leaf_size bodies, and stores the total mass,
+ * the center of mass, and the tight bounding box of its bodies. The bodies
+ * are stored in tree order; results are returned in input order.
+ */
+class mpi::ext::octree
+{
+public:
+
+
+    // ========================================================================
+    using point = std::array<double, 3>;
+
+    struct body
+    {
+        point x;
+        double mass;
+    };
+
+    struct node
+    {
+        point lo;
+        double size;
+        point com;
+        double mass;
+        point bmin, bmax;
+        std::size_t begin, end;
+        int children[8];
+        bool leaf;
+    };
+
+    enum class action { skip, summarize, open };
+
+
+    // ========================================================================
+    octree(const std::vector<body>& input, std::size_t leaf_size=16) : leaf_size(leaf_size)
+    {
+        if (input.empty())
+        {
+            return;
+        }
+        auto lo = input[0].x, hi = input[0].x;
+
+        for (const auto& b : input)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = std::min(lo[a], b.x[a]);
+                hi[a] = std::max(hi[a], b.x[a]);
+            }
+        }
+        auto size = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]}) * (1 + 1e-12) + 1e-300;
+
+        order.resize(input.size());
+        std::iota(order.begin(), order.end(), 0);
+        nodes.push_back(node());
+        nodes[0].lo = lo;
+        nodes[0].size = size;
+        build(input, 0, 0, input.size(), 0);
+
+        for (auto i : order)
+        {
+            sorted.push_back(input[i]);
+        }
+    }
+
+    const std::vector<node>& tree() const { return nodes; }
+    const std::vector<body>& bodies() const { return sorted; }
+    std::size_t size() const { return sorted.size(); }
+    std::size_t input_index(std::size_t i) const { return order[i]; }
+
+
+    /**
+     * Return the gravitational acceleration (with G = 1, and Plummer
+     * softening length eps) at x due to the bodies, accepting a node as a
+     * point mass if its size over its distance is less than theta.
+     */
+    point acceleration(const point& x, double theta, double eps) const
+    {
+        auto acc = point{{0, 0, 0}};
+        auto add = [&] (const point& y, double m)
+        {
+            auto d = point{{y[0] - x[0], y[1] - x[1], y[2] - x[2]}};
+            auto r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2] + eps * eps;
+            auto f = r2 > 0 ? m / (r2 * std::sqrt(r2)) : 0.0;
+            acc[0] += f * d[0];
+            acc[1] += f * d[1];
+            acc[2] += f * d[2];
+        };
+        auto stack = std::vector<int>();
+
+        if (! nodes.empty())
+        {
+            stack.push_back(0);
+        }
+        while (! stack.empty())
+        {
+            const auto& n = nodes[stack.back()];
+            stack.pop_back();
+
+            if (n.leaf)
+            {
+                for (auto i = n.begin; i < n.end; ++i)
+                {
+                    add(sorted[i].x, sorted[i].mass);
+                }
+            }
+            else if (n.size < theta * distance(x, n.com))
+            {
+                add(n.com, n.mass);
+            }
+            else
+            {
+                push_children(n, stack);
+            }
+        }
+        return acc;
+    }
+
+
+    /**
+     * Return the indexes (in input order) of the bodies within distance r
+     * of x.
+     */
+    std::vector<std::size_t> within(const point& x, double r) const
+    {
+        auto res = std::vector<std::size_t>();
+        auto stack = std::vector<int>();
+
+        if (! nodes.empty())
+        {
+            stack.push_back(0);
+        }
+        while (! stack.empty())
+        {
+            const auto& n = nodes[stack.back()];
+            stack.pop_back();
+
+            if (box_distance(x, n.bmin, n.bmax) > r)
+            {
+                continue;
+            }
+            if (n.leaf)
+            {
+                for (auto i = n.begin; i < n.end; ++i)
+                {
+                    if (distance(x, sorted[i].x) <= r)
+                    {
+                        res.push_back(order[i]);
+                    }
+                }
+            }
+            else
+            {
+                push_children(n, stack);
+            }
+        }
+        return res;
+    }
+
+
+    /**
+     * Walk the tree, deciding for each node whether to skip it, summarize it
+     * as a single body at its center of mass, or open it. Opened leaves emit
+     * their bodies which pass the keep predicate. This is how the pieces of
+     * the tree other ranks need are selected.
+     */
+    template <typename Decide, typename Keep>
+    void collect(Decide decide, Keep keep, std::vector<body>& out) const
+    {
+        auto stack = std::vector<int>();
+
+        if (! nodes.empty())
+        {
+            stack.push_back(0);
+        }
+        while (! stack.empty())
+        {
+            const auto& n = nodes[stack.back()];
+            stack.pop_back();
+
+            switch (decide(n))
+            {
+                case action::skip: break;
+                case action::summarize: out.push_back({n.com, n.mass}); break;
+                case action::open:
+                    if (n.leaf)
+                    {
+                        for (auto i = n.begin; i < n.end; ++i)
+                        {
+                            if (keep(sorted[i]))
+                            {
+                                out.push_back(sorted[i]);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        push_children(n, stack);
+                    }
+                    break;
+            }
+        }
+    }
+
+
+    // ========================================================================
+    static double distance(const point& a, const point& b)
+    {
+        return std::sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+    }
+
+    static double box_distance(const point& x, const point& bmin, const point& bmax)
+    {
+        auto d2 = 0.0;
+
+        for (int a = 0; a < 3; ++a)
+        {
+            auto d = std::max({bmin[a] - x[a], 0.0, x[a] - bmax[a]});
+            d2 += d * d;
+        }
+        return std::sqrt(d2);
+    }
+
+    static double box_box_distance(const point& amin, const point& amax, const point& bmin, const point& bmax)
+    {
+        auto d2 = 0.0;
+
+        for (int a = 0; a < 3; ++a)
+        {
+            auto d = std::max({bmin[a] - amax[a], 0.0, amin[a] - bmax[a]});
+            d2 += d * d;
+        }
+        return std::sqrt(d2);
+    }
+
+
+private:
+    // ========================================================================
+    static constexpr int max_depth = 48;
+
+    void push_children(const node& n, std::vector<int>& stack) const
+    {
+        for (int c = 0; c < 8; ++c)
+        {
+            if (n.children[c] >= 0)
+            {
+                stack.push_back(n.children[c]);
+            }
+        }
+    }
+
+    void build(const std::vector<body>& input, int id, std::size_t begin, std::size_t end, int depth)
+    {
+        auto& n = nodes[id];
+        n.begin = begin;
+        n.end = end;
+        n.mass = 0;
+        n.com = {{0, 0, 0}};
+        n.bmin = n.bmax = input[order[begin]].x;
+        std::fill(n.children, n.children + 8, -1);
+
+        for (auto i = begin; i < end; ++i)
+        {
+            const auto& b = input[order[i]];
+            n.mass += b.mass;
+
+            for (int a = 0; a < 3; ++a)
+            {
+                n.com[a] += b.mass * b.x[a];
+                n.bmin[a] = std::min(n.bmin[a], b.x[a]);
+                n.bmax[a] = std::max(n.bmax[a], b.x[a]);
+            }
+        }
+        for (int a = 0; a < 3; ++a)
+        {
+            n.com[a] = n.mass > 0 ? n.com[a] / n.mass : n.bmin[a];
+        }
+        n.leaf = end - begin <= leaf_size || depth == max_depth;
+
+        if (n.leaf)
+        {
+            return;
+        }
+
+        // Split the range into octants with seven partitions: by x, then
+        // each half by y, then each quarter by z.
+        auto half = n.size / 2;
+        auto mid = point{{n.lo[0] + half, n.lo[1] + half, n.lo[2] + half}};
+        auto lo = n.lo;
+        std::size_t bounds[9] = {begin, 0, 0, 0, 0, 0, 0, 0, end};
+        auto split = [&] (std::size_t b, std::size_t e, int axis)
+        {
+            return std::size_t(std::partition(order.begin() + b, order.begin() + e,
+                [&] (std::size_t i) { return input[i].x[axis] < mid[axis]; }) - order.begin());
+        };
+        bounds[4] = split(bounds[0], bounds[8], 0);
+        bounds[2] = split(bounds[0], bounds[4], 1);
+        bounds[6] = split(bounds[4], bounds[8], 1);
+
+        for (int q = 0; q < 8; q += 2)
+        {
+            bounds[q + 1] = split(bounds[q], bounds[q + 2], 2);
+        }
+        for (int c = 0; c < 8; ++c)
+        {
+            if (bounds[c + 1] > bounds[c])
+            {
+                auto child = int(nodes.size());
+                nodes.push_back(node());
+                nodes[child].size = half;
+                nodes[child].lo = {{lo[0] + (c & 4 ? half : 0), lo[1] + (c & 2 ? half : 0), lo[2] + (c & 1 ? half : 0)}};
+                nodes[id].children[c] = child;
+                build(input, child, bounds[c], bounds[c + 1], depth + 1);
+            }
+        }
+    }
+
+    std::size_t leaf_size;
+    std::vector<node> nodes;
+    std::vector<std::size_t> order;
+    std::vector<body> sorted;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Barnes-Hut tree over bodies distributed by a space-filling curve, so that
+ * each rank's bodies occupy a compact region. Each rank builds an octree of
+ * its own bodies, and the ranks all_gather the bounding boxes of their top
+ * (branch) nodes, which describe each rank's region in some detail. Each
+ * rank then walks its tree once for every other rank, and sends it the
+ * locally essential tree: the nodes that are far enough from all of that
+ * rank's branch boxes to be used as point masses anywhere in them, and the
+ * bodies of the leaves that are not. The pieces go in one sparse exchange,
+ * and the bodies and pseudo-bodies received are built into a second local
+ * tree. Forces on local bodies are then walks of the two trees, with no
+ * further communication:
+ *
+ *              auto tree = mpi::ext::distributed_octree(comm, bodies);
+ *              tree.exchange_essential(0.5);
+ *              auto acc = tree.accelerations(0.5, 1e-3);
+ *
+ * For neighbour searches, halo(r) returns the remote bodies within r of
+ * this rank's branch boxes.
+ */
+class mpi::ext::distributed_octree
+{
+public:
+
+
+    // ========================================================================
+    using point = octree::point;
+    using body = octree::body;
+
+
+    // ========================================================================
+    distributed_octree(const Communicator& comm, const std::vector<body>& bodies, std::size_t leaf_size=16, int branch_depth=2)
+    : comm(comm)
+    , local(bodies, leaf_size)
+    , essential(std::vector<body>(), leaf_size)
+    , leaf_size(leaf_size)
+    {
+        auto branches = std::vector<point>();
+        collect_branches(0, 0, branch_depth, branches);
+
+        auto counts = std::vector<int>();
+        auto all = comm.all_gatherv(branches, counts);
+        auto offset = std::size_t(0);
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            boxes.emplace_back(all.begin() + offset, all.begin() + offset + counts[q]);
+            offset += counts[q];
+        }
+    }
+
+
+    /**
+     * Return the local tree.
+     */
+    const octree& local_tree() const
+    {
+        return local;
+    }
+
+
+    /**
+     * Send every other rank the locally essential tree for opening angle
+     * theta, and build the tree of what was received. This is a collective
+     * operation.
+     */
+    void exchange_essential(double theta)
+    {
+        auto outgoing = std::vector<body>();
+        auto sendcounts = std::vector<int>(comm.size(), 0);
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            if (q == comm.rank())
+            {
+                continue;
+            }
+            const auto& target = boxes[q];
+            auto before = outgoing.size();
+
+            local.collect([&] (const octree::node& n)
+            {
+                for (std::size_t b = 0; b < target.size(); b += 2)
+                {
+                    if (! (n.size < theta * octree::box_distance(n.com, target[b], target[b + 1])))
+                    {
+                        return octree::action::open;
+                    }
+                }
+                return octree::action::summarize;
+            }, [] (const body&) { return true; }, outgoing);
+
+            sendcounts[q] = outgoing.size() - before;
+        }
+        auto recvcounts = std::vector<int>();
+        essential = octree(comm.sparse_exchange(outgoing, sendcounts, recvcounts), leaf_size);
+    }
+
+
+    /**
+     * Return the accelerations of the local bodies, in their input order,
+     * from walks of the local and the essential trees. The trees are walked
+     * once per local leaf, accepting nodes against the leaf's bounding box,
+     * and the resulting interaction list is applied to each body in the leaf.
+     */
+    std::vector<point> accelerations(double theta, double eps) const
+    {
+        auto res = std::vector<point>(local.size());
+        auto list = std::vector<body>();
+        auto lx = std::vector<double>(), ly = std::vector<double>(), lz = std::vector<double>(), lm = std::vector<double>();
+        const auto& bodies = local.bodies();
+
+        for (const auto& leaf : local.tree())
+        {
+            if (! leaf.leaf)
+            {
+                continue;
+            }
+            auto decide = [&] (const octree::node& n)
+            {
+                return n.size < theta * octree::box_distance(n.com, leaf.bmin, leaf.bmax) ? octree::action::summarize : octree::action::open;
+            };
+            auto keep = [] (const body&) { return true; };
+
+            list.clear();
+            local.collect(decide, keep, list);
+            essential.collect(decide, keep, list);
+            lx.resize(list.size());
+            ly.resize(list.size());
+            lz.resize(list.size());
+            lm.resize(list.size());
+
+            for (std::size_t j = 0; j < list.size(); ++j)
+            {
+                lx[j] = list[j].x[0];
+                ly[j] = list[j].x[1];
+                lz[j] = list[j].x[2];
+                lm[j] = list[j].mass;
+            }
+            for (auto i = leaf.begin; i < leaf.end; ++i)
+            {
+                auto x = bodies[i].x[0], y = bodies[i].x[1], z = bodies[i].x[2];
+                auto ax = 0.0, ay = 0.0, az = 0.0;
+
+                for (std::size_t j = 0; j < list.size(); ++j)
+                {
+                    auto dx = lx[j] - x, dy = ly[j] - y, dz = lz[j] - z;
+                    auto r2 = dx * dx + dy * dy + dz * dz + eps * eps;
+                    auto f = r2 > 0.0 ? lm[j] / (r2 * std::sqrt(r2)) : 0.0;
+                    ax += f * dx;
+                    ay += f * dy;
+                    az += f * dz;
+                }
+                res[local.input_index(i)] = {{ax, ay, az}};
+            }
+        }
+        return res;
+    }
+
+
+    /**
+     * Return the bodies on other ranks that lie within distance r of this
+     * rank's branch boxes, e.g. for fixed-radius neighbour searches. This is
+     * a collective operation.
+     */
+    std::vector<body> halo(double r) const
+    {
+        auto outgoing = std::vector<body>();
+        auto sendcounts = std::vector<int>(comm.size(), 0);
+
+        for (int q = 0; q < comm.size(); ++q)
+        {
+            if (q == comm.rank())
+            {
+                continue;
+            }
+            const auto& target = boxes[q];
+            auto near = [&] (const point& lo, const point& hi)
+            {
+                for (std::size_t b = 0; b < target.size(); b += 2)
+                {
+                    if (octree::box_box_distance(lo, hi, target[b], target[b + 1]) <= r)
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            auto before = outgoing.size();
+
+            local.collect(
+                [&] (const octree::node& n) { return near(n.bmin, n.bmax) ? octree::action::open : octree::action::skip; },
+                [&] (const body& b) { return near(b.x, b.x); }, outgoing);
+
+            sendcounts[q] = outgoing.size() - before;
+        }
+        auto recvcounts = std::vector<int>();
+        return comm.sparse_exchange(outgoing, sendcounts, recvcounts);
+    }
+
+
+private:
+    // ========================================================================
+    /**
+     * Gather the bounding boxes (as lower, upper corner pairs) of the nodes
+     * at the branch depth, or of shallower leaves.
+     */
+    void collect_branches(int id, int depth, int branch_depth, std::vector<point>& out) const
+    {
+        if (local.tree().empty())
+        {
+            return;
+        }
+        const auto& n = local.tree()[id];
+
+        if (n.leaf || depth == branch_depth)
+        {
+            out.push_back(n.bmin);
+            out.push_back(n.bmax);
+            return;
+        }
+        for (int c = 0; c < 8; ++c)
+        {
+            if (n.children[c] >= 0)
+            {
+                collect_branches(n.children[c], depth + 1, branch_depth, out);
+            }
+        }
+    }
+
+    const Communicator& comm;
+    octree local;
+    octree essential;
+    std::size_t leaf_size;
+    std::vector<std::vector<point>> boxes;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Distributed graph with a 1-D vertex partition: each rank owns a
+ * contiguous block of the global vertex ids, in rank order, and stores the
+ * adjacency lists of its vertices in CSR form. Traversals exchange only
+ * their frontiers, with sparse_exchange, so their communication is
+ * proportional to the edges cut rather than to the graph size:
+ *
+ *              auto g = mpi::ext::graph(comm, num_local, edges);
+ *              auto level = g.bfs(0);
+ *              auto label = g.connected_components();
+ */
+class mpi::ext::graph
+{
+public:
+
+
+    // ========================================================================
+    using vertex = std::uint64_t;
+    using edge = std::array<vertex, 2>;
+
+
+    // ========================================================================
+    /**
+     * Construct a graph from the adjacency lists of this rank's vertices,
+     * in CSR form, with global vertex ids in cols. Vertices are numbered
+     * consecutively in rank order.
+     */
+    graph(const Communicator& comm, const std::vector<std::size_t>& row_ptr, const std::vector<vertex>& cols)
+    : comm(comm)
+    , row_ptr(row_ptr)
+    , cols(cols)
+    {
+        if (row_ptr.empty() || row_ptr.back() != cols.size())
+        {
+            throw std::invalid_argument("graph row pointer does not match the columns");
+        }
+        partition(row_ptr.size() - 1);
+    }
+
+
+    /**
+     * Construct a graph with num_local vertices on this rank, from edges
+     * which may be listed on any rank. Each edge is routed to the owner of
+     * its first vertex, and if symmetric is true (the default), also to the
+     * owner of its second vertex with the ends reversed. Duplicate edges
+     * are removed. This is a collective operation.
+     */
+    graph(const Communicator& comm, std::size_t num_local, std::vector<edge> edges, bool symmetric=true)
+    : comm(comm)
+    {
+        partition(num_local);
+
+        if (symmetric)
+        {
+            auto n = edges.size();
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                edges.push_back({{edges[i][1], edges[i][0]}});
+            }
+        }
+        auto dest = std::vector<int>(edges.size());
+        auto sendcounts = std::vector<int>(comm.size(), 0);
+
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            if (edges[i][0] >= starts.back() || edges[i][1] >= starts.back())
+            {
+                throw std::invalid_argument("graph edge refers to a vertex out of range");
+            }
+            dest[i] = owner(edges[i][0]);
+            sendcounts[dest[i]]++;
+        }
+        auto offsets = std::vector<std::size_t>(comm.size() + 1, 0);
+        std::partial_sum(sendcounts.begin(), sendcounts.end(), offsets.begin() + 1);
+        auto sendbuf = std::vector<edge>(edges.size());
+
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            sendbuf[offsets[dest[i]]++] = edges[i];
+        }
+        auto recvcounts = std::vector<int>();
+        edges = comm.sparse_exchange(sendbuf, sendcounts, recvcounts);
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        row_ptr.assign(num_local + 1, 0);
+
+        for (const auto& e : edges)
+        {
+            row_ptr[e[0] - first + 1]++;
+            cols.push_back(e[1]);
+        }
+        std::partial_sum(row_ptr.begin(), row_ptr.end(), row_ptr.begin());
+    }
+
+
+    /**
+     * Return the number of vertices owned by this rank.
+     */
+    std::size_t local_vertices() const
+    {
+        return row_ptr.size() - 1;
+    }
+
+
+    /**
+     * Return the global id of this rank's first vertex.
+     */
+    vertex first_vertex() const
+    {
+        return first;
+    }
+
+
+    /**
+     * Return the number of vertices on all ranks.
+     */
+    vertex global_vertices() const
+    {
+        return starts.back();
+    }
+
+
+    /**
+     * Return the rank that owns the given vertex.
+     */
+    int owner(vertex v) const
+    {
+        return int(std::upper_bound(starts.begin(), starts.end(), v) - starts.begin()) - 1;
+    }
+
+
+    /**
+     * Return the neighbors of local vertex i (a local index) as a pointer
+     * range of global ids.
+     */
+    std::pair<const vertex*, const vertex*> neighbors(std::size_t i) const
+    {
+        return {cols.data() + row_ptr[i], cols.data() + row_ptr[i + 1]};
+    }
+
+
+    /**
+     * Run a level-synchronous breadth-first search from the given global
+     * vertex, and return the level (distance in edges) of each local vertex,
+     * or -1 if it was not reached. Each level, the remote neighbors of the
+     * frontier are sent to their owners, deduplicated per owner, in one
+     * sparse exchange. This is a collective operation.
+     */
+    std::vector<std::int64_t> bfs(vertex source) const
+    {
+        auto level = std::vector<std::int64_t>(local_vertices(), -1);
+        auto frontier = std::vector<std::size_t>();
+        auto next = std::vector<std::size_t>();
+        auto remote = std::vector<vertex>();
+        auto depth = std::int64_t(0);
+
+        if (is_local(source))
+        {
+            level[source - first] = 0;
+            frontier.push_back(source - first);
+        }
+        while (comm.all_reduce(std::uint64_t(frontier.size())) > 0)
+        {
+            next.clear();
+            remote.clear();
+
+            for (auto i : frontier)
+            {
+                for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k)
+                {
+                    auto v = cols[k];
+
+                    if (! is_local(v))
+                    {
+                        remote.push_back(v);
+                    }
+                    else if (level[v - first] < 0)
+                    {
+                        level[v - first] = depth + 1;
+                        next.push_back(v - first);
+                    }
+                }
+            }
+
+            // Ids sorted are grouped by owner, which is the layout
+            // sparse_exchange wants.
+            std::sort(remote.begin(), remote.end());
+            remote.erase(std::unique(remote.begin(), remote.end()), remote.end());
+
+            for (auto v : exchange(remote))
+            {
+                if (level[v - first] < 0)
+                {
+                    level[v - first] = depth + 1;
+                    next.push_back(v - first);
+                }
+            }
+            frontier.swap(next);
+            ++depth;
+        }
+        return level;
+    }
+
+
+    /**
+     * Label the connected components, and return for each local vertex the
+     * smallest global vertex id in its component. The adjacency must be
+     * symmetric. The components of the subgraph within this rank are found
+     * first with union-find, and labels are then propagated between ranks
+     * along the cut edges: each round, the local components whose label
+     * changed send it to the owners of their remote neighbors. This is a
+     * collective operation, which takes a number of rounds proportional to
+     * the number of rank crossings on the paths of a component, rather than
+     * to its diameter.
+     */
+    std::vector<vertex> connected_components() const
+    {
+        auto n = local_vertices();
+        auto parent = std::vector<std::size_t>(n);
+        std::iota(parent.begin(), parent.end(), std::size_t(0));
+
+        auto find = [&parent] (std::size_t i)
+        {
+            while (parent[i] != i)
+            {
+                i = parent[i] = parent[parent[i]];
+            }
+            return i;
+        };
+        auto boundary = std::vector<std::pair<std::size_t, vertex>>();
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k)
+            {
+                if (is_local(cols[k]))
+                {
+                    auto a = find(i), b = find(cols[k] - first);
+                    parent[std::max(a, b)] = std::min(a, b);
+                }
+            }
+        }
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            parent[i] = find(i);
+
+            for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k)
+            {
+                if (! is_local(cols[k]))
+                {
+                    boundary.emplace_back(parent[i], cols[k]);
+                }
+            }
+        }
+        std::sort(boundary.begin(), boundary.end());
+        boundary.erase(std::unique(boundary.begin(), boundary.end()), boundary.end());
+
+        // Each component's root is its smallest local vertex, so the label
+        // starts as the root's global id.
+        auto label = std::vector<vertex>(n);
+        auto changed = std::vector<char>(n, 1);
+        auto updates = std::vector<edge>();
+        std::iota(label.begin(), label.end(), first);
+
+        while (true)
+        {
+            updates.clear();
+
+            for (const auto& b : boundary)
+            {
+                if (changed[b.first])
+                {
+                    updates.push_back({{b.second, label[b.first]}});
+                }
+            }
+            std::fill(changed.begin(), changed.end(), 0);
+
+            if (comm.all_reduce(std::uint64_t(updates.size())) == 0)
+            {
+                break;
+            }
+            std::sort(updates.begin(), updates.end());
+            updates.erase(std::unique(updates.begin(), updates.end(),
+                [] (const edge& a, const edge& b) { return a[0] == b[0]; }), updates.end());
+
+            for (const auto& u : exchange(updates))
+            {
+                auto root = parent[u[0] - first];
+
+                if (u[1] < label[root])
+                {
+                    label[root] = u[1];
+                    changed[root] = 1;
+                }
+            }
+        }
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            label[i] = label[parent[i]];
+        }
+        return label;
+    }
+
+
+private:
+    // ========================================================================
+    void partition(std::size_t num_local)
+    {
+        first = comm.exscan(vertex(num_local));
+        starts = comm.all_gather(first);
+        starts.push_back(comm.all_reduce(vertex(num_local)));
+    }
+
+    bool is_local(vertex v) const
+    {
+        return v - first < local_vertices();
+    }
+
+    static vertex target(vertex v) { return v; }
+    static vertex target(const edge& e) { return e[0]; }
+
+
+    /**
+     * Send each item to the owner of its target vertex. The items must be
+     * sorted by target.
+     */
+    template <typename T>
+    std::vector<T> exchange(const std::vector<T>& items) const
+    {
+        auto sendcounts = std::vector<int>(comm.size(), 0);
+        auto recvcounts = std::vector<int>();
+
+        for (const auto& item : items)
+        {
+            sendcounts[owner(target(item))]++;
+        }
+        return comm.sparse_exchange(items, sendcounts, recvcounts);
+    }
+
+    const Communicator& comm;
+    std::vector<std::size_t> row_ptr;
+    std::vector<vertex> cols;
+    std::vector<vertex> starts;
+    vertex first = 0;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Receives messages from any rank into a ring of persistent receives, so
+ * that they are delivered straight into their slot rather than first into
+ * MPI's unexpected-message queue. Messages up to the slot size are sent on
+ * one tag and matched by the ring, in the order the receives were posted, so
+ * only the oldest slot needs testing; each slot is reposted as soon as its
+ * message is consumed. Larger messages are sent on a second tag, and picked
+ * up by probing. Every rank constructs the mailbox, with the same slot size:
+ *
+ *              auto box = mpi::ext::mailbox(comm, 16, 4096);
+ *              box.send("work item", 0);
+ *              box.poll([] (int source, const char* data, std::size_t size) { ... });
+ *
+ * Small messages from one rank arrive in order, but may overtake large ones.
+ * Messages still in flight when the mailbox is destroyed are lost, so drain
+ * it first, e.g. after a barrier.
+ */
+class mpi::ext::mailbox
+{
+public:
+
+
+    // ========================================================================
+    mailbox(const Communicator& comm, std::size_t slots=16, std::size_t slot_size=4096)
+    : tags(comm, 2)
+    , slot_size(slot_size)
+    , buffer(slots * slot_size)
+    {
+        if (slots == 0 || slot_size == 0)
+        {
+            throw std::invalid_argument("mailbox needs at least one slot of non-zero size");
+        }
+        for (std::size_t i = 0; i < slots; ++i)
+        {
+            ring.push_back(tags.recv_init(buffer.data() + i * slot_size, slot_size, any_source, 0));
+            ring.back().start();
+        }
+    }
+
+
+    /**
+     * Return the largest message which goes through the ring.
+     */
+    std::size_t max_slot_size() const
+    {
+        return slot_size;
+    }
+
+
+    /**
+     * Send a message to the mailbox on the given rank, blocking until the
+     * buffer can be reused.
+     */
+    void send(const std::string& message, int rank) const
+    {
+        tags.send(message, rank, tag_for(message.size()));
+    }
+
+
+    /**
+     * Send a message to the mailbox on the given rank, without blocking.
+     */
+    Request isend(std::string message, int rank) const
+    {
+        auto tag = tag_for(message.size());
+        return tags.isend(std::move(message), rank, tag);
+    }
+
+
+    /**
+     * If a message has arrived, pass its source rank, data, and size to the
+     * handler and return true; otherwise return false without blocking. A
+     * message in the ring is read in place, and its slot reposted when the
+     * handler returns.
+     */
+    template <typename Handler>
+    bool poll(Handler handler)
+    {
+        auto& slot = ring[head];
+        auto status = slot.status();
+
+        if (! status.is_null())
+        {
+            slot.wait();
+            handler(status.source(), buffer.data() + head * slot_size, std::size_t(status.count()));
+            slot.start();
+            head = (head + 1) % ring.size();
+            return true;
+        }
+        auto large = tags.iprobe(any_source, 1);
+
+        if (! large.is_null())
+        {
+            auto message = tags.recv(large.source(), 1);
+            handler(large.source(), message.data(), message.size());
+            return true;
+        }
+        return false;
+    }
+
+
+    /**
+     * If a message has arrived, store it and its source rank and return
+     * true; otherwise return false without blocking.
+     */
+    bool poll(int& source, std::string& message)
+    {
+        return poll([&] (int s, const char* data, std::size_t size)
+        {
+            source = s;
+            message.assign(data, size);
+        });
+    }
+
+
+    /**
+     * Block until a message arrives, and return it, storing its source rank.
+     */
+    std::string receive(int& source)
+    {
+        auto message = std::string();
+
+        while (! poll(source, message))
+        {
+        }
+        return message;
+    }
+
+
+private:
+    // ========================================================================
+    int tag_for(std::size_t size) const
+    {
+        return size <= slot_size ? 0 : 1;
+    }
+
+    TagSpace tags;
+    std::size_t slot_size;
+    std::vector<char> buffer;
+    std::vector<Request> ring;
+    std::size_t head = 0;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Point-to-point messages with credit-based flow control, so that many
+ * ranks sending to one can not flood its unexpected-message queue. Each
+ * sender starts with a number of credits for every destination, and spends
+ * one per message. Out of credits, send() makes progress until credit
+ * returns, while post() queues the message locally and sends it later. The
+ * receiver returns credits in acknowledgments, one for every half of the
+ * credits' worth of messages consumed from a sender, so at most credits
+ * messages from each sender are ever unconsumed at the receiver:
+ *
+ *              auto chan = mpi::ext::channel(comm, 16);
+ *              chan.post(result, 0);
+ *              ...
+ *              chan.close();
+ *
+ * Every rank constructs the channel, and closes it once all the messages
+ * sent have been received. Receiving and posting both make progress on the
+ * channel; a rank which only sends can call progress() or flush().
+ *
+ * Credit only comes back when the destination consumes messages with poll()
+ * or receive(); progress() takes in acknowledgments but never receives
+ * data. So send() returns only if the destination is receiving meanwhile:
+ * two ranks blocked in send() to each other, or a rank sending to itself,
+ * with no credit left will wait forever. Symmetric patterns should use
+ * post(), and receive while the queue drains.
+ */
+class mpi::ext::channel
+{
+public:
+
+
+    // ========================================================================
+    channel(const Communicator& comm, int credits=16)
+    : tags(comm, 2)
+    , initial(credits)
+    , credits(comm.size(), credits)
+    , unacked(comm.size(), 0)
+    , queues(comm.size())
+    {
+        if (credits <= 0)
+        {
+            throw std::invalid_argument("channel needs a positive number of credits");
+        }
+    }
+
+
+    /**
+     * Send a message to the given rank, making progress on the channel
+     * (and so receiving acknowledgments) while out of credits for it. This
+     * needs the destination to be receiving; see the class notes. Throws
+     * std::logic_error if sending to this rank without credit, which could
+     * never complete.
+     */
+    void send(std::string message, int rank)
+    {
+        if (rank == tags.communicator().rank() && credits[rank] <= int(queues[rank].size()))
+        {
+            throw std::logic_error("channel::send to this rank without credit; use post and poll instead");
+        }
+        while (credits[rank] == 0 || ! queues[rank].empty())
+        {
+            progress();
+        }
+        transmit(std::move(message), rank);
+    }
+
+
+    /**
+     * Send a message to the given rank if there is credit for it, or else
+     * queue it to be sent when credit returns. This never blocks.
+     */
+    void post(std::string message, int rank)
+    {
+        queues[rank].push_back(std::move(message));
+        progress();
+    }
+
+
+    /**
+     * If a message has arrived, store it and its source rank and return
+     * true; otherwise return false without blocking.
+     */
+    bool poll(int& source, std::string& message)
+    {
+        progress();
+        auto status = tags.iprobe(any_source, 0);
+
+        if (status.is_null())
+        {
+            return false;
+        }
+        source = status.source();
+        message = tags.recv(source, 0);
+
+        if (++unacked[source] >= std::max(1, initial / 2))
+        {
+            acknowledge(source);
+        }
+        return true;
+    }
+
+
+    /**
+     * Block until a message arrives, and return it, storing its source rank.
+     */
+    std::string receive(int& source)
+    {
+        auto message = std::string();
+
+        while (! poll(source, message))
+        {
+        }
+        return message;
+    }
+
+
+    /**
+     * Take in returned credits, send queued messages that now have credit,
+     * and release completed sends.
+     */
+    void progress()
+    {
+        while (true)
+        {
+            auto status = tags.iprobe(any_source, 1);
+
+            if (status.is_null())
+            {
+                break;
+            }
+            credits[status.source()] += tags.recv<int>(status.source(), 1);
+        }
+        for (std::size_t rank = 0; rank < queues.size(); ++rank)
+        {
+            while (credits[rank] > 0 && ! queues[rank].empty())
+            {
+                transmit(std::move(queues[rank].front()), rank);
+                queues[rank].pop_front();
+            }
+        }
+        sends.erase(std::remove_if(sends.begin(), sends.end(), [] (const Request& r) { return r.is_ready(); }), sends.end());
+    }
+
+
+    /**
+     * Make progress until all the queued messages have been sent.
+     */
+    void flush()
+    {
+        while (queued() > 0)
+        {
+            progress();
+        }
+        for (auto& request : sends)
+        {
+            request.wait();
+        }
+        sends.clear();
+    }
+
+
+    /**
+     * Return the number of messages queued locally for lack of credit.
+     */
+    std::size_t queued() const
+    {
+        auto n = std::size_t(0);
+
+        for (const auto& q : queues)
+        {
+            n += q.size();
+        }
+        return n;
+    }
+
+
+    /**
+     * Return the number of messages sent to the given rank and not yet
+     * acknowledged. This never exceeds the number of credits.
+     */
+    int in_flight(int rank) const
+    {
+        return initial - credits[rank];
+    }
+
+
+    /**
+     * Flush the queued messages, return the credits for the messages
+     * received, and wait until all credits have come back, so no messages
+     * are left in flight. Every message sent must have been received before
+     * this is called. This is a collective operation.
+     */
+    void close()
+    {
+        flush();
+
+        for (std::size_t rank = 0; rank < unacked.size(); ++rank)
+        {
+            if (unacked[rank] > 0)
+            {
+                acknowledge(rank);
+            }
+        }
+        while (std::any_of(credits.begin(), credits.end(), [this] (int c) { return c < initial; }))
+        {
+            progress();
+        }
+        flush();
+        tags.communicator().barrier();
+    }
+
+
+private:
+    // ========================================================================
+    void transmit(std::string message, int rank)
+    {
+        --credits[rank];
+        sends.push_back(tags.isend(std::move(message), rank, 0));
+    }
+
+    void acknowledge(int rank)
+    {
+        sends.push_back(tags.isend(unacked[rank], rank, 1));
+        unacked[rank] = 0;
+    }
+
+    TagSpace tags;
+    int initial;
+    std::vector<int> credits;
+    std::vector<int> unacked;
+    std::vector<std::deque<std::string>> queues;
+    std::vector<Request> sends;
+};
+
+
+
+
+// ============================================================================
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+
+
+
+// ============================================================================
+void example_ring()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+
+    outp.only(0) << "\n<--------- isend, recv --------->\n\n";
+
+    for (int i = 0; i < comm.size(); ++i)
+    {
+        if (i == comm.rank())
+        {
+            auto content = "Hello from proc " + std::to_string(i) + "!";
+            auto request = comm.isend(content, (comm.rank() + 1) % comm.size());
+            auto message = comm.recv((comm.rank() + comm.size() - 1) % comm.size());
+
+            outp << "Proc " << " " << comm.rank() << " received '" << message << "\n";
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+void example_scatter()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto res = int();
+
+    outp.only(0) << "\n<--------- scatter --------->\n\n";
+
+    if (comm.rank() == 0)
+    {
+        auto values = std::vector<int>(comm.size());
+
+        for (int n = 0; n < values.size(); ++n)
+        {
+            values[n] = n;
+        }
+        res = comm.scatter(0, values);
+    }
+    else
+    {
+        res = comm.scatter(0, std::vector<int>());
+    }
+    outp << "Rank " << comm.rank() << " has res = " << res << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_scatterv()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto res = std::vector<int>();
+
+    outp.only(0) << "\n<--------- scatterv --------->\n\n";
+
+    if (comm.rank() == 0)
+    {
+        auto values = std::vector<std::vector<int>>(comm.size());
+
+        for (int n = 0; n < values.size(); ++n)
+        {
+            values[n] = std::vector<int>(n + 1, n);
+        }
+        res = comm.scatter(0, values);
+    }
+    else
+    {
+        res = comm.scatter(0, std::vector<std::vector<int>>());
+    }
+    
+    outp << "Rank " << comm.rank() << " has res.size() = " << res.size() << " and values ";
+
+    for (auto v : res)
+    {
+        outp << v << ", ";
+    }
+    outp << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_all_gather()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+
+    outp.only(0) << "\n<--------- all-gather --------->\n\n";
+
+    for (auto r : comm.all_gather(comm.rank()))
+    {
+        outp.only(0) << r << " ";
+    }
+    outp.only(0) << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_all_gatherv()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto res = comm.all_gather(std::vector<int>(comm.rank() + 1, comm.rank()));
+
+    outp.only(0) << "\n<--------- all-gatherv --------->\n\n";
+
+    outp << "Rank " << comm.rank() << " has res.size() = " << res.size() << "\n";
+
+    outp.only(0) << "The final rank sent values: ";
+
+    for (auto v : res.back())
+    {
+        outp.only(0) << v << ", ";
+    }
+    outp.only(0) << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_gather()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto counts = std::vector<int>();
+    auto ranks = comm.gather(0, comm.rank());
+    auto flat = comm.gatherv(0, std::vector<int>(comm.rank() + 1, comm.rank()), counts);
+
+    outp.only(0) << "\n<--------- gather, gatherv --------->\n\n";
+
+    outp << "Rank " << comm.rank() << " has ranks.size() = " << ranks.size() << " and flat.size() = " << flat.size() << "\n";
+
+    outp.only(0) << "Counts at the root: ";
+
+    for (auto c : counts)
+    {
+        outp.only(0) << c << ", ";
+    }
+    outp.only(0) << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_scan()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto count = 10 * (comm.rank() + 1);
+    auto start = comm.exscan(count);
+    auto total = comm.scan(count);
+    auto peak = comm.iscan(comm.rank() % 2 ? -comm.rank() : comm.rank(), mpi::max<int>());
+    auto prior = comm.iexscan(comm.rank() == 1 ? 100 : comm.rank(),
+        [] (int a, int b) { return a > b ? a : b; });
+
+    outp.only(0) << "\n<--------- scan, exscan --------->\n\n";
+
+    outp << "Rank " << comm.rank() << " writes [" << start << ", " << total << ")"
+         << ", running max = " << peak.get<int>()
+         << ", exclusive max = " << prior.get<int>() << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_user_reduction()
+{
+    struct vec3 { double x, y, z; };
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto r = double(comm.rank());
+    auto points = std::vector<vec3>{{r, -r, 1.0}, {-r, r, 2.0 * r}};
+    auto lower = comm.all_reduce(points, mpi::componentwise<mpi::min<double>>());
+    auto upper = comm.all_reduce(points, mpi::componentwise<mpi::max<double>>());
+    auto acc = mpi::compensated<double>();
+    auto naive = 0.0;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        acc += 0.1;
+        naive += 0.1;
+    }
+    auto total = comm.all_reduce(acc, mpi::compensated_plus<double>());
+    auto naive_total = comm.all_reduce(naive);
+
+    outp.only(0) << "\n<--------- user-defined reductions --------->\n\n";
+    outp.only(0) << "lower[1] = (" << lower[1].x << ", " << lower[1].y << ", " << lower[1].z << ")\n";
+    outp.only(0) << "upper[1] = (" << upper[1].x << ", " << upper[1].y << ", " << upper[1].z << ")\n";
+    outp.only(0) << std::setprecision(17) << "compensated sum of 0.1's = " << total.value() << " (naive " << naive_total << ")\n";
+}
+
+
+
+
+// ============================================================================
+void example_reproducible_sum()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto global = std::vector<double>(100000);
+
+    for (std::size_t i = 0; i < global.size(); ++i)
+    {
+        global[i] = std::sin(double(i)) * std::pow(10.0, int(i % 13) - 6);
+    }
+
+    // Two different decompositions of the same global array: equal blocks
+    // in rank order, and uneven blocks in reverse rank order.
+    auto block = [&] (std::size_t i0, std::size_t i1) { return std::vector<double>(global.begin() + i0, global.begin() + i1); };
+    auto n = global.size();
+    auto p = std::size_t(comm.size());
+    auto r = std::size_t(comm.rank());
+    auto q = p - 1 - r;
+    auto a = block(n * r / p, n * (r + 1) / p);
+    auto b = block(n * q * q / (p * p), n * (q + 1) * (q + 1) / (p * p));
+
+    auto plain_a = comm.all_sum(a);
+    auto plain_b = comm.all_sum(b);
+    auto exact_a = comm.all_sum(a, mpi::reproducible_plus<double>());
+    auto exact_b = comm.all_sum(b, mpi::reproducible_plus<double>());
+
+    outp.only(0) << "\n<--------- reproducible sum --------->\n\n";
+    outp.only(0) << std::setprecision(17) << "plain:        " << plain_a << " vs " << plain_b << (plain_a == plain_b ? " (same)" : " (differ)") << "\n";
+    outp.only(0) << std::setprecision(17) << "reproducible: " << exact_a << " vs " << exact_b << (exact_a == exact_b ? " (same)" : " (differ)") << "\n";
+
+    // A NaN on one rank has to reach the result, as it would in a plain sum.
+    auto poisoned = comm.rank() == 0 ? std::vector<double>{1.0, std::nan("")} : std::vector<double>{1.0, 2.0};
+    auto nan_sum = comm.all_sum(poisoned, mpi::reproducible_plus<double>());
+    auto nan_each = comm.all_reduce(poisoned, mpi::reproducible_plus<double>());
+    auto nan_ok = std::isnan(nan_sum) && nan_each[0] == comm.size() && std::isnan(nan_each[1]);
+    outp.only(0) << "NaN propagates: " << (nan_ok ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_allreduce_algorithms()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto algorithms = {
+        mpi::Algorithm::recursive_doubling,
+        mpi::Algorithm::ring,
+        mpi::Algorithm::rabenseifner,
+        mpi::Algorithm::hierarchical};
+
+    outp.only(0) << "\n<--------- allreduce algorithms --------->\n\n";
+
+    // A user message on the tag the algorithms use internally stays pending
+    // while they run; they work on the library communicator, so they must
+    // neither take it nor be disturbed by it.
+    auto right = (comm.rank() + 1) % comm.size();
+    auto left = (comm.rank() + comm.size() - 1) % comm.size();
+    auto stray = comm.isend(-1 - comm.rank(), right, mpi::detail::collective_tag);
+
+    for (auto algorithm : algorithms)
+    {
+        auto agree = true;
+
+        for (auto n : {0, 1, 3, 1000, 12345})
+        {
+            auto values = std::vector<long>(n);
+
+            for (int i = 0; i < n; ++i)
+            {
+                values[i] = (i + 1) * (comm.rank() + 1);
+            }
+            auto expected = comm.all_reduce(values, std::plus<long>(), mpi::Algorithm::native);
+            auto result = comm.all_reduce(values, std::plus<long>(), algorithm);
+            agree = agree && result == expected;
+        }
+        outp.only(0) << mpi::to_string(algorithm) << ": " << (comm.all_reduce(agree, std::logical_and<bool>()) ? "ok" : "FAILED") << "\n";
+    }
+    auto untouched = comm.recv<int>(left, mpi::detail::collective_tag) == -1 - left;
+    stray.wait();
+    outp.only(0) << "user message on a library tag left alone: " << (comm.all_reduce(untouched, std::logical_and<bool>()) ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_persistent_collectives()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto local = std::vector<double>(2);
+    auto global = std::vector<double>();
+    auto count = 0;
+    auto total = 0;
+    auto requests = mpi::RequestSet();
+
+    requests.add(comm.all_reduce_init(local, global));
+    requests.add(comm.all_reduce_init(count, total));
+
+    outp.only(0) << "\n<--------- persistent collectives --------->\n\n";
+
+    for (int iteration = 0; iteration < 3; ++iteration)
+    {
+        local = {1.0 * iteration, 1.0 * comm.rank()};
+        count = iteration + comm.rank();
+        requests.start_all();
+        requests.wait_all();
+        outp.only(0) << "iteration " << iteration << ": global = (" << global[0] << ", " << global[1] << "), total = " << total << "\n";
+    }
+}
+
+
+
+
+// ============================================================================
+void example_pipelined_cg()
+{
+    using vector = mpi::ext::dist_vector<double>;
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto ranks = comm.size();
+    auto rank = comm.rank();
+    auto n = std::size_t(400);
+    auto local_size = n * (rank + 1) / ranks - n * rank / ranks;
+    auto left = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    auto right = rank < ranks - 1 ? rank + 1 : MPI_PROC_NULL;
+
+    // y = A x, where A is the 1D Laplacian tridiag(-1, 2, -1).
+    auto apply = [&] (const vector& x, vector& y)
+    {
+        auto m = x.size();
+        auto ghost_l = 0.0;
+        auto ghost_r = 0.0;
+        comm.sendrecv(x.data(), 1, left, &ghost_r, 1, right);
+        comm.sendrecv(x.data() + m - 1, 1, right, &ghost_l, 1, left);
+
+        for (std::size_t i = 0; i < m; ++i)
+        {
+            auto xl = i == 0 ? ghost_l : x[i - 1];
+            auto xr = i == m - 1 ? ghost_r : x[i + 1];
+            y[i] = 2 * x[i] - xl - xr;
+        }
+    };
+
+    auto b = vector(comm, local_size, 1.0);
+    auto x = vector(comm, local_size);
+    auto r = b;
+    auto w = vector(comm, local_size);
+    auto q = w, z = w, s = w, p = w;
+    auto dots = mpi::ext::fused_reduction<double>(comm);
+    auto gamma_old = 0.0, alpha_old = 0.0;
+    auto norm_b = b.norm();
+    auto iteration = 0;
+
+    apply(r, w);
+
+    for (; iteration < 2000; ++iteration)
+    {
+        dots.reset();
+        auto rr = dots.add_dot(r, r);
+        auto wr = dots.add_dot(w, r);
+        dots.start();
+
+        apply(w, q); // overlaps the reduction
+
+        auto gamma = dots[rr];
+        auto delta = dots[wr];
+
+        if (std::sqrt(gamma) < 1e-8 * norm_b)
+        {
+            break;
+        }
+        auto beta = iteration > 0 ? gamma / gamma_old : 0.0;
+        auto alpha = iteration > 0 ? gamma / (delta - beta * gamma / alpha_old) : gamma / delta;
+
+        z.axpby(1.0, q, beta);
+        s.axpby(1.0, w, beta);
+        p.axpby(1.0, r, beta);
+        x.axpy(alpha, p);
+        r.axpy(-alpha, s);
+        w.axpy(-alpha, z);
+        gamma_old = gamma;
+        alpha_old = alpha;
+    }
+
+    auto ax = vector(comm, local_size);
+    apply(x, ax);
+    auto residual = ax.axpy(-1.0, b).norm() / norm_b;
+
+    outp.only(0) << "\n<--------- pipelined CG --------->\n\n";
+    outp.only(0) << "converged in " << iteration << " iterations, one fused all-reduce each, relative residual " << residual << "\n";
+}
+
+
+
+
+// ============================================================================
+/**
+ * Build this rank's rows of the 7-point 3D Laplacian on an n^3 grid, with
+ * rows distributed in contiguous blocks.
+ */
+mpi::ext::dist_csr<double> laplacian_3d(const mpi::Communicator& comm, std::size_t n)
+{
+    auto total = n * n * n;
+    auto r = std::size_t(comm.rank());
+    auto p = std::size_t(comm.size());
+    auto row0 = total * r / p;
+    auto row1 = total * (r + 1) / p;
+    auto row_ptr = std::vector<std::size_t>{0};
+    auto cols = std::vector<std::uint64_t>();
+    auto values = std::vector<double>();
+
+    for (auto row = row0; row < row1; ++row)
+    {
+        auto i = row / (n * n), j = row / n % n, k = row % n;
+
+        auto add = [&] (std::size_t c, double v) { cols.push_back(c); values.push_back(v); };
+
+        if (i > 0)     add(row - n * n, -1.0);
+        if (j > 0)     add(row - n, -1.0);
+        if (k > 0)     add(row - 1, -1.0);
+
+        add(row, 6.0);
+
+        if (k < n - 1) add(row + 1, -1.0);
+        if (j < n - 1) add(row + n, -1.0);
+        if (i < n - 1) add(row + n * n, -1.0);
+
+        row_ptr.push_back(cols.size());
+    }
+    return mpi::ext::dist_csr<double>(comm, row_ptr, cols, values);
+}
+
+
+
+
+// ============================================================================
+void example_dist_csr()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto n = std::size_t(12);
+    auto A = laplacian_3d(comm, n);
+    auto x = mpi::ext::dist_vector<double>(comm, A.rows());
+    auto y = mpi::ext::dist_vector<double>(comm, A.rows());
+
+    // With x equal to the global row index, interior rows of A x vanish, and
+    // a row on a face gets the index its missing neighbor would have had.
+    for (std::size_t m = 0; m < x.size(); ++m)
+    {
+        x[m] = double(x.global_offset() + m);
+    }
+    A.multiply(x, y);
+
+    auto error = 0.0;
+
+    for (std::size_t m = 0; m < y.size(); ++m)
+    {
+        auto row = x.global_offset() + m;
+        auto i = row / (n * n), j = row / n % n, k = row % n;
+        auto expected = 0.0;
+
+        if (i == 0)     expected += double(row) - double(n * n);
+        if (i == n - 1) expected += double(row) + double(n * n);
+        if (j == 0)     expected += double(row) - double(n);
+        if (j == n - 1) expected += double(row) + double(n);
+        if (k == 0)     expected += double(row) - 1.0;
+        if (k == n - 1) expected += double(row) + 1.0;
+
+        error = std::max(error, std::fabs(y[m] - expected));
+    }
+
+    outp.only(0) << "\n<--------- distributed sparse matrix --------->\n\n";
+    outp << "Rank " << comm.rank() << " owns " << A.rows() << " rows and receives " << A.ghost_count() << " ghosts\n";
+    outp.only(0) << "max error in A x = " << comm.all_reduce(error, mpi::max<double>()) << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_fft3d()
+{
+    using complex = std::complex<double>;
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto n0 = std::size_t(12), n1 = std::size_t(10), n2 = std::size_t(9);
+    auto fft = mpi::ext::fft3d(comm, n0, n1, n2);
+    auto slab = std::vector<complex>(fft.local_size());
+    auto spectrum = std::vector<complex>(fft.local_size());
+
+    // A single Fourier mode (a, b, c) transforms to n0 n1 n2 at (a, b, c) and
+    // zero elsewhere.
+    auto a = std::size_t(3), b = std::size_t(7), c = std::size_t(2);
+
+    for (std::size_t i = 0; i < fft.x_count(); ++i)
+    {
+        for (std::size_t j = 0; j < n1; ++j)
+        {
+            for (std::size_t k = 0; k < n2; ++k)
+            {
+                auto x = double((fft.x_start() + i) * a) / n0 + double(j * b) / n1 + double(k * c) / n2;
+                slab[(i * n1 + j) * n2 + k] = std::polar(1.0, 2 * M_PI * x);
+            }
+        }
+    }
+    auto original = slab;
+    fft.forward(slab, spectrum);
+
+    auto spectral_error = 0.0;
+
+    for (std::size_t j = 0; j < fft.y_count(); ++j)
+    {
+        for (std::size_t i = 0; i < n0; ++i)
+        {
+            for (std::size_t k = 0; k < n2; ++k)
+            {
+                auto peak = fft.y_start() + j == b && i == a && k == c;
+                auto expected = peak ? double(n0 * n1 * n2) : 0.0;
+                spectral_error = std::max(spectral_error, std::abs(spectrum[(j * n0 + i) * n2 + k] - expected));
+            }
+        }
+    }
+    fft.backward(spectrum, slab);
+
+    auto round_trip_error = 0.0;
+
+    for (std::size_t m = 0; m < fft.x_count() * n1 * n2; ++m)
+    {
+        round_trip_error = std::max(round_trip_error, std::abs(slab[m] - original[m]));
+    }
+
+    outp.only(0) << "\n<--------- distributed 3D FFT --------->\n\n";
+    outp << "Rank " << comm.rank() << " owns x-planes [" << fft.x_start() << ", " << fft.x_start() + fft.x_count()
+         << ") and y-planes [" << fft.y_start() << ", " << fft.y_start() + fft.y_count() << ")\n";
+    outp.only(0) << "max error in spectrum of a single mode = " << comm.all_reduce(spectral_error, mpi::max<double>()) << "\n";
+    outp.only(0) << "max error in forward + backward = " << comm.all_reduce(round_trip_error, mpi::max<double>()) << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_parallel_sort()
+{
+    struct item { int key; int rank; int index; };
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto items = std::vector<item>(1000 + 137 * comm.rank());
+    auto seed = std::uint32_t(12345 + comm.rank());
+
+    for (std::size_t i = 0; i < items.size(); ++i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        items[i] = item{int(seed >> 16) % 50, comm.rank(), int(i)};
+    }
+
+    auto by_key = [] (const item& a, const item& b) { return a.key < b.key; };
+    auto sorted = mpi::ext::parallel_stable_sort(comm, items, by_key);
+
+    // Check that the result is sorted and stable on this rank and across the
+    // boundary with the previous rank, and that the sizes are preserved.
+    auto in_order = [] (const item& a, const item& b)
+    {
+        return a.key < b.key || (a.key == b.key && (a.rank < b.rank || (a.rank == b.rank && a.index < b.index)));
+    };
+    auto ok = sorted.size() == items.size();
+
+    for (std::size_t i = 1; i < sorted.size(); ++i)
+    {
+        ok = ok && in_order(sorted[i - 1], sorted[i]);
+    }
+    auto firsts = comm.all_gather(sorted.front());
+    auto lasts = comm.all_gather(sorted.back());
+
+    for (int q = 1; q < comm.size(); ++q)
+    {
+        ok = ok && in_order(lasts[q - 1], firsts[q]);
+    }
+
+    auto keys = std::vector<double>(items.size());
+    std::transform(items.begin(), items.end(), keys.begin(), [] (const item& a) { return double(a.key); });
+    auto unstable = mpi::ext::parallel_sort(comm, keys);
+    auto sum_before = comm.all_sum(keys);
+    auto sum_after = comm.all_sum(unstable);
+
+    for (std::size_t i = 1; i < unstable.size(); ++i)
+    {
+        ok = ok && unstable[i - 1] <= unstable[i];
+    }
+
+    outp.only(0) << "\n<--------- parallel sample sort --------->\n\n";
+    outp << "Rank " << comm.rank() << " has keys " << sorted.front().key << " to " << sorted.back().key << "\n";
+    outp.only(0) << "stable sort correct: " << (comm.all_reduce(int(ok), mpi::min<int>()) ? "yes" : "no")
+                 << ", key sum preserved: " << (sum_before == sum_after ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_sfc_partition()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto positions = std::vector<mpi::ext::sfc_partition::point>(2000);
+    auto seed = std::uint32_t(2024 + 7 * comm.rank());
+    auto uniform = [&seed] { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / double(1 << 24); };
+
+    // Most particles are in a tight cluster near one corner of the box.
+    for (std::size_t i = 0; i < positions.size(); ++i)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            positions[i][a] = i % 5 == 0 ? uniform() : 0.2 + 0.05 * (uniform() + uniform() + uniform() - 1.5);
+        }
+    }
+
+    // Count the particles each rank would own under a static slab
+    // decomposition along x, for comparison.
+    auto slab_counts = std::vector<int>(comm.size(), 0);
+
+    for (const auto& x : positions)
+    {
+        slab_counts[std::min(comm.size() - 1, int(x[0] * comm.size()))]++;
+    }
+    slab_counts = comm.all_reduce(slab_counts);
+
+    auto partition = mpi::ext::sfc_partition(comm, {0, 0, 0}, {1, 1, 1});
+    auto keys = partition.keys(positions);
+    partition.rebalance(keys, std::vector<double>(keys.size(), 1.0));
+
+    auto plan = partition.plan(keys);
+    positions = partition.migrate(plan, positions);
+    keys = partition.migrate(plan, keys);
+
+    auto owned = std::all_of(keys.begin(), keys.end(), [&] (std::uint64_t k) { return partition.owner(k) == comm.rank(); });
+    auto total = comm.all_reduce(int(positions.size()));
+
+    outp.only(0) << "\n<--------- space-filling curve partition --------->\n\n";
+    outp << "Rank " << comm.rank() << " would own " << slab_counts[comm.rank()] << " particles in a slab, and owns "
+         << positions.size() << " after rebalancing\n";
+    outp.only(0) << "all particles on their owner: " << (comm.all_reduce(int(owned), mpi::min<int>()) ? "yes" : "no")
+                 << ", total " << total << " of " << 2000 * comm.size() << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_migrate()
+{
+    struct particle { double x, v; int id; };
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto p = comm.size();
+    auto left = (comm.rank() + p - 1) % p, right = (comm.rank() + 1) % p;
+    auto neighbors = p == 1 ? std::vector<int>() : p == 2 ? std::vector<int>{right} : std::vector<int>{left, right};
+    auto owner = [p] (double x) { return std::min(p - 1, int(x)); };
+    auto wrap = [p] (double x) { return x < 0.0 ? x + p : x >= p ? x - p : x; };
+
+    // Each rank owns the interval [r, r + 1) of a periodic domain [0, p).
+    // Particles move less than one interval per step, so they only ever go
+    // to a neighbor.
+    auto particles = std::vector<particle>();
+    auto xs = std::vector<double>(), vs = std::vector<double>();
+    auto ids = std::vector<int>();
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto x = comm.rank() + (i + 0.5) / 1000;
+        auto v = 0.9 * std::sin(0.1 * i + comm.rank());
+        particles.push_back({x, v, comm.rank() * 1000 + i});
+        xs.push_back(x);
+        vs.push_back(v);
+        ids.push_back(comm.rank() * 1000 + i);
+    }
+    particles.reserve(2000);
+    xs.reserve(2000);
+
+    auto reallocated = false;
+    auto received = std::size_t(0);
+
+    for (int step = 0; step < 10; ++step)
+    {
+        auto data = particles.data();
+
+        for (auto& q : particles)
+        {
+            q.x = wrap(q.x + q.v);
+        }
+        for (std::size_t i = 0; i < xs.size(); ++i)
+        {
+            xs[i] = wrap(xs[i] + vs[i]);
+        }
+        received += mpi::ext::migrate(comm, particles, [&] (const particle& q) { return owner(q.x); }, neighbors);
+        mpi::ext::migrate(comm, std::tie(xs, vs, ids), [&] (std::size_t i) { return owner(xs[i]); });
+        reallocated = reallocated || particles.data() != data;
+    }
+
+    auto owned = std::all_of(particles.begin(), particles.end(), [&] (const particle& q) { return owner(q.x) == comm.rank(); })
+              && std::all_of(xs.begin(), xs.end(), [&] (double x) { return owner(x) == comm.rank(); });
+    auto id_sum = std::uint64_t(0), soa_id_sum = std::uint64_t(0);
+
+    for (const auto& q : particles) id_sum += q.id;
+    for (auto id : ids) soa_id_sum += id;
+
+    outp.only(0) << "\n<--------- particle migration --------->\n\n";
+    outp << "Rank " << comm.rank() << " has " << particles.size() << " particles (AoS), " << xs.size()
+         << " (SoA), received " << received << " in 10 steps" << (reallocated ? ", reallocated" : "") << "\n";
+    outp.only(0) << "all particles on their owner: " << (comm.all_reduce(int(owned), mpi::min<int>()) ? "yes" : "no")
+                 << ", ids conserved: " << (comm.all_reduce(id_sum) == comm.all_reduce(soa_id_sum)
+                                         && comm.all_reduce(id_sum) == std::uint64_t(1000 * p) * (1000 * p - 1) / 2 ? "yes" : "no") << "\n";
+
+    // A destination that is not a rank, even on rank 0 alone, is caught on
+    // every rank before anything is sent.
+    auto strays = std::vector<particle>{{0.0, 0.0, 0}};
+    auto rejected = false;
+
+    try
+    {
+        mpi::ext::migrate(comm, strays, [&] (const particle&) { return comm.rank() == 0 ? p : comm.rank(); });
+    }
+    catch (const std::out_of_range&)
+    {
+        rejected = true;
+    }
+    outp.only(0) << "bad destination rank rejected: " << (comm.all_reduce(int(rejected), mpi::min<int>()) ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_histogram()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto field = std::vector<double>(20000);
+    auto seed = std::uint32_t(99 + comm.rank());
+    auto uniform = [&seed] { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / double(1 << 24); };
+
+    // Roughly normal values, centered differently on each rank, plus a few
+    // outliers.
+    for (std::size_t i = 0; i < field.size(); ++i)
+    {
+        auto g = uniform() + uniform() + uniform() + uniform() - 2.0;
+        field[i] = i % 1000 == 0 ? 1e6 * uniform() - 5e5 : comm.rank() + g;
+    }
+
+    auto hist = mpi::ext::histogram(-2.0, comm.size() + 1.0, 64);
+    auto sketch = mpi::ext::quantile_sketch(0.01);
+    hist.add(field);
+    hist.all_reduce(comm);
+    sketch.add(field);
+    sketch.all_merge(comm);
+
+    // For comparison, find the exact quantiles by gathering everything.
+    auto counts = std::vector<int>();
+    auto all = comm.gatherv(0, field, counts);
+    std::sort(all.begin(), all.end());
+
+    outp.only(0) << "\n<--------- histogram and quantile sketch --------->\n\n";
+    outp.only(0) << "histogram of " << hist.total() << " values: " << hist.underflow() << " below, "
+                 << hist.overflow() << " above the range\n";
+
+    for (auto q : {0.01, 0.25, 0.5, 0.75, 0.99})
+    {
+        auto exact = comm.rank() == 0 ? all[std::size_t(q * (all.size() - 1))] : 0.0;
+        outp.only(0) << "    quantile " << std::setw(4) << q
+                     << ": exact " << std::setw(10) << exact
+                     << ", histogram " << std::setw(10) << hist.quantile(q)
+                     << ", sketch " << std::setw(10) << sketch.quantile(q) << "\n";
+    }
+
+    // Rank 0 contributes nothing, and only the last rank has a negative
+    // value; the merge must not lose either side.
+    auto sparse = mpi::ext::quantile_sketch(0.01);
+
+    for (int i = 1; i <= 100 && comm.rank() > 0; ++i)
+    {
+        sparse.add(double(i));
+    }
+    if (comm.rank() == comm.size() - 1)
+    {
+        sparse.add(-1.0);
+    }
+    sparse.all_merge(comm);
+
+    auto expected = std::uint64_t(100 * (comm.size() - 1) + 1);
+    auto sparse_ok = sparse.count() == expected && sparse.quantile(0.0) < 0.0;
+    outp.only(0) << "sketch merged with an empty rank: " << sparse.count() << " of " << expected
+                 << " values (" << (comm.all_reduce(int(sparse_ok), mpi::min<int>()) ? "ok" : "FAILED") << ")\n";
+}
+
+
+
+
+// ============================================================================
+void example_philox()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+
+    // Known-answer test from the Random123 distribution.
+    auto kat = mpi::ext::philox::generate({{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}}, {{0xa4093822, 0x299f31d0}});
+    auto kat_ok = kat == mpi::ext::philox::counter_type{{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}};
+
+    // Each rank draws numbers for its own, uneven share of a global array.
+    // The global sum matches a serial run on rank 0 for any rank count, and
+    // the bulk path matches the per-index one.
+    auto rng = mpi::ext::philox(20241017, 3);
+    auto total = std::uint64_t(100001);
+    auto share = total * (comm.rank() + 1) * (comm.rank() + 2) / (comm.size() * (comm.size() + 1)) - total * comm.rank() * (comm.rank() + 1) / (comm.size() * (comm.size() + 1));
+    auto first = comm.exscan(share);
+    auto values = std::vector<double>(share);
+    auto normals = std::vector<double>(share);
+    auto bulk_ok = true;
+
+    rng.uniform(first, values);
+    rng.normal(first, normals);
+
+    for (std::size_t i = 0; i < share; ++i)
+    {
+        bulk_ok = bulk_ok && values[i] == rng.uniform(first + i) && normals[i] == rng.normal(first + i);
+    }
+
+    // Sum exactly, so the comparison with the serial sum can be bitwise.
+    auto exact = mpi::reproducible_plus<double>();
+    auto sum = comm.all_sum(values, exact);
+    auto self = comm.split(comm.rank());
+    auto serial = 0.0;
+
+    if (comm.rank() == 0)
+    {
+        auto all = std::vector<double>(total);
+        rng.uniform(0, all);
+        serial = self.all_sum(all, exact);
+    }
+
+    auto mean = comm.all_sum(normals) / total;
+    auto variance = comm.all_sum(std::vector<double>{std::inner_product(normals.begin(), normals.end(), normals.begin(), 0.0)}) / total - mean * mean;
+
+    outp.only(0) << "\n<--------- counter-based random numbers --------->\n\n";
+    outp.only(0) << "known-answer test: " << (kat_ok ? "pass" : "FAIL") << "\n";
+    outp.only(0) << "bulk matches per-index: " << (comm.all_reduce(int(bulk_ok), mpi::min<int>()) ? "yes" : "no") << "\n";
+    outp.only(0) << std::setprecision(17) << "sum of " << total << " uniforms: " << sum << " (serial " << serial << ")\n";
+    outp.only(0) << "normals: mean " << mean << ", variance " << variance << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_load_balancer()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto num_blocks = std::size_t(16 * comm.size());
+    auto balancer = mpi::ext::load_balancer(comm, num_blocks);
+    auto data = std::vector<std::vector<int>>();
+
+    // Each block holds a variable amount of data tagged with its index.
+    for (auto block : balancer.local_blocks())
+    {
+        data.push_back(std::vector<int>(1 + block % 7, int(block)));
+    }
+
+    // Work piles up in a region of the block sequence, which drifts over
+    // time. The cost is reported rather than timed, to keep the example
+    // deterministic.
+    auto cost = [&] (std::size_t block, int step)
+    {
+        auto hot = (step * num_blocks / 8 + num_blocks / 4) % num_blocks;
+        return block >= hot && block < hot + num_blocks / 8 ? 4.0 : 1.0;
+    };
+
+    outp.only(0) << "\n<--------- dynamic load balancing --------->\n\n";
+
+    for (int step = 0; step < 4; ++step)
+    {
+        for (auto block : balancer.local_blocks())
+        {
+            balancer.record(block, cost(block, step));
+        }
+        auto before = balancer.imbalance();
+        auto migrated = std::size_t(0);
+
+        if (balancer.rebalance())
+        {
+            balancer.migrate(data);
+            migrated = balancer.migrated_blocks();
+        }
+        for (auto block : balancer.local_blocks())
+        {
+            balancer.record(block, cost(block, step));
+        }
+        auto after = balancer.imbalance();
+        balancer.clear();
+
+        outp.only(0) << "step " << step << ": imbalance " << before << " -> " << after
+                     << ", moved " << migrated << " of " << num_blocks << " blocks\n";
+    }
+
+    auto blocks = balancer.local_blocks();
+    auto ok = data.size() == blocks.size();
+
+    for (std::size_t i = 0; ok && i < blocks.size(); ++i)
+    {
+        ok = data[i] == std::vector<int>(1 + blocks[i] % 7, int(blocks[i]));
+    }
+    outp.only(0) << "block data followed its block: " << (comm.all_reduce(int(ok), mpi::min<int>()) ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_amr()
+{
+    using box = mpi::ext::amr::box;
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto p = comm.size();
+    auto mesh = mpi::ext::amr(comm, 2);
+    auto n = 0;
+
+    // A 32 x 32 base level in four patches, a refined region in its middle in
+    // four patches, and one patch refined again.
+    for (int a = 0; a < 2; ++a)
+        for (int b = 0; b < 2; ++b, ++n)
+            mesh.add_patch(0, box{{16 * a, 16 * b}, {16 * a + 16, 16 * b + 16}}, n % p);
+    for (int a = 0; a < 2; ++a)
+        for (int b = 0; b < 2; ++b, ++n)
+            mesh.add_patch(1, box{{16 + 16 * a, 16 + 16 * b}, {32 + 16 * a, 32 + 16 * b}}, n % p);
+    mesh.add_patch(2, box{{40, 40}, {56, 56}}, n % p);
+    mesh.finalize();
+
+    // A linear function is restricted exactly by averaging, and copied
+    // exactly between patches on a level; prolongation injects the value of
+    // the coarse cell. Coarse cells under finer patches start at zero, and
+    // ghost cells at a sentinel which should survive only outside the mesh.
+    auto f = [] (int level, int i, int j)
+    {
+        auto dx = 1.0 / (32 << level);
+        return (i + 0.5) * dx + 2.0 * (j + 0.5) * dx;
+    };
+    auto covering = [&] (int level, int i, int j)
+    {
+        for (auto q = 0; q < n + 1; ++q)
+        {
+            const auto& info = mesh.patch_info(q);
+            const auto& r = info.interior;
+
+            if (info.level == level && i >= r.lo[0] && i < r.hi[0] && j >= r.lo[1] && j < r.hi[1])
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto sentinel = -1e300;
+
+    for (auto q : mesh.local_patches())
+    {
+        const auto& info = mesh.patch_info(q);
+        auto g = info.interior.grow(2);
+
+        for (int i = g.lo[0]; i < g.hi[0]; ++i)
+            for (int j = g.lo[1]; j < g.hi[1]; ++j)
+                mesh.at(q, i, j) = sentinel;
+        for (int i = info.interior.lo[0]; i < info.interior.hi[0]; ++i)
+            for (int j = info.interior.lo[1]; j < info.interior.hi[1]; ++j)
+                mesh.at(q, i, j) = covering(info.level + 1, 2 * i, 2 * j) ? 0.0 : f(info.level, i, j);
+    }
+    mesh.restrict_to_coarse();
+    mesh.fill_ghosts();
+
+    auto restrict_error = 0.0, copy_error = 0.0, prolong_error = 0.0;
+
+    for (auto q : mesh.local_patches())
+    {
+        const auto& info = mesh.patch_info(q);
+        const auto& r = info.interior;
+        auto g = r.grow(2);
+
+        for (int i = g.lo[0]; i < g.hi[0]; ++i)
+        {
+            for (int j = g.lo[1]; j < g.hi[1]; ++j)
+            {
+                auto value = mesh.at(q, i, j);
+                auto interior = i >= r.lo[0] && i < r.hi[0] && j >= r.lo[1] && j < r.hi[1];
+
+                if (interior)
+                    restrict_error = std::max(restrict_error, std::fabs(value - f(info.level, i, j)));
+                else if (covering(info.level, i, j))
+                    copy_error = std::max(copy_error, std::fabs(value - f(info.level, i, j)));
+                else if (info.level > 0 && covering(info.level - 1, i >> 1, j >> 1))
+                    prolong_error = std::max(prolong_error, std::fabs(value - f(info.level - 1, i >> 1, j >> 1)));
+                else if (value != sentinel)
+                    copy_error = std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+
+    auto traffic = mesh.ghost_fill_traffic();
+
+    outp.only(0) << "\n<--------- AMR patch exchange --------->\n\n";
+    outp << "Rank " << comm.rank() << " owns " << mesh.local_patches().size() << " patches, sends "
+         << traffic.first << " remote ghost transfers in " << traffic.second << " messages\n";
+    outp.only(0) << "max error after restriction = " << comm.all_reduce(restrict_error, mpi::max<double>())
+                 << ", same-level ghosts = " << comm.all_reduce(copy_error, mpi::max<double>())
+                 << ", prolonged ghosts = " << comm.all_reduce(prolong_error, mpi::max<double>()) << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_octree()
+{
+    using body = mpi::ext::octree::body;
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto rng = mpi::ext::philox(99);
+    auto n = std::size_t(1000);
+    auto positions = std::vector<mpi::ext::sfc_partition::point>(n);
+    auto offsets = std::vector<double>(3 * n);
+    rng.normal(3 * n * comm.rank(), offsets);
+
+    // Two Gaussian clusters in the unit box, distributed along the Hilbert
+    // curve.
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto center = i % 2 ? 0.3 : 0.65;
+
+        for (int a = 0; a < 3; ++a)
+        {
+            positions[i][a] = std::min(1.0, std::max(0.0, center + 0.08 * offsets[3 * i + a]));
+        }
+    }
+    auto partition = mpi::ext::sfc_partition(comm, {0, 0, 0}, {1, 1, 1});
+    auto keys = partition.keys(positions);
+    partition.rebalance(keys, std::vector<double>(keys.size(), 1.0));
+    positions = partition.migrate(partition.plan(keys), positions);
+
+    auto bodies = std::vector<body>();
+    auto mass = 1.0 / (n * comm.size());
+
+    for (const auto& x : positions)
+    {
+        bodies.push_back({x, mass});
+    }
+    auto theta = 0.5, eps = 1e-2, radius = 0.03;
+    auto tree = mpi::ext::distributed_octree(comm, bodies);
+    tree.exchange_essential(theta);
+    auto acc = tree.accelerations(theta, eps);
+    auto halo = tree.halo(radius);
+
+    // Compare with direct summation, and with brute-force neighbour counts,
+    // over all the bodies.
+    auto counts = std::vector<int>();
+    auto all = comm.all_gatherv(bodies, counts);
+    auto near = mpi::ext::octree(bodies);
+    auto near_halo = mpi::ext::octree(halo);
+    auto direct_sum = mpi::ext::octree(all, all.size());
+    auto err2 = 0.0, norm2 = 0.0;
+    auto counts_match = true;
+
+    for (std::size_t i = 0; i < bodies.size(); ++i)
+    {
+        auto direct = direct_sum.acceleration(bodies[i].x, 0.0, eps);
+        auto brute = std::size_t(0);
+
+        for (const auto& b : all)
+        {
+            brute += mpi::ext::octree::distance(b.x, bodies[i].x) <= radius;
+        }
+        for (int a = 0; a < 3; ++a)
+        {
+            err2 += (acc[i][a] - direct[a]) * (acc[i][a] - direct[a]);
+            norm2 += direct[a] * direct[a];
+        }
+        counts_match = counts_match && brute == near.within(bodies[i].x, radius).size() + near_halo.within(bodies[i].x, radius).size();
+    }
+
+    outp.only(0) << "\n<--------- distributed octree --------->\n\n";
+    outp << "Rank " << comm.rank() << " has " << bodies.size() << " bodies and " << halo.size() << " halo bodies\n";
+    outp.only(0) << "Barnes-Hut relative rms error (theta = " << theta << ") = "
+                 << std::sqrt(comm.all_reduce(err2) / comm.all_reduce(norm2))
+                 << ", neighbour counts match: " << (comm.all_reduce(int(counts_match), mpi::min<int>()) ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_graph()
+{
+    using vertex = mpi::ext::graph::vertex;
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto p = comm.size();
+    auto num_local = std::size_t(200 + 50 * (comm.rank() % 2));
+    auto total = comm.all_reduce(vertex(num_local));
+
+    // Chains of 100 vertices, which cross rank boundaries. The edges are
+    // listed round-robin by all ranks, not by their owners.
+    auto edges = std::vector<mpi::ext::graph::edge>();
+
+    for (vertex v = comm.rank(); v + 1 < total; v += p)
+    {
+        if (v % 100 != 99)
+        {
+            edges.push_back({{v, v + 1}});
+        }
+    }
+    auto g = mpi::ext::graph(comm, num_local, edges);
+    auto level = g.bfs(0);
+    auto label = g.connected_components();
+    auto correct = true;
+
+    for (std::size_t i = 0; i < g.local_vertices(); ++i)
+    {
+        auto v = g.first_vertex() + i;
+        correct = correct && label[i] == v / 100 * 100 && level[i] == (v < 100 ? std::int64_t(v) : -1);
+    }
+    auto roots = std::size_t(0);
+
+    for (std::size_t i = 0; i < label.size(); ++i)
+    {
+        roots += label[i] == g.first_vertex() + i;
+    }
+    auto reached = std::count_if(level.begin(), level.end(), [] (std::int64_t l) { return l >= 0; });
+
+    outp.only(0) << "\n<--------- distributed graph --------->\n\n";
+    outp << "Rank " << comm.rank() << " owns vertices " << g.first_vertex() << " to "
+         << g.first_vertex() + g.local_vertices() << ", " << reached << " reached from vertex 0\n";
+    outp.only(0) << comm.all_reduce(std::uint64_t(roots)) << " components among " << total
+                 << " vertices, levels and labels correct: " << (comm.all_reduce(int(correct), mpi::min<int>()) ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_tag_space()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto right = (comm.rank() + 1) % comm.size();
+    auto left = (comm.rank() + comm.size() - 1) % comm.size();
+
+    // Two modules share the communicator, and both use their local tag 0 to
+    // send to the same rank. The receives are done in the opposite order to
+    // the sends, and still match the right messages.
+    auto halo = mpi::TagSpace(comm, 4);
+    auto events = mpi::TagSpace(comm, 4);
+    auto sent_halo = halo.isend(1.5 * comm.rank(), right);
+    auto sent_event = events.isend("event from rank " + std::to_string(comm.rank()), right);
+    auto event = events.recv(left, 0);
+    auto value = halo.recv<double>(left);
+    sent_halo.wait();
+    sent_event.wait();
+
+    // A released block is reused by the next reservation that fits.
+    auto scratch_tag = mpi::TagSpace(comm, 100).tag(0);
+    auto reused = mpi::TagSpace(comm, 50).tag(0) == scratch_tag;
+
+    outp.only(0) << "\n<--------- tag spaces --------->\n\n";
+    outp.only(0) << "halo tags start at " << halo.tag(0) << ", event tags at " << events.tag(0)
+                 << ", released block reused: " << (reused ? "yes" : "no") << ", communicator handles: " << comm.use_count() << "\n";
+    outp << "Rank " << comm.rank() << " received halo value " << value << " and '" << event << "'\n";
+}
+
+
+
+
+// ============================================================================
+void example_mailbox()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto box = mpi::ext::mailbox(comm, 4, 64);
+
+    // Every rank sends rank 0 five small messages, which go through the
+    // ring, and one too large for a slot.
+    auto sends = std::vector<mpi::Request>();
+
+    for (int i = 0; i < 5; ++i)
+    {
+        sends.push_back(box.isend(std::to_string(comm.rank()) + " " + std::to_string(i), 0));
+    }
+    sends.push_back(box.isend(std::string(1000, 'x'), 0));
+
+    if (comm.rank() == 0)
+    {
+        auto next = std::vector<int>(comm.size(), 0);
+        auto in_order = true;
+        auto large = 0;
+
+        for (int n = 0; n < 6 * comm.size(); ++n)
+        {
+            auto source = 0;
+            auto message = box.receive(source);
+
+            if (message.size() > box.max_slot_size())
+            {
+                ++large;
+            }
+            else
+            {
+                in_order = in_order && message == std::to_string(source) + " " + std::to_string(next[source]++);
+            }
+        }
+        outp << "\n<--------- mailbox --------->\n\n";
+        outp << "received " << 5 * comm.size() << " small messages, in order from each rank: " << (in_order ? "yes" : "no")
+             << ", and " << large << " large\n";
+    }
+    for (auto& request : sends)
+    {
+        request.wait();
+    }
+    comm.barrier();
+
+    // Null requests and persistent ones not yet started have no status.
+    auto value = 0;
+    auto idle = comm.recv_init(&value, 1, comm.rank());
+    outp.only(0) << "no status for null and inactive requests: " << (mpi::Request().status().is_null() && idle.status().is_null() ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_channel()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto chan = mpi::ext::channel(comm, 4);
+    auto max_in_flight = 0;
+    auto in_order = true;
+
+    // Every rank posts 50 results to rank 0, which never has more than four
+    // unconsumed from any one of them.
+    for (int i = 0; i < 50; ++i)
+    {
+        chan.post(std::to_string(comm.rank()) + " " + std::to_string(i), 0);
+        max_in_flight = std::max(max_in_flight, chan.in_flight(0));
+    }
+
+    if (comm.rank() == 0)
+    {
+        auto next = std::vector<int>(comm.size(), 0);
+
+        for (int n = 0; n < 50 * comm.size(); ++n)
+        {
+            auto source = 0;
+            auto message = chan.receive(source);
+            in_order = in_order && message == std::to_string(source) + " " + std::to_string(next[source]++);
+        }
+    }
+    chan.close();
+    max_in_flight = comm.all_reduce(max_in_flight, mpi::max<int>());
+
+    outp.only(0) << "\n<--------- flow-controlled channel --------->\n\n";
+    outp.only(0) << "received " << 50 * comm.size() << " messages, in order from each rank: " << (in_order ? "yes" : "no")
+                 << ", most in flight from one rank: " << max_in_flight << " (4 credits)\n";
+}
+
+
+
+
+// ============================================================================
+void example_wait_policy()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto right = (comm.rank() + 1) % comm.size();
+    auto left = (comm.rank() + comm.size() - 1) % comm.size();
+    auto sendbuf = 0, recvbuf = -1;
+    auto requests = mpi::RequestSet();
+    auto correct = true;
+
+    requests.add(comm.recv_init(&recvbuf, 1, left));
+    requests.add(comm.send_init(&sendbuf, 1, right));
+
+    // Pass values around the ring, waiting with each policy in turn, and
+    // then with the process-wide default set to backoff.
+    for (auto policy : {mpi::WaitPolicy::native, mpi::WaitPolicy::spin, mpi::WaitPolicy::backoff, mpi::WaitPolicy::yield, mpi::WaitPolicy::sleep})
+    {
+        sendbuf = 10 * comm.rank() + int(policy);
+        requests.start_all();
+        requests.wait_all(policy);
+        correct = correct && recvbuf == 10 * left + int(policy);
+    }
+    mpi::wait_policy() = mpi::WaitPolicy::backoff;
+    sendbuf = -comm.rank();
+    requests.start_all();
+    requests.wait_all();
+    correct = correct && recvbuf == -left;
+    mpi::wait_policy() = mpi::WaitPolicy::native;
+
+    outp.only(0) << "\n<--------- wait policies --------->\n\n";
+    outp.only(0) << "ring exchange with every wait policy correct: " << (comm.all_reduce(int(correct), mpi::min<int>()) ? "yes" : "no") << "\n";
+}
+
+
+
+
+// ============================================================================
+void example_bcast_containers()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto name = std::string();
+    auto small = std::vector<double>();
+    auto large = std::vector<double>();
+
+    outp.only(0) << "\n<--------- bcast vector and string --------->\n\n";
+
+    if (comm.rank() == 0)
+    {
+        name = "config.yaml";
+        small = {1.0, 2.0, 3.0};
+        large = std::vector<double>(1 << 20, 0.5);
+    }
+    comm.bcast(0, name);
+    comm.bcast(0, small);
+    comm.bcast(0, large);
+
+    outp << "Rank " << comm.rank() << " has name = " << name
+         << ", small.size() = " << small.size()
+         << ", sum(large) = " << std::accumulate(large.begin(), large.end(), 0.0) << "\n";
+}
+
+
+
+
+// ============================================================================
+void benchmark_communicator_handles()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto trials = 1000;
+
+    auto time = [&] (auto&& f)
+    {
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        for (int n = 0; n < trials; ++n)
+        {
+            f();
+        }
+        return comm.all_reduce((MPI_Wtime() - start) / trials, mpi::max<double>());
+    };
+    auto t_copy = time([&] { auto c = comm; c.barrier(); });
+    auto t_world = time([&] { auto c = mpi::comm_world(); c.barrier(); });
+    auto t_dup = time([&] { auto c = comm.dup(); c.barrier(); });
+
+    outp.only(0) << "\n<--------- benchmark: communicator handles --------->\n\n";
+    outp.only(0) << "acquire, barrier, release on " << comm.size() << " ranks\n";
+    outp.only(0) << "    copy ........................ " << t_copy * 1e6 << " us\n";
+    outp.only(0) << "    comm_world() ................ " << t_world * 1e6 << " us\n";
+    outp.only(0) << "    dup() (the old copy) ........ " << t_dup * 1e6 << " us\n";
+}
+
+
+
+
+// ============================================================================
+void benchmark_user_reduction()
+{
+    struct vec3 { double x, y, z; };
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto points = std::vector<vec3>(1 << 22, vec3{1.0 * comm.rank(), 2.0, 3.0});
+    auto bytes = points.size() * sizeof(vec3);
+    auto trials = 5;
+
+    auto scalars = std::vector<double>(points.size() * 3, 1.0 * comm.rank());
+
+    auto time = [&] (const auto& data, auto op)
+    {
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        for (int n = 0; n < trials; ++n)
+        {
+            comm.all_reduce(data, op);
+        }
+        return (MPI_Wtime() - start) / trials;
+    };
+
+    auto t_native = time(scalars, mpi::min<double>());
+    auto t_lambda = time(points, [] (vec3 a, vec3 b) { return vec3{std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)}; });
+    auto t_vector = time(points, mpi::componentwise<mpi::min<double>>());
+
+    outp.only(0) << "\n<--------- benchmark: user-defined reductions --------->\n\n";
+    outp.only(0) << "all_reduce of " << bytes / (1 << 20) << " MB of 3-vectors on " << comm.size() << " ranks\n";
+    outp.only(0) << "    native MPI_MIN on doubles .... " << t_native * 1e3 << " ms\n";
+    outp.only(0) << "    per-struct lambda ............ " << t_lambda * 1e3 << " ms\n";
+    outp.only(0) << "    componentwise<min> ........... " << t_vector * 1e3 << " ms\n";
+}
+
+
+
+
+// ============================================================================
+void benchmark_reproducible_sum()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto field = std::vector<double>(1 << 20);
+    auto local = std::vector<double>(1 << 24);
+    auto trials = 5;
+
+    for (std::size_t i = 0; i < field.size(); ++i)
+    {
+        field[i] = std::sin(double(i + comm.rank()));
+    }
+    for (std::size_t i = 0; i < local.size(); ++i)
+    {
+        local[i] = std::cos(double(i + comm.rank()));
+    }
+
+    auto time = [&] (auto&& f)
+    {
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        for (int n = 0; n < trials; ++n)
+        {
+            f();
+        }
+        return (MPI_Wtime() - start) / trials;
+    };
+
+    auto t_field_plain = time([&] { comm.all_reduce(field); });
+    auto t_field_exact = time([&] { comm.all_reduce(field, mpi::reproducible_plus<double>()); });
+    auto t_sum_plain = time([&] { comm.all_sum(local); });
+    auto t_sum_exact = time([&] { comm.all_sum(local, mpi::reproducible_plus<double>()); });
+
+    outp.only(0) << "\n<--------- benchmark: reproducible sum --------->\n\n";
+    outp.only(0) << "element-wise all_reduce of " << field.size() << " doubles on " << comm.size() << " ranks\n";
+    outp.only(0) << "    std::plus ................... " << t_field_plain * 1e3 << " ms\n";
+    outp.only(0) << "    reproducible_plus ........... " << t_field_exact * 1e3 << " ms\n";
+    outp.only(0) << "all_sum of " << local.size() << " doubles per rank\n";
+    outp.only(0) << "    std::plus ................... " << t_sum_plain * 1e3 << " ms\n";
+    outp.only(0) << "    reproducible_plus ........... " << t_sum_exact * 1e3 << " ms\n";
+}
+
+
+
+
+// ============================================================================
+void benchmark_dist_csr()
+{
+    auto world = mpi::comm_world();
+    auto outp = mpi::ext::log(world, std::cout);
+    auto n = std::size_t(64);
+    auto trials = 20;
+
+    outp.only(0) << "\n<--------- benchmark: distributed SpMV, 3D Laplacian " << n << "^3 --------->\n\n";
+
+    for (int ranks = 1; ranks <= world.size(); ranks *= 2)
+    {
+        auto comm = world.split(world.rank() < ranks ? 0 : -1);
+        auto line = std::ostringstream();
+
+        if (! comm.is_null())
+        {
+            auto A = laplacian_3d(comm, n);
+            auto x = mpi::ext::dist_vector<double>(comm, A.rows(), 1.0);
+            auto y = mpi::ext::dist_vector<double>(comm, A.rows());
+
+            A.multiply(x, y);
+            comm.barrier();
+            auto start = MPI_Wtime();
+
+            for (int t = 0; t < trials; ++t)
+            {
+                A.multiply(x, y);
+            }
+            auto time = comm.all_reduce((MPI_Wtime() - start) / trials, mpi::max<double>());
+            auto ghosts = comm.all_reduce(A.ghost_count());
+            line << std::setw(6) << ranks << " ranks: " << time * 1e3 << " ms per multiply, "
+                 << 2 * 7 * double(n * n * n) / time * 1e-9 << " GFlop/s, " << ghosts << " ghosts exchanged\n";
+        }
+        outp.only(0) << line.str();
+    }
+}
+
+
+
+
+// ============================================================================
+void benchmark_fft3d()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto n = std::size_t(64);
+    auto trials = 5;
+
+    outp.only(0) << "\n<--------- benchmark: distributed 3D FFT " << n << "^3 on " << comm.size() << " ranks --------->\n\n";
+
+    for (auto batches : {1, 4})
+    {
+        auto fft = mpi::ext::fft3d(comm, n, n, n, batches);
+        auto slab = std::vector<std::complex<double>>(fft.local_size(), 1.0);
+        auto spectrum = slab;
+
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        for (int t = 0; t < trials; ++t)
+        {
+            fft.forward(slab, spectrum);
+            fft.backward(spectrum, slab);
+        }
+        auto time = comm.all_reduce((MPI_Wtime() - start) / trials, mpi::max<double>());
+        outp.only(0) << "    forward + backward, " << batches << " batch(es) ..... " << time * 1e3 << " ms\n";
+    }
+}
+
+
+
+
+// ============================================================================
+void benchmark_parallel_sort()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto max_bytes_per_rank = std::uint64_t(1) << 27;
+
+    outp.only(0) << "\n<--------- benchmark: parallel sort of 64-bit keys on " << comm.size() << " ranks --------->\n\n";
+
+    for (auto total = std::uint64_t(1000000); total <= std::uint64_t(10000000000); total *= 10)
+    {
+        auto local = total / comm.size() + (std::uint64_t(comm.rank()) < total % comm.size());
+
+        if (total / comm.size() * sizeof(std::uint64_t) > max_bytes_per_rank)
+        {
+            outp.only(0) << std::setw(14) << total << " keys: skipped, needs more memory per rank\n";
+            continue;
+        }
+        auto keys = std::vector<std::uint64_t>(local);
+        auto seed = std::uint64_t(88172645463325252ull + comm.rank());
+
+        for (auto& k : keys)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            k = seed;
+        }
+
+        comm.barrier();
+        auto start = MPI_Wtime();
+        auto sorted = mpi::ext::parallel_sort(comm, keys);
+        auto t_sort = comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
+
+        comm.barrier();
+        start = MPI_Wtime();
+        sorted = mpi::ext::parallel_stable_sort(comm, keys);
+        auto t_stable = comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
+
+        outp.only(0) << std::setw(14) << total << " keys: "
+                     << double(total) / t_sort * 1e-6 << " Mkeys/s (sort), "
+                     << double(total) / t_stable * 1e-6 << " Mkeys/s (stable)\n";
+    }
+}
+
+
+
+
+// ============================================================================
+void benchmark_histogram()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto field = std::vector<double>(1 << 24);
+    auto bins = std::size_t(256);
+    auto trials = 5;
+
+    for (std::size_t i = 0; i < field.size(); ++i)
+    {
+        field[i] = 0.5 + 0.6 * std::sin(double(i) * 1e-3 + comm.rank());
+    }
+
+    auto time = [&] (auto&& f)
+    {
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        for (int n = 0; n < trials; ++n)
+        {
+            f();
+        }
+        return comm.all_reduce((MPI_Wtime() - start) / trials, mpi::max<double>());
+    };
+
+    auto t_naive = time([&]
+    {
+        auto counts = std::vector<std::uint64_t>(bins + 2, 0);
+
+        for (auto x : field)
+        {
+            if      (x < 0.0)  counts[0]++;
+            else if (x >= 1.0) counts[bins + 1]++;
+            else               counts[1 + std::size_t(x * bins)]++;
+        }
+        counts = comm.all_reduce(counts);
+    });
+    auto t_histogram = time([&]
+    {
+        auto hist = mpi::ext::histogram(0.0, 1.0, bins);
+        hist.add(field);
+        hist.all_reduce(comm);
+    });
+    auto t_sketch = time([&]
+    {
+        auto sketch = mpi::ext::quantile_sketch(0.01);
+        sketch.add(field);
+        sketch.all_merge(comm);
+    });
+
+    outp.only(0) << "\n<--------- benchmark: global histogram --------->\n\n";
+    outp.only(0) << field.size() << " values per rank into " << bins << " bins on " << comm.size() << " ranks\n";
+    outp.only(0) << "    branchy loop + all_reduce .... " << double(field.size()) / t_naive * 1e-6 << " Mvalues/s\n";
+    outp.only(0) << "    histogram .................... " << double(field.size()) / t_histogram * 1e-6 << " Mvalues/s\n";
+    outp.only(0) << "    quantile_sketch .............. " << double(field.size()) / t_sketch * 1e-6 << " Mvalues/s\n";
+}
+
+
+
+
+// ============================================================================
+void benchmark_philox()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto values = std::vector<double>(1 << 24);
+    auto rng = mpi::ext::philox(1234);
+    auto first = std::uint64_t(comm.rank()) * values.size();
+    auto trials = 5;
+
+    auto time = [&] (auto&& f)
+    {
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        for (int n = 0; n < trials; ++n)
+        {
+            f();
+        }
+        return comm.all_reduce((MPI_Wtime() - start) / trials, mpi::max<double>());
+    };
+
+    auto t_mt = time([&]
+    {
+        auto engine = std::mt19937_64(first);
+        auto dist = std::uniform_real_distribution<double>();
+
+        for (auto& x : values)
+        {
+            x = dist(engine);
+        }
+    });
+    auto t_scalar = time([&]
+    {
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            values[i] = rng.uniform(first + i);
+        }
+    });
+    auto t_bulk = time([&] { rng.uniform(first, values); });
+    auto t_normal = time([&] { rng.normal(first, values); });
+    auto rate = [&] (double t) { return double(values.size()) / t * 1e-6; };
+
+    outp.only(0) << "\n<--------- benchmark: random number generation --------->\n\n";
+    outp.only(0) << values.size() << " doubles per rank on " << comm.size() << " ranks\n";
+    outp.only(0) << "    std::mt19937_64 ............. " << rate(t_mt) << " M/s\n";
+    outp.only(0) << "    philox, per index ........... " << rate(t_scalar) << " M/s\n";
+    outp.only(0) << "    philox, bulk uniform ........ " << rate(t_bulk) << " M/s\n";
+    outp.only(0) << "    philox, bulk normal ......... " << rate(t_normal) << " M/s\n";
+}
 
-        auto recvcounts = all_gather(int(sendbuf.size() * sizeof(T)));
-        auto recvdispls = std::vector<int>{0};
-        std::partial_sum(recvcounts.begin(), recvcounts.end(), std::back_inserter(recvdispls));
 
-        auto recvbuf = std::vector<T>(recvdispls.back() / sizeof(T));
 
-        MPI_Allgatherv(
-            &sendbuf[0], sendbuf.size() * sizeof(T), MPI_CHAR,
-            &recvbuf[0], &recvcounts[0], &recvdispls[0], MPI_CHAR, comm);
 
-        auto res = std::vector<std::vector<T>>(size());
-        auto recv = recvbuf.begin();
+// ============================================================================
+void benchmark_octree()
+{
+    using body = mpi::ext::octree::body;
+
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto rng = mpi::ext::philox(7);
+    auto theta = 0.6, eps = 1e-3;
+    auto t_previous = 0.0;
+
+    outp.only(0) << "\n<--------- benchmark: distributed octree --------->\n\n";
+    outp.only(0) << "Plummer-like cluster, theta = " << theta << ", on " << comm.size() << " ranks\n";
+
+    for (auto total : {std::uint64_t(100000), std::uint64_t(1000000), std::uint64_t(10000000), std::uint64_t(100000000)})
+    {
+        auto n = std::size_t(total / comm.size());
+
+        // Bodies, positions, offsets, and the tree take roughly 200 bytes
+        // each; skip sizes that would not fit.
+        if (n * 200 > (std::size_t(1) << 30))
+        {
+            outp.only(0) << "    " << std::setw(10) << total << " bodies ...... skipped (memory)\n";
+            continue;
+        }
+        if (t_previous * 10 > 60)
+        {
+            outp.only(0) << "    " << std::setw(10) << total << " bodies ...... skipped (would take over a minute)\n";
+            continue;
+        }
+        auto offsets = std::vector<double>(3 * n);
+        auto radii = std::vector<double>(n);
+        auto positions = std::vector<mpi::ext::sfc_partition::point>(n);
+        rng.normal(3 * n * comm.rank(), offsets);
+        rng.uniform(n * comm.rank(), radii);
 
-        for (int i = 0; i < res.size(); ++i)
+        for (std::size_t i = 0; i < n; ++i)
         {
-            res[i].resize(recvcounts[i] / sizeof(T));
+            auto norm = std::sqrt(offsets[3 * i] * offsets[3 * i] + offsets[3 * i + 1] * offsets[3 * i + 1] + offsets[3 * i + 2] * offsets[3 * i + 2]);
+            auto r = std::min(0.49, 0.05 / std::sqrt(std::pow(radii[i], -2.0 / 3) - 1 + 1e-12));
 
-            for (int j = 0; j < res[i].size(); ++j)
+            for (int a = 0; a < 3; ++a)
             {
-                res[i][j] = *recv++;
+                positions[i][a] = 0.5 + r * offsets[3 * i + a] / (norm + 1e-300);
             }
         }
-        return res;
-    }
+        auto partition = mpi::ext::sfc_partition(comm, {0, 0, 0}, {1, 1, 1});
+        auto keys = partition.keys(positions);
+        partition.rebalance(keys, std::vector<double>(keys.size(), 1.0));
+        positions = partition.migrate(partition.plan(keys), positions);
 
+        auto bodies = std::vector<body>();
+        offsets = std::vector<double>();
+        keys = std::vector<std::uint64_t>();
 
-private:
-    // ========================================================================
-    friend Communicator comm_world();
-    MPI_Comm comm = MPI_COMM_NULL;
-};
+        for (const auto& x : positions)
+        {
+            bodies.push_back({x, 1.0 / total});
+        }
+        positions = std::vector<mpi::ext::sfc_partition::point>();
 
+        comm.barrier();
+        auto start = MPI_Wtime();
+        auto tree = mpi::ext::distributed_octree(comm, bodies);
+        auto t_build = comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
 
+        start = MPI_Wtime();
+        tree.exchange_essential(theta);
+        auto t_let = comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
 
+        start = MPI_Wtime();
+        auto acc = tree.accelerations(theta, eps);
+        auto t_walk = comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
+        t_previous = t_build + t_let + t_walk;
 
-// ============================================================================
-mpi::Communicator mpi::comm_world()
-{
-    Communicator res;
-    MPI_Comm_dup(MPI_COMM_WORLD, &res.comm);
-    return res;
+        outp.only(0) << "    " << std::setw(10) << total << " bodies ...... build " << t_build << " s, essential tree "
+                     << t_let << " s, walk " << t_walk << " s (" << double(total) / t_walk * 1e-6 << " M bodies/s)\n";
+    }
 }
 
 
 
 
 // ============================================================================
-#include <sstream>
-
-class mpi::ext::log
+void benchmark_graph()
 {
-public:
-
-
-    // ========================================================================
-    using char_type    = std::stringstream::char_type;
-    using traits_type  = std::stringstream::traits_type;
-    using ostream_type = std::basic_ostream<char_type, traits_type>;
+    using vertex = mpi::ext::graph::vertex;
+    using edge = mpi::ext::graph::edge;
 
-
-    // ========================================================================
-    log(const Communicator& comm, std::ostream& stream)
-    : comm(comm)
-    , stream(stream)
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto rng = mpi::ext::philox(11);
+    auto num_local = std::size_t(1 << 20);
+    auto total = vertex(num_local) * comm.size();
+    auto first = vertex(num_local) * comm.rank();
+
+    // A friends-of-friends-like graph: links between consecutive vertices,
+    // broken at random, plus occasional links to a random nearby vertex.
+    auto edges = std::vector<edge>();
+    auto coins = std::vector<double>(2 * num_local);
+    rng.uniform(2 * first, coins);
+
+    for (std::size_t i = 0; i < num_local; ++i)
     {
-    }
+        auto v = first + i;
 
-    log(const log& other)
-    : comm(other.comm)
-    , stream(other.stream)
-    {
+        if (v + 1 < total && coins[2 * i] < 0.9)
+        {
+            edges.push_back({{v, v + 1}});
+        }
+        if (coins[2 * i + 1] < 0.05)
+        {
+            edges.push_back({{v, std::min(total - 1, v + vertex(coins[2 * i + 1] * 2e6))}});
+        }
     }
 
-    ~log()
+    auto time = [&] (auto&& f)
     {
-        flush();
-    }
-
-    log only(int rank) const
+        comm.barrier();
+        auto start = MPI_Wtime();
+        f();
+        return comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
+    };
+    auto g = std::unique_ptr<mpi::ext::graph>();
+    auto label = std::vector<vertex>();
+    auto t_build = time([&] { g.reset(new mpi::ext::graph(comm, num_local, edges)); });
+    auto t_cc = time([&] { label = g->connected_components(); });
+
+    // Search from the root of the most common component on rank 0.
+    auto sorted = label;
+    auto source = vertex(0);
+    auto most = std::ptrdiff_t(0);
+    std::sort(sorted.begin(), sorted.end());
+
+    for (auto it = sorted.begin(); it != sorted.end(); )
     {
-        auto res = *this;
-        res.active_rank = rank;
-        return res;
-    }
+        auto end = std::upper_bound(it, sorted.end(), *it);
 
-    log& operator<<(ostream_type& os(ostream_type&))
-    {
-        buffer << os;
-        return *this;
+        if (end - it > most)
+        {
+            most = end - it;
+            source = *it;
+        }
+        it = end;
     }
-
-    template <typename T>
-    log& operator<<(const T& value)
+    comm.bcast(0, source);
+    auto level = std::vector<std::int64_t>();
+    auto t_bfs = time([&] { level = g->bfs(source); });
+    auto reached = comm.all_reduce(std::uint64_t(std::count_if(level.begin(), level.end(), [] (std::int64_t l) { return l >= 0; })));
+
+    // The gather-to-root approach: union-find over all the edges on rank 0,
+    // then scatter the labels back.
+    auto root_label = std::vector<vertex>();
+    auto t_root = time([&]
     {
-        buffer << value;
-        return *this;
-    }
+        auto counts = std::vector<int>();
+        auto all = comm.gatherv(0, edges, counts);
+        auto labels = std::vector<std::vector<vertex>>();
 
-    log& flush()
-    {
-        if (active_rank == -1)
+        if (comm.rank() == 0)
         {
-            for (int n = 0; n < comm.size(); ++n)
+            auto parent = std::vector<vertex>(total);
+            std::iota(parent.begin(), parent.end(), vertex(0));
+            auto find = [&] (vertex v) { while (parent[v] != v) v = parent[v] = parent[parent[v]]; return v; };
+
+            for (const auto& e : all)
             {
-                if (n == comm.rank())
-                {
-                    stream << buffer.str();
-                }
-                comm.barrier();
+                auto a = find(e[0]), b = find(e[1]);
+                parent[std::max(a, b)] = std::min(a, b);
+            }
+            for (vertex v = 0; v < total; ++v)
+            {
+                parent[v] = find(v);
+            }
+            for (int q = 0; q < comm.size(); ++q)
+            {
+                labels.emplace_back(parent.begin() + q * num_local, parent.begin() + (q + 1) * num_local);
             }
         }
-        else if (comm.rank() == active_rank)
-        {
-            stream << buffer.str();
-        }
-        stream.clear();
-        return *this;
-    }
-
-private:
-    // ========================================================================
-    const Communicator& comm;
-    std::ostream& stream;
-    std::stringstream buffer;
-    int active_rank = -1;
-};
+        root_label = comm.scatter(0, labels);
+    });
+
+    outp.only(0) << "\n<--------- benchmark: distributed graph --------->\n\n";
+    outp.only(0) << total << " vertices on " << comm.size() << " ranks, labels agree: "
+                 << (comm.all_reduce(int(label == root_label), mpi::min<int>()) ? "yes" : "no") << "\n";
+    outp.only(0) << "    build from edge list ........ " << t_build << " s\n";
+    outp.only(0) << "    bfs ......................... " << t_bfs << " s (" << reached << " vertices reached)\n";
+    outp.only(0) << "    connected components ........ " << t_cc << " s\n";
+    outp.only(0) << "    gather to root + union-find . " << t_root << " s\n";
+}
 
 
 
 
 // ============================================================================
-#include <iostream>
+void benchmark_mailbox()
+{
+    auto comm = mpi::comm_world();
+    auto outp = mpi::ext::log(comm, std::cout);
+    auto messages = 2000;
+    auto payload = std::string(256, 'm');
+
+    // Every other rank sends messages to rank 0, which receives them from
+    // any source, first with probe and receive and then from a mailbox.
+    auto run = [&] (auto&& receive, auto&& send)
+    {
+        comm.barrier();
+        auto start = MPI_Wtime();
+
+        if (comm.rank() == 0)
+        {
+            for (int n = 0; n < messages * (comm.size() - 1); ++n)
+            {
+                receive();
+            }
+        }
+        else
+        {
+            for (int n = 0; n < messages; ++n)
+            {
+                send();
+            }
+        }
+        return comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
+    };
+    auto tags = mpi::TagSpace(comm, 1);
+    auto t_probe = run([&] { tags.recv(mpi::any_source, 0); }, [&] { tags.send(payload, 0); });
+    auto box = mpi::ext::mailbox(comm, 64, 1024);
+    auto t_mailbox = run([&] { auto source = 0; box.receive(source); }, [&] { box.send(payload, 0); });
+    auto total = double(messages * (comm.size() - 1));
+
+    outp.only(0) << "\n<--------- benchmark: mailbox --------->\n\n";
+    outp.only(0) << total << " messages of " << payload.size() << " bytes to rank 0 from " << comm.size() - 1 << " ranks\n";
+    outp.only(0) << "    probe + recv ................ " << total / t_probe * 1e-3 << " k messages/s\n";
+    outp.only(0) << "    mailbox (64 slots) .......... " << total / t_mailbox * 1e-3 << " k messages/s\n";
+}
 
 
 
 
 // ============================================================================
-void example_ring()
+void benchmark_channel()
 {
     auto comm = mpi::comm_world();
     auto outp = mpi::ext::log(comm, std::cout);
+    auto messages = 5000;
+    auto payload = std::string(1024, 'r');
+    auto senders = comm.size() - 1;
+    auto total = double(messages * senders);
 
-    outp.only(0) << "\n<--------- isend, recv --------->\n\n";
-
-    for (int i = 0; i < comm.size(); ++i)
+    auto time = [&] (auto&& f)
     {
-        if (i == comm.rank())
+        comm.barrier();
+        auto start = MPI_Wtime();
+        f();
+        return comm.all_reduce(MPI_Wtime() - start, mpi::max<double>());
+    };
+
+    // Unthrottled: every other rank isends all its results to rank 0 at
+    // once, so they may all sit in rank 0's unexpected-message queue.
+    auto tags = mpi::TagSpace(comm, 1);
+    auto t_plain = time([&]
+    {
+        if (comm.rank() == 0)
         {
-            auto content = "Hello from proc " + std::to_string(i) + "!";
-            auto request = comm.isend(content, (comm.rank() + 1) % comm.size());
-            auto message = comm.recv((comm.rank() + comm.size() - 1) % comm.size());
+            for (int n = 0; n < total; ++n)
+            {
+                tags.recv(mpi::any_source, 0);
+            }
+        }
+        else
+        {
+            auto requests = std::vector<mpi::Request>();
 
-            outp << "Proc " << " " << comm.rank() << " received '" << message << "\n";
+            for (int n = 0; n < messages; ++n)
+            {
+                requests.push_back(tags.isend(payload, 0));
+            }
+            for (auto& r : requests)
+            {
+                r.wait();
+            }
         }
+    });
+
+    outp.only(0) << "\n<--------- benchmark: flow-controlled channel --------->\n\n";
+    outp.only(0) << total << " messages of " << payload.size() << " bytes to rank 0 from " << senders << " ranks\n";
+    outp.only(0) << "    unthrottled isend ........... " << total / t_plain * 1e-3 << " k messages/s, up to "
+                 << total * payload.size() / 1024 << " kB queued at rank 0\n";
+
+    for (auto credits : {4, 16, 64})
+    {
+        auto chan = mpi::ext::channel(comm, credits);
+        auto t_channel = time([&]
+        {
+            if (comm.rank() == 0)
+            {
+                for (int n = 0; n < total; ++n)
+                {
+                    auto source = 0;
+                    chan.receive(source);
+                }
+            }
+            else
+            {
+                for (int n = 0; n < messages; ++n)
+                {
+                    chan.post(payload, 0);
+                }
+                chan.flush();
+            }
+        });
+        chan.close();
+
+        outp.only(0) << "    channel, " << std::setw(2) << credits << " credits .......... " << total / t_channel * 1e-3
+                     << " k messages/s, up to " << credits * senders * payload.size() / 1024 << " kB queued at rank 0\n";
     }
 }
 
@@ -903,121 +10090,291 @@ void example_ring()
 
 
 // ============================================================================
-void example_scatter()
+void benchmark_wait_policy()
 {
     auto comm = mpi::comm_world();
     auto outp = mpi::ext::log(comm, std::cout);
-    auto res = int();
 
-    outp.only(0) << "\n<--------- scatter --------->\n\n";
+    outp.only(0) << "\n<--------- benchmark: wait policies --------->\n\n";
 
-    if (comm.rank() == 0)
+    if (comm.size() < 2)
     {
-        auto values = std::vector<int>(comm.size());
+        outp.only(0) << "needs at least two ranks\n";
+        return;
+    }
+    auto sendbuf = 0.0, recvbuf = 0.0;
+    auto peer = comm.rank() == 0 ? 1 : 0;
+    auto send = comm.send_init(&sendbuf, 1, peer);
+    auto recv = comm.recv_init(&recvbuf, 1, peer);
+    auto active = comm.rank() < 2;
+    auto trials = 1000;
 
-        for (int n = 0; n < values.size(); ++n)
+    outp.only(0) << "ping-pong latency between ranks 0 and 1, and the CPU time rank 0 uses\n"
+                 << "while waiting 50 ms for a message\n";
+
+    for (auto policy : {mpi::WaitPolicy::native, mpi::WaitPolicy::spin, mpi::WaitPolicy::backoff, mpi::WaitPolicy::yield, mpi::WaitPolicy::sleep})
+    {
+        auto latency = 0.0, busy = 0.0;
+        comm.barrier();
+
+        if (active)
         {
-            values[n] = n;
+            auto start = MPI_Wtime();
+
+            for (int n = 0; n < trials; ++n)
+            {
+                if (comm.rank() == 0)
+                {
+                    send.start();
+                    send.wait(policy);
+                    recv.start();
+                    recv.wait(policy);
+                }
+                else
+                {
+                    recv.start();
+                    recv.wait(policy);
+                    send.start();
+                    send.wait(policy);
+                }
+            }
+            latency = (MPI_Wtime() - start) / trials / 2;
+
+            if (comm.rank() == 0)
+            {
+                auto wall = MPI_Wtime();
+                auto cpu = std::clock();
+                recv.start();
+                recv.wait(policy);
+                busy = double(std::clock() - cpu) / CLOCKS_PER_SEC / (MPI_Wtime() - wall);
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                send.start();
+                send.wait(policy);
+            }
         }
-        res = comm.scatter(0, values);
-    }
-    else
-    {
-        res = comm.scatter(0, std::vector<int>());
+        outp.only(0) << "    " << std::left << std::setw(8) << mpi::to_string(policy) << std::right << " ............ "
+                     << std::setw(8) << latency * 1e6 << " us, " << std::setw(5) << 100 * busy << "% CPU while waiting\n";
     }
-    outp << "Rank " << comm.rank() << " has res = " << res << "\n";
 }
 
 
 
 
 // ============================================================================
-void example_scatterv()
+void benchmark_persistent_all_reduce()
 {
     auto comm = mpi::comm_world();
     auto outp = mpi::ext::log(comm, std::cout);
-    auto res = std::vector<int>();
+    auto local = std::vector<double>(4, 1.0);
+    auto global = std::vector<double>();
+    auto persistent = comm.all_reduce_init(local, global);
+    auto trials = 10000;
 
-    outp.only(0) << "\n<--------- scatterv --------->\n\n";
+    comm.barrier();
+    auto start = MPI_Wtime();
 
-    if (comm.rank() == 0)
+    for (int n = 0; n < trials; ++n)
     {
-        auto values = std::vector<std::vector<int>>(comm.size());
-
-        for (int n = 0; n < values.size(); ++n)
-        {
-            values[n] = std::vector<int>(n + 1, n);
-        }
-        res = comm.scatter(0, values);
+        global = comm.all_reduce(local);
     }
-    else
+    auto t_plain = (MPI_Wtime() - start) / trials;
+
+    comm.barrier();
+    start = MPI_Wtime();
+
+    for (int n = 0; n < trials; ++n)
     {
-        res = comm.scatter(0, std::vector<std::vector<int>>());
+        persistent.start();
+        persistent.wait();
     }
-    
-    outp << "Rank " << comm.rank() << " has res.size() = " << res.size() << " and values ";
+    auto t_persistent = (MPI_Wtime() - start) / trials;
 
-    for (auto v : res)
+    outp.only(0) << "\n<--------- benchmark: persistent all_reduce --------->\n\n";
+    outp.only(0) << "all_reduce of 4 doubles on " << comm.size() << " ranks\n";
+    outp.only(0) << "    all_reduce .................. " << t_plain * 1e6 << " us\n";
+    outp.only(0) << "    all_reduce_init + start ..... " << t_persistent * 1e6 << " us\n";
+}
+
+
+
+
+// ============================================================================
+double time_all_reduce(const mpi::Communicator& comm, std::size_t bytes, mpi::Algorithm algorithm)
+{
+    auto values = std::vector<double>(bytes / sizeof(double), 1.0);
+    auto trials = std::max(2, int((std::size_t(1) << 24) / bytes));
+
+    comm.all_reduce(values, std::plus<double>(), algorithm);
+    comm.barrier();
+    auto start = MPI_Wtime();
+
+    for (int n = 0; n < trials; ++n)
     {
-        outp << v << ", ";
+        comm.all_reduce(values, std::plus<double>(), algorithm);
     }
-    outp << "\n";
+    return comm.all_reduce((MPI_Wtime() - start) / trials, mpi::max<double>());
 }
 
 
 
 
 // ============================================================================
-void example_all_gather()
+void benchmark_allreduce_algorithms()
 {
     auto comm = mpi::comm_world();
     auto outp = mpi::ext::log(comm, std::cout);
-
-    outp.only(0) << "\n<--------- all-gather --------->\n\n";
-
-    for (auto r : comm.all_gather(comm.rank()))
+    auto algorithms = {
+        mpi::Algorithm::native,
+        mpi::Algorithm::recursive_doubling,
+        mpi::Algorithm::ring,
+        mpi::Algorithm::rabenseifner,
+        mpi::Algorithm::hierarchical};
+
+    outp.only(0) << "\n<--------- benchmark: allreduce algorithms --------->\n\n";
+    outp.only(0) << "time in ms for an all_reduce of doubles on " << comm.size() << " ranks\n\n";
+    outp.only(0) << std::setw(12) << "bytes";
+
+    for (auto algorithm : algorithms)
     {
-        outp.only(0) << r << " ";
+        outp.only(0) << std::setw(20) << mpi::to_string(algorithm);
     }
     outp.only(0) << "\n";
+
+    for (std::size_t bytes = 1 << 10; bytes <= std::size_t(1) << 26; bytes *= 4)
+    {
+        auto line = std::ostringstream();
+
+        for (auto algorithm : algorithms)
+        {
+            line << std::setw(20) << time_all_reduce(comm, bytes, algorithm) * 1e3;
+        }
+        outp.only(0) << std::setw(12) << bytes << line.str() << "\n";
+    }
 }
 
 
 
 
 // ============================================================================
-void example_all_gatherv()
+/**
+ * Time each collective algorithm over a range of message sizes on the
+ * current machine and rank count, and write the fastest choices to a tuning
+ * profile, which Session loads at startup. Rules for other rank counts
+ * already in the profile are kept.
+ */
+void tool_autotune(const std::string& filename)
 {
     auto comm = mpi::comm_world();
     auto outp = mpi::ext::log(comm, std::cout);
-    auto res = comm.all_gather(std::vector<int>(comm.rank() + 1, comm.rank()));
+    auto algorithms = {
+        mpi::Algorithm::native,
+        mpi::Algorithm::recursive_doubling,
+        mpi::Algorithm::ring,
+        mpi::Algorithm::rabenseifner,
+        mpi::Algorithm::hierarchical};
 
-    outp.only(0) << "\n<--------- all-gatherv --------->\n\n";
+    outp.only(0) << "\n<--------- autotune: all_reduce on " << comm.size() << " ranks --------->\n\n";
 
-    outp << "Rank " << comm.rank() << " has res.size() = " << res.size() << "\n";
+    auto& table = mpi::tuning();
+    auto previous = mpi::Algorithm();
+    table.clear("all_reduce", comm.size());
 
-    outp.only(0) << "The final rank sent values: ";
+    for (std::size_t bytes = 1 << 10; bytes <= std::size_t(1) << 26; bytes *= 2)
+    {
+        auto fastest = mpi::Algorithm::native;
+        auto fastest_time = 0.0;
 
-    for (auto v : res.back())
+        for (auto algorithm : algorithms)
+        {
+            auto time = time_all_reduce(comm, bytes, algorithm);
+
+            if (algorithm == mpi::Algorithm::native || time < fastest_time)
+            {
+                fastest = algorithm;
+                fastest_time = time;
+            }
+        }
+        outp.only(0) << std::setw(12) << bytes << " bytes: " << mpi::to_string(fastest) << " (" << fastest_time * 1e3 << " ms)\n";
+
+        if (bytes == 1 << 10 || fastest != previous)
+        {
+            table.set("all_reduce", comm.size(), bytes == 1 << 10 ? 0 : bytes, fastest);
+            previous = fastest;
+        }
+    }
+
+    if (comm.rank() == 0)
     {
-        outp.only(0) << v << ", ";
+        std::ofstream(filename) << table.dump();
     }
-    outp.only(0) << "\n";
+    outp.only(0) << "\nwrote " << filename << ":\n\n" << table.dump();
 }
 
 
 
 
 // ============================================================================
-int main()
+int main(int argc, const char* argv[])
 {
     auto session = mpi::Session();
 
+    if (argc > 1 && std::string(argv[1]) == "bench")
+    {
+        benchmark_communicator_handles();
+        benchmark_user_reduction();
+        benchmark_reproducible_sum();
+        benchmark_allreduce_algorithms();
+        benchmark_persistent_all_reduce();
+        benchmark_dist_csr();
+        benchmark_fft3d();
+        benchmark_parallel_sort();
+        benchmark_histogram();
+        benchmark_philox();
+        benchmark_octree();
+        benchmark_graph();
+        benchmark_mailbox();
+        benchmark_channel();
+        benchmark_wait_policy();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "tune")
+    {
+        tool_autotune(argc > 2 ? argv[2] : "mpi-plus.tuning");
+        return 0;
+    }
+
     example_ring();
     example_scatter();
     example_scatterv();
     example_all_gather();
     example_all_gatherv();
+    example_gather();
+    example_scan();
+    example_user_reduction();
+    example_reproducible_sum();
+    example_allreduce_algorithms();
+    example_persistent_collectives();
+    example_pipelined_cg();
+    example_dist_csr();
+    example_fft3d();
+    example_parallel_sort();
+    example_sfc_partition();
+    example_migrate();
+    example_histogram();
+    example_philox();
+    example_load_balancer();
+    example_amr();
+    example_octree();
+    example_graph();
+    example_tag_space();
+    example_mailbox();
+    example_channel();
+    example_wait_policy();
+    example_bcast_containers();
 
     return 0;
 }